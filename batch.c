@@ -0,0 +1,282 @@
+/* Batch command tool: reads a stream of commands, one per line,
+ *
+ *   INSERT <key> <value>
+ *   SEARCH <key>
+ *   DELETE <key>
+ *
+ * and runs them against an in-memory table. Consecutive commands of the same
+ * kind are grouped and executed through the batched table operations. SEARCH
+ * prints "<key>\t<value>" when the key is found and "<key>" alone otherwise.
+ * The value of an INSERT is the rest of the line and may contain spaces.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "hash_table.h"
+#include "xmalloc.h"
+
+#define BATCH_DEFAULT_SIZE 64
+
+enum { OP_NONE, OP_INSERT, OP_SEARCH, OP_DELETE };
+
+typedef struct {
+    int op;
+    int size;
+    int count;
+    // one reusable line buffer per slot, keys and values point into them
+    char **lines;
+    size_t *line_caps;
+    const char **keys;
+    const char **values;
+    char **results;
+    FILE *out;
+    unsigned long ops;
+    unsigned long found;
+} batch;
+
+static void batch_init(batch *b, int size, FILE *out) {
+    memset(b, 0, sizeof(*b));
+    b->size = size;
+    b->lines = xcalloc((size_t) size, sizeof(char *));
+    b->line_caps = xcalloc((size_t) size, sizeof(size_t));
+    b->keys = xcalloc((size_t) size, sizeof(char *));
+    b->values = xcalloc((size_t) size, sizeof(char *));
+    b->results = xcalloc((size_t) size, sizeof(char *));
+    b->out = out;
+}
+
+static void batch_free(batch *b) {
+    int i;
+    for (i = 0; i < b->size; i++) {
+        free(b->lines[i]);
+    }
+    free(b->lines);
+    free(b->line_caps);
+    free(b->keys);
+    free(b->values);
+    free(b->results);
+}
+
+// execute the pending commands, which are all of kind b->op
+static void batch_flush(batch *b, ht_hash_table *ht) {
+    int i;
+    switch (b->op) {
+    case OP_INSERT:
+        ht_insert_batch(ht, b->keys, b->values, b->count);
+        break;
+    case OP_SEARCH:
+        ht_search_batch(ht, b->keys, b->count, b->results);
+        for (i = 0; i < b->count; i++) {
+            if (b->results[i] != NULL) {
+                fprintf(b->out, "%s\t%s\n", b->keys[i], b->results[i]);
+                b->found++;
+            } else {
+                fprintf(b->out, "%s\n", b->keys[i]);
+            }
+        }
+        break;
+    case OP_DELETE:
+        for (i = 0; i < b->count; i++) {
+            ht_delete(ht, b->keys[i]);
+        }
+        break;
+    }
+    b->ops += b->count;
+    b->count = 0;
+    b->op = OP_NONE;
+}
+
+static int parse_op(const char *word) {
+    if (strcmp(word, "INSERT") == 0) return OP_INSERT;
+    if (strcmp(word, "SEARCH") == 0) return OP_SEARCH;
+    if (strcmp(word, "DELETE") == 0) return OP_DELETE;
+    return OP_NONE;
+}
+
+/* Split the line of the next slot into a command, its key and its value.
+ * Returns the command kind, OP_NONE for blank lines and -1 on syntax errors.
+ */
+static int parse_line(char *line, const char **key, const char **value) {
+    line[strcspn(line, "\r\n")] = '\0';
+    char *word = line + strspn(line, " \t");
+    if (*word == '\0') {
+        return OP_NONE;
+    }
+    char *end = word + strcspn(word, " \t");
+    if (*end == '\0') {
+        return -1;
+    }
+    *end = '\0';
+    const int op = parse_op(word);
+    if (op == OP_NONE) {
+        return -1;
+    }
+    char *k = end + 1;
+    k += strspn(k, " \t");
+    end = k + strcspn(k, " \t");
+    if (end == k) {
+        return -1;
+    }
+    *key = k;
+    if (op != OP_INSERT) {
+        // trailing words after the key are not allowed
+        char *rest = end + strspn(end, " \t");
+        if (*rest != '\0') {
+            return -1;
+        }
+        *end = '\0';
+        return op;
+    }
+    if (*end == '\0') {
+        return -1;
+    }
+    *end = '\0';
+    *value = end + 1;
+    return op;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-b batch_size] [-o output] [-v] [input]\n"
+        "  -b  maximum number of commands per batch (default: %d)\n"
+        "  -o  file to write SEARCH results to (default: stdout)\n"
+        "  -v  print throughput statistics to stderr\n"
+        "Commands are read from 'input', or stdin when omitted.\n",
+        prog,
+        BATCH_DEFAULT_SIZE
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int batch_size = BATCH_DEFAULT_SIZE;
+    const char *out_path = NULL;
+    int verbose = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "b:o:vh")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch_size = atoi(optarg);
+            if (batch_size <= 0) {
+                fprintf(stderr, "Invalid batch size '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'o':
+            out_path = optarg;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind > 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    FILE *in = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in = fopen(argv[optind], "r");
+        if (in == NULL) {
+            perror(argv[optind]);
+            return 1;
+        }
+    }
+    FILE *out = stdout;
+    if (out_path != NULL) {
+        out = fopen(out_path, "w");
+        if (out == NULL) {
+            perror(out_path);
+            return 1;
+        }
+    }
+
+    ht_hash_table *ht = ht_new();
+    batch b;
+    batch_init(&b, batch_size, out);
+
+    const double start = now();
+    unsigned long line_no = 0;
+    int status = 0;
+    for (;;) {
+        // read into the next free slot so the line outlives the batch
+        const int slot = b.count;
+        if (getline(&b.lines[slot], &b.line_caps[slot], in) < 0) {
+            break;
+        }
+        line_no++;
+        const char *key = NULL;
+        const char *value = NULL;
+        const int op = parse_line(b.lines[slot], &key, &value);
+        if (op < 0) {
+            fprintf(stderr, "line %lu: invalid command\n", line_no);
+            status = 1;
+            continue;
+        }
+        if (op == OP_NONE) {
+            continue;
+        }
+        if (b.op != OP_NONE && b.op != op) {
+            /* Flushing reuses the slots, move the new line to the first one
+             * which is swapped with the current.
+             */
+            char *line = b.lines[slot];
+            size_t cap = b.line_caps[slot];
+            batch_flush(&b, ht);
+            b.lines[slot] = b.lines[0];
+            b.line_caps[slot] = b.line_caps[0];
+            b.lines[0] = line;
+            b.line_caps[0] = cap;
+        }
+        b.op = op;
+        b.keys[b.count] = key;
+        b.values[b.count] = value;
+        b.count++;
+        if (b.count == b.size) {
+            batch_flush(&b, ht);
+        }
+    }
+    batch_flush(&b, ht);
+    const double elapsed = now() - start;
+
+    if (ferror(in)) {
+        perror("read");
+        status = 1;
+    }
+    if (fflush(out) != 0 || ferror(out)) {
+        perror("write");
+        status = 1;
+    }
+    if (verbose) {
+        fprintf(
+            stderr,
+            "%lu ops in %.3f s (%.0f ops/s), %lu found, %d keys\n",
+            b.ops,
+            elapsed,
+            elapsed > 0 ? b.ops / elapsed : 0.0,
+            b.found,
+            ht->count
+        );
+    }
+
+    batch_free(&b);
+    ht_del_hash_table(ht);
+    if (in != stdin) fclose(in);
+    if (out != stdout) fclose(out);
+    return status;
+}
@@ -0,0 +1,901 @@
+/* Benchmark of the hash table operations.
+ *
+ * For every table size, key length and engine, a fresh table is filled with
+ * 'size' keys, each key is looked up once, a key absent from the table is
+ * looked up as many times, and every key is deleted. The table starts empty,
+ * so the inserts pay for the resizes up to the final size and the deletes for
+ * the resizes down, which are also reported on their own. Each combination
+ * is run 'warmup' times unmeasured, then 'repeat' times, and the time per
+ * operation is reported as the mean, minimum and standard deviation of the
+ * runs. The engines measured on the same keys are then compared side by side,
+ * along with the heap memory they use per key once filled.
+ *
+ * The engines are:
+ *   table   ht_insert(), ht_search() and ht_delete(), one key at a time
+ *   batch   the same table through ht_insert_batch() and ht_search_batch(),
+ *           there is no batched delete
+ *   linear  the linear probing baseline of linear_table.c
+ *   stdmap  std::unordered_map<std::string, std::string>, available when
+ *           built with -DBENCH_STDMAP and bench_stdmap.cpp
+ *
+ * With -l the table records the latency of every operation, and the
+ * percentiles of the measured runs are reported along with their longest
+ * resize, the usual cause of the slowest inserts and deletes.
+ *
+ * With -p the hardware counters of the process are read around each
+ * operation with perf_event_open(), and their mean per operation is added
+ * to each row. Counters the kernel or the hardware does not provide are
+ * shown as '-'.
+ *
+ * Built with -DHT_COUNTERS, the work of the table operations is reported
+ * after their rows: buckets read, keys compared and deleted buckets passed
+ * per operation, and the allocations per insert.
+ *
+ * With -j the results are also written to a JSON file along with a
+ * description of the machine and of the build, and with the time of every
+ * measured run so that benchcmp can tell whether two files differ
+ * significantly.
+ */
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <linux/perf_event.h>
+#include "bench_util.h"
+#include "hash_table.h"
+#include "linear_table.h"
+#include "xmalloc.h"
+
+#define BENCH_MAX_LIST 16
+#define BENCH_BATCH 64
+#define BENCH_MIN_KEY (BENCH_INDEX_CHARS + 2)
+
+enum { OP_INSERT, OP_HIT, OP_MISS, OP_DELETE, OP_RESIZE, NUM_OPS };
+
+static const char *op_names[NUM_OPS] = {"insert", "search_hit", "search_miss", "delete", "resize"};
+
+#ifdef BENCH_STDMAP
+void *stdmap_new(void);
+void stdmap_free(void *map);
+void stdmap_insert(void *map, const char *key, const char *value);
+int stdmap_search(void *map, const char *key);
+void stdmap_delete(void *map, const char *key);
+#endif
+
+// operations of a table implementation, batched ones are optional
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *t);
+    void (*insert)(void *t, const char *key, const char *value);
+    int (*search)(void *t, const char *key);
+    void (*remove)(void *t, const char *key);
+    void (*insert_batch)(void *t, const char **keys, const char **values, int n);
+    void (*search_batch)(void *t, const char **keys, int n, char **values);
+    // set for the engines backed by a ht_hash_table
+    int is_table;
+} bench_engine;
+
+static void *table_create(void) {
+    return ht_new();
+}
+
+static void table_destroy(void *t) {
+    ht_del_hash_table(t);
+}
+
+static void table_insert(void *t, const char *key, const char *value) {
+    ht_insert(t, key, value);
+}
+
+static int table_search(void *t, const char *key) {
+    return ht_search(t, key) != NULL;
+}
+
+static void table_remove(void *t, const char *key) {
+    ht_delete(t, key);
+}
+
+static void table_insert_batch(void *t, const char **keys, const char **values, int n) {
+    ht_insert_batch(t, keys, values, n);
+}
+
+static void table_search_batch(void *t, const char **keys, int n, char **values) {
+    ht_search_batch(t, keys, n, values);
+}
+
+static void *linear_create(void) {
+    return lp_new();
+}
+
+static void linear_destroy(void *t) {
+    lp_free(t);
+}
+
+static void linear_insert(void *t, const char *key, const char *value) {
+    lp_insert(t, key, value);
+}
+
+static int linear_search(void *t, const char *key) {
+    return lp_search(t, key) != NULL;
+}
+
+static void linear_remove(void *t, const char *key) {
+    lp_delete(t, key);
+}
+
+static const bench_engine engines[] = {
+    {
+        "table", table_create, table_destroy, table_insert, table_search,
+        table_remove, NULL, NULL, 1
+    },
+    {
+        "batch", table_create, table_destroy, table_insert, table_search,
+        table_remove, table_insert_batch, table_search_batch, 1
+    },
+    {
+        "linear", linear_create, linear_destroy, linear_insert, linear_search,
+        linear_remove, NULL, NULL, 0
+    },
+#ifdef BENCH_STDMAP
+    {
+        "stdmap", stdmap_new, stdmap_free, stdmap_insert, stdmap_search,
+        stdmap_delete, NULL, NULL, 0
+    },
+#endif
+};
+
+#define BENCH_NUM_ENGINES ((int) (sizeof(engines) / sizeof(engines[0])))
+
+enum {
+    PERF_CYCLES,
+    PERF_INSTRUCTIONS,
+    PERF_L1D_MISSES,
+    PERF_LLC_MISSES,
+    PERF_DTLB_MISSES,
+    PERF_BRANCH_MISSES,
+    PERF_NUM_COUNTERS
+};
+
+static const char *perf_names[PERF_NUM_COUNTERS] = {
+    "cycles", "instr", "l1d_miss", "llc_miss", "dtlb_miss", "br_miss"
+};
+
+#define PERF_CACHE_READ_MISS(cache) ((cache) | PERF_COUNT_HW_CACHE_OP_READ << 8 \
+    | PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} perf_events[PERF_NUM_COUNTERS] = {
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D)},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL)},
+    {PERF_TYPE_HW_CACHE, PERF_CACHE_READ_MISS(PERF_COUNT_HW_CACHE_DTLB)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+};
+
+// counters of the process, -1 for those that could not be opened
+typedef struct {
+    int fds[PERF_NUM_COUNTERS];
+} bench_perf;
+
+/* Measures of one run, counters per operation are negative when unavailable.
+ * Engines other than the table do not report their resizes.
+ */
+typedef struct {
+    double ns[NUM_OPS];
+    double counters[NUM_OPS][PERF_NUM_COUNTERS];
+    // heap bytes allocated by the filled table, per key
+    double bytes;
+    // counted with -DHT_COUNTERS, by table engines for the costs
+    ht_counters costs;
+    xmalloc_counters insert_allocs;
+} bench_sample;
+
+typedef struct {
+    long size;
+    int key_len;
+    char *data;
+    // keys stored in the table, then as many keys that are not
+    const char **keys;
+    const char **missing;
+} bench_keys;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Write the key of 'index' in 'key'. The first character tells stored keys
+ * from missing ones, the last ones spell the index so keys are unique, and
+ * the characters in between are pseudo-random.
+ */
+static void bench_key(char *key, int len, char kind, long index) {
+    key[0] = kind;
+    bench_random_chars(key + 1, len - 1 - BENCH_INDEX_CHARS, (uint64_t) index);
+    bench_index_chars(key + len - BENCH_INDEX_CHARS, index);
+    key[len] = '\0';
+}
+
+static void bench_keys_init(bench_keys *k, long size, int key_len) {
+    k->size = size;
+    k->key_len = key_len;
+    k->data = xmalloc((size_t) size * 2 * (key_len + 1));
+    k->keys = xmalloc((size_t) size * sizeof(char *));
+    k->missing = xmalloc((size_t) size * sizeof(char *));
+    long i;
+    for (i = 0; i < size; i++) {
+        char *key = k->data + (size_t) i * 2 * (key_len + 1);
+        bench_key(key, key_len, 'k', i);
+        bench_key(key + key_len + 1, key_len, 'm', i);
+        k->keys[i] = key;
+        k->missing[i] = key + key_len + 1;
+    }
+}
+
+static void bench_keys_free(bench_keys *k) {
+    free(k->data);
+    free(k->keys);
+    free(k->missing);
+}
+
+/* Open the hardware counters of the calling thread, counted in user space
+ * only. Returns the number of counters opened.
+ */
+static int perf_open(bench_perf *perf) {
+    int opened = 0;
+    int i;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        // counters are scaled when the hardware has to multiplex them
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        perf->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        opened += perf->fds[i] >= 0;
+    }
+    return opened;
+}
+
+static void perf_close(bench_perf *perf) {
+    int i;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        if (perf->fds[i] >= 0) {
+            close(perf->fds[i]);
+        }
+    }
+}
+
+static void perf_start(const bench_perf *perf) {
+    int i;
+    for (i = 0; perf != NULL && i < PERF_NUM_COUNTERS; i++) {
+        if (perf->fds[i] >= 0) {
+            ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+// stop the counters and store their values divided by 'n' in 'values'
+static void perf_stop(const bench_perf *perf, long n, double *values) {
+    int i;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        values[i] = -1;
+        if (perf == NULL || perf->fds[i] < 0) {
+            continue;
+        }
+        ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+        // value, time enabled, time running
+        uint64_t data[3];
+        if (read(perf->fds[i], data, sizeof(data)) != sizeof(data) || data[2] == 0) {
+            continue;
+        }
+        values[i] = (double) data[0] * ((double) data[1] / data[2]) / n;
+    }
+}
+
+/* Run every operation once over the keys and store the nanoseconds and
+ * counters per operation in 'sample'. The resize entry is the mean time of
+ * one resize, its counters are part of the inserts and deletes. The
+ * latencies recorded by the table are added to 'latency' when it is set.
+ */
+static void bench_run(
+        const bench_keys *k,
+        const bench_engine *engine,
+        const char *value,
+        bench_sample *sample,
+        const bench_perf *perf,
+        ht_latency *latency
+) {
+    double *ns = sample->ns;
+    const long n = k->size;
+    const char **values = xmalloc(BENCH_BATCH * sizeof(char *));
+    char **results = xmalloc(BENCH_BATCH * sizeof(char *));
+    int j;
+    for (j = 0; j < BENCH_BATCH; j++) {
+        values[j] = value;
+    }
+    long found = 0;
+    long i;
+    const size_t heap = bench_heap_bytes();
+    void *t = engine->create();
+    ht_hash_table *ht = engine->is_table ? t : NULL;
+    if (ht != NULL) {
+        ht_track_latency(ht, latency != NULL);
+    }
+
+    xmalloc_counters allocs;
+    xmalloc_get_counters(&allocs);
+    perf_start(perf);
+    double start = now();
+    if (engine->insert_batch == NULL) {
+        for (i = 0; i < n; i++) {
+            engine->insert(t, k->keys[i], value);
+        }
+    } else {
+        for (i = 0; i < n; i += BENCH_BATCH) {
+            const int m = n - i < BENCH_BATCH ? (int) (n - i) : BENCH_BATCH;
+            engine->insert_batch(t, k->keys + i, values, m);
+        }
+    }
+    ns[OP_INSERT] = (now() - start) * 1e9 / n;
+    perf_stop(perf, n, sample->counters[OP_INSERT]);
+    xmalloc_get_counters(&sample->insert_allocs);
+    sample->insert_allocs.mallocs -= allocs.mallocs;
+    sample->insert_allocs.callocs -= allocs.callocs;
+    sample->insert_allocs.reallocs -= allocs.reallocs;
+    sample->insert_allocs.bytes -= allocs.bytes;
+    // latency records are not part of the table
+    sample->bytes = (double) (bench_heap_bytes() - heap) / n
+        - (latency != NULL && ht != NULL ? (double) sizeof(ht_latency) / n : 0);
+
+    const char **lists[2] = {k->keys, k->missing};
+    int list;
+    for (list = 0; list < 2; list++) {
+        const char **keys = lists[list];
+        perf_start(perf);
+        start = now();
+        if (engine->search_batch == NULL) {
+            for (i = 0; i < n; i++) {
+                found += engine->search(t, keys[i]);
+            }
+        } else {
+            for (i = 0; i < n; i += BENCH_BATCH) {
+                const int m = n - i < BENCH_BATCH ? (int) (n - i) : BENCH_BATCH;
+                engine->search_batch(t, keys + i, m, results);
+                for (j = 0; j < m; j++) {
+                    found += results[j] != NULL;
+                }
+            }
+        }
+        ns[list == 0 ? OP_HIT : OP_MISS] = (now() - start) * 1e9 / n;
+        perf_stop(perf, n, sample->counters[list == 0 ? OP_HIT : OP_MISS]);
+    }
+    if (found != n) {
+        fprintf(stderr, "Found %ld keys out of %ld.\n", found, n);
+        exit(1);
+    }
+
+    perf_start(perf);
+    start = now();
+    for (i = 0; i < n; i++) {
+        engine->remove(t, k->keys[i]);
+    }
+    ns[OP_DELETE] = (now() - start) * 1e9 / n;
+    perf_stop(perf, n, sample->counters[OP_DELETE]);
+    perf_stop(NULL, n, sample->counters[OP_RESIZE]);
+
+    ns[OP_RESIZE] = ht == NULL ? -1
+        : ht->resizes > 0 ? (double) ht->resize_ns / ht->resizes : 0;
+    if (ht != NULL) {
+        sample->costs = ht->counters;
+    }
+    if (latency != NULL && ht != NULL) {
+        const ht_latency *l = ht->latency;
+        hist_merge(&latency->insert, &l->insert);
+        hist_merge(&latency->search, &l->search);
+        hist_merge(&latency->delete, &l->delete);
+        hist_merge(&latency->resize, &l->resize);
+        // the longest resize is kept in the first event
+        const unsigned long num_events = l->num_events < HT_RESIZE_EVENTS
+            ? l->num_events : HT_RESIZE_EVENTS;
+        unsigned long e;
+        for (e = 0; e < num_events; e++) {
+            if (l->events[e].duration_ns > latency->events[0].duration_ns) {
+                latency->events[0] = l->events[e];
+                latency->num_events = 1;
+            }
+        }
+    }
+    engine->destroy(t);
+    free(values);
+    free(results);
+}
+
+// select the engines named in a comma separated list, returns -1 on errors
+static int parse_engines(const char *arg, int *selected) {
+    int i;
+    for (i = 0; i < BENCH_NUM_ENGINES; i++) {
+        selected[i] = 0;
+    }
+    const char *p = arg;
+    while (*p != '\0') {
+        const size_t len = strcspn(p, ",");
+        for (i = 0; i < BENCH_NUM_ENGINES; i++) {
+            if (strlen(engines[i].name) == len && strncmp(engines[i].name, p, len) == 0) {
+                selected[i] = 1;
+                break;
+            }
+        }
+        if (i == BENCH_NUM_ENGINES) {
+            return -1;
+        }
+        p += len + (p[len] == ',');
+    }
+    return 0;
+}
+
+static void print_latency(const char *name, const histogram *h) {
+    if (h->count == 0) {
+        return;
+    }
+    printf(
+        "    %-8s latency ns: p50 %llu, p99 %llu, p99.9 %llu, p99.99 %llu, max %llu\n",
+        name,
+        (unsigned long long) hist_percentile(h, 0.5),
+        (unsigned long long) hist_percentile(h, 0.99),
+        (unsigned long long) hist_percentile(h, 0.999),
+        (unsigned long long) hist_percentile(h, 0.9999),
+        (unsigned long long) h->max
+    );
+}
+
+#ifdef HT_COUNTERS
+static void print_cost(const char *name, const ht_op_cost *cost) {
+    if (cost->calls == 0) {
+        return;
+    }
+    printf(
+        "    %-8s per call: %.2f buckets, %.2f compares, %.2f deleted\n",
+        name,
+        (double) cost->slots / cost->calls,
+        (double) cost->compares / cost->calls,
+        (double) cost->tombstones / cost->calls
+    );
+}
+
+// costs of a run of 'n' keys, the same in every run
+static void print_costs(const bench_sample *sample, long n) {
+    print_cost("insert", &sample->costs.insert);
+    print_cost("search", &sample->costs.search);
+    print_cost("delete", &sample->costs.delete);
+    const xmalloc_counters *a = &sample->insert_allocs;
+    printf(
+        "    per insert: %.2f allocations, %.1f bytes\n",
+        (double) (a->mallocs + a->callocs + a->reallocs) / n,
+        (double) a->bytes / n
+    );
+}
+#endif
+
+// write 's' as a JSON string
+static void json_string(FILE *out, const char *s) {
+    fputc('"', out);
+    for (; *s != '\0'; s++) {
+        const unsigned char c = *s;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+/* Start the JSON document with what the results depend on besides the code:
+ * the machine, the build and the options.
+ */
+static void json_begin(FILE *out, int value_size, int warmup, int repeat, int use_perf) {
+    char date[32];
+    const time_t t = time(NULL);
+    strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&t));
+    char host[256] = "";
+    gethostname(host, sizeof(host) - 1);
+    struct utsname uts;
+    if (uname(&uts) == -1) {
+        memset(&uts, 0, sizeof(uts));
+    }
+    char cpu[256] = "";
+    FILE *cpuinfo = fopen("/proc/cpuinfo", "r");
+    char line[512];
+    while (cpuinfo != NULL && fgets(line, sizeof(line), cpuinfo) != NULL) {
+        char *colon = strchr(line, ':');
+        if (strncmp(line, "model name", 10) == 0 && colon != NULL) {
+            snprintf(cpu, sizeof(cpu), "%s", colon + 2);
+            cpu[strcspn(cpu, "\n")] = '\0';
+            break;
+        }
+    }
+    if (cpuinfo != NULL) {
+        fclose(cpuinfo);
+    }
+#ifdef __OPTIMIZE__
+    const int optimized = 1;
+#else
+    const int optimized = 0;
+#endif
+
+    fprintf(out, "{\n  \"benchmark\": \"bench\",\n  \"environment\": {\n    \"date\": ");
+    json_string(out, date);
+    fprintf(out, ",\n    \"host\": ");
+    json_string(out, host);
+    fprintf(out, ",\n    \"kernel\": ");
+    json_string(out, uts.release);
+    fprintf(out, ",\n    \"machine\": ");
+    json_string(out, uts.machine);
+    fprintf(out, ",\n    \"cpu\": ");
+    json_string(out, cpu);
+    fprintf(out, ",\n    \"cpus\": %ld,\n    \"compiler\": ", sysconf(_SC_NPROCESSORS_ONLN));
+    json_string(out, __VERSION__);
+    fprintf(
+        out,
+        ",\n    \"optimized\": %s,\n    \"value_size\": %d,\n    \"warmup\": %d,"
+        "\n    \"repeat\": %d,\n    \"perf\": %s\n  },\n  \"results\": [",
+        optimized ? "true" : "false",
+        value_size,
+        warmup,
+        repeat,
+        use_perf ? "true" : "false"
+    );
+}
+
+// append the result of an operation, 'first' tells whether it needs a comma
+static void json_result(
+        FILE *out,
+        int first,
+        long size,
+        int key_len,
+        const char *engine,
+        int op,
+        const bench_sample *samples,
+        int repeat,
+        double bytes,
+        int use_perf
+) {
+    fprintf(
+        out,
+        "%s\n    {\"size\": %ld, \"key_len\": %d, \"engine\": \"%s\", \"op\": \"%s\","
+        " \"bytes_per_key\": %.1f, \"ns\": [",
+        first ? "" : ",",
+        size,
+        key_len,
+        engine,
+        op_names[op],
+        bytes
+    );
+    int i;
+    for (i = 0; i < repeat; i++) {
+        fprintf(out, "%s%.2f", i > 0 ? ", " : "", samples[i].ns[op]);
+    }
+    fprintf(out, "]");
+    int c;
+    for (c = 0; use_perf && c < PERF_NUM_COUNTERS; c++) {
+        double total = 0;
+        for (i = 0; i < repeat && total >= 0; i++) {
+            total = samples[i].counters[op][c] < 0 ? -1 : total + samples[i].counters[op][c];
+        }
+        if (total >= 0) {
+            fprintf(out, ", \"%s\": %.3f", perf_names[c], total / repeat);
+        }
+    }
+    fprintf(out, "}");
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-s sizes] [-k key_lengths] [-e engines] [-v value_size]\n"
+        "          [-w warmup] [-r repeat] [-l] [-p] [-j file]\n"
+        "  -s  comma separated numbers of keys, with an optional K or M suffix\n"
+        "      (default: 1K,10K,100K,1M)\n"
+        "  -k  comma separated key lengths, at least %d (default: 8,32,256)\n"
+        "  -e  comma separated engines among table, batch, linear and stdmap,\n"
+        "      the last one when built in (default: all of them)\n"
+        "  -v  size of the values (default: 16)\n"
+        "  -w  unmeasured runs of each combination (default: 1)\n"
+        "  -r  measured runs of each combination (default: 5)\n"
+        "  -l  report latency percentiles and the longest resize, which adds\n"
+        "      two clock reads to every operation\n"
+        "  -p  report hardware counters per operation\n"
+        "  -j  also write the results to 'file' as JSON, for benchcmp\n",
+        prog,
+        BENCH_MIN_KEY
+    );
+}
+
+int main(int argc, char *argv[]) {
+    long sizes[BENCH_MAX_LIST] = {1000, 10000, 100000, 1000000};
+    int num_sizes = 4;
+    long key_lens[BENCH_MAX_LIST] = {8, 32, 256};
+    int num_key_lens = 3;
+    int selected[BENCH_NUM_ENGINES];
+    int value_size = 16;
+    int warmup = 1;
+    int repeat = 5;
+    int track_latency = 0;
+    int use_perf = 0;
+    const char *json_path = NULL;
+
+    int opt;
+    int i;
+    for (i = 0; i < BENCH_NUM_ENGINES; i++) {
+        selected[i] = 1;
+    }
+    while ((opt = getopt(argc, argv, "s:k:e:v:w:r:lpj:h")) != -1) {
+        switch (opt) {
+        case 's':
+            num_sizes = bench_parse_list(optarg, sizes, BENCH_MAX_LIST);
+            if (num_sizes < 0) {
+                fprintf(stderr, "Invalid sizes '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'k':
+            num_key_lens = bench_parse_list(optarg, key_lens, BENCH_MAX_LIST);
+            for (i = 0; i < num_key_lens; i++) {
+                if (key_lens[i] < BENCH_MIN_KEY) {
+                    num_key_lens = -1;
+                }
+            }
+            if (num_key_lens < 0) {
+                fprintf(stderr, "Invalid key lengths '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'e':
+            if (parse_engines(optarg, selected) < 0) {
+                fprintf(stderr, "Invalid engines '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'v':
+            value_size = atoi(optarg);
+            break;
+        case 'w':
+            warmup = atoi(optarg);
+            break;
+        case 'r':
+            repeat = atoi(optarg);
+            break;
+        case 'l':
+            track_latency = 1;
+            break;
+        case 'p':
+            use_perf = 1;
+            break;
+        case 'j':
+            json_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc || value_size < 0 || warmup < 0 || repeat < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    char *value = xmalloc(value_size + 1);
+    memset(value, 'v', value_size);
+    value[value_size] = '\0';
+    bench_sample *samples = xmalloc((size_t) repeat * sizeof(bench_sample));
+    // mean ns per operation and bytes per key of each engine, for the summary
+    double means[BENCH_NUM_ENGINES][NUM_OPS];
+    double bytes[BENCH_NUM_ENGINES];
+    ht_latency *latency = xmalloc(sizeof(ht_latency));
+    bench_perf perf;
+    if (use_perf && perf_open(&perf) == 0) {
+        fprintf(
+            stderr,
+            "No hardware counter available, see /proc/sys/kernel/perf_event_paranoid.\n"
+        );
+        use_perf = 0;
+    }
+    FILE *json = NULL;
+    if (json_path != NULL) {
+        json = fopen(json_path, "w");
+        if (json == NULL) {
+            perror(json_path);
+            return 1;
+        }
+        json_begin(json, value_size, warmup, repeat, use_perf);
+    }
+    int json_first = 1;
+
+    printf(
+        "%10s %5s %-7s %-12s %12s %12s %10s %14s",
+        "size", "key", "engine", "op", "ns/op", "min_ns", "stddev", "ops/s"
+    );
+    for (i = 0; use_perf && i < PERF_NUM_COUNTERS; i++) {
+        printf(" %10s", perf_names[i]);
+    }
+    printf("\n");
+    int s;
+    for (s = 0; s < num_sizes; s++) {
+        int l;
+        for (l = 0; l < num_key_lens; l++) {
+            bench_keys keys;
+            bench_keys_init(&keys, sizes[s], (int) key_lens[l]);
+            int e;
+            for (e = 0; e < BENCH_NUM_ENGINES; e++) {
+                if (!selected[e]) {
+                    continue;
+                }
+                const bench_engine *engine = &engines[e];
+                for (i = 0; i < warmup; i++) {
+                    bench_run(&keys, engine, value, samples, NULL, NULL);
+                }
+                memset(latency, 0, sizeof(ht_latency));
+                bytes[e] = 0;
+                for (i = 0; i < repeat; i++) {
+                    bench_run(
+                        &keys,
+                        engine,
+                        value,
+                        &samples[i],
+                        use_perf ? &perf : NULL,
+                        track_latency ? latency : NULL
+                    );
+                    bytes[e] += samples[i].bytes / repeat;
+                }
+                int op;
+                for (op = 0; op < NUM_OPS; op++) {
+                    if (samples[0].ns[op] < 0) {
+                        means[e][op] = -1;
+                        continue;
+                    }
+                    double sum = 0;
+                    double min = samples[0].ns[op];
+                    for (i = 0; i < repeat; i++) {
+                        const double v = samples[i].ns[op];
+                        sum += v;
+                        min = v < min ? v : min;
+                    }
+                    const double mean = sum / repeat;
+                    means[e][op] = mean;
+                    double var = 0;
+                    for (i = 0; i < repeat; i++) {
+                        const double d = samples[i].ns[op] - mean;
+                        var += d * d;
+                    }
+                    const double stddev = repeat > 1 ? sqrt(var / (repeat - 1)) : 0;
+                    printf(
+                        "%10ld %5d %-7s %-12s %12.1f %12.1f %10.1f %14.0f",
+                        sizes[s],
+                        (int) key_lens[l],
+                        engine->name,
+                        op_names[op],
+                        mean,
+                        min,
+                        stddev,
+                        mean > 0 ? 1e9 / mean : 0.0
+                    );
+                    int c;
+                    for (c = 0; use_perf && c < PERF_NUM_COUNTERS; c++) {
+                        double total = 0;
+                        for (i = 0; i < repeat && total >= 0; i++) {
+                            total = samples[i].counters[op][c] < 0
+                                ? -1 : total + samples[i].counters[op][c];
+                        }
+                        if (total < 0) {
+                            printf(" %10s", "-");
+                        } else {
+                            printf(" %10.2f", total / repeat);
+                        }
+                    }
+                    printf("\n");
+                    if (json != NULL) {
+                        json_result(
+                            json,
+                            json_first,
+                            sizes[s],
+                            (int) key_lens[l],
+                            engine->name,
+                            op,
+                            samples,
+                            repeat,
+                            bytes[e],
+                            use_perf
+                        );
+                        json_first = 0;
+                    }
+                }
+#ifdef HT_COUNTERS
+                if (engine->is_table) {
+                    print_costs(&samples[0], sizes[s]);
+                }
+#endif
+                if (track_latency && engine->is_table) {
+                    print_latency("insert", &latency->insert);
+                    print_latency("search", &latency->search);
+                    print_latency("delete", &latency->delete);
+                    print_latency("resize", &latency->resize);
+                    if (latency->num_events > 0) {
+                        const ht_resize_event *event = &latency->events[0];
+                        printf(
+                            "    longest resize: %llu ns, %d to %d buckets, %d items moved\n",
+                            (unsigned long long) event->duration_ns,
+                            event->old_size,
+                            event->new_size,
+                            event->moved
+                        );
+                    }
+                }
+                fflush(stdout);
+            }
+            printf(
+                "%10ld %5d %-7s %14s %14s %14s %14s %10s\n",
+                sizes[s],
+                (int) key_lens[l],
+                "compare",
+                "insert/s",
+                "hit/s",
+                "miss/s",
+                "delete/s",
+                "bytes/key"
+            );
+            for (e = 0; e < BENCH_NUM_ENGINES; e++) {
+                if (!selected[e]) {
+                    continue;
+                }
+                printf(
+                    "%10s %5s %-7s %14.0f %14.0f %14.0f %14.0f %10.1f\n",
+                    "",
+                    "",
+                    engines[e].name,
+                    1e9 / means[e][OP_INSERT],
+                    1e9 / means[e][OP_HIT],
+                    1e9 / means[e][OP_MISS],
+                    1e9 / means[e][OP_DELETE],
+                    bytes[e]
+                );
+            }
+            fflush(stdout);
+            bench_keys_free(&keys);
+        }
+    }
+
+    if (use_perf) {
+        perf_close(&perf);
+    }
+    if (json != NULL) {
+        fprintf(json, "\n  ]\n}\n");
+        if (fclose(json) != 0) {
+            perror(json_path);
+            return 1;
+        }
+    }
+    free(samples);
+    free(latency);
+    free(value);
+    return 0;
+}
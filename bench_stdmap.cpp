@@ -0,0 +1,31 @@
+// std::unordered_map engine of the benchmark, linked in with -DBENCH_STDMAP
+
+#include <string>
+#include <unordered_map>
+
+typedef std::unordered_map<std::string, std::string> stdmap;
+
+extern "C" {
+
+void *stdmap_new(void) {
+    return new stdmap();
+}
+
+void stdmap_free(void *map) {
+    delete static_cast<stdmap *>(map);
+}
+
+void stdmap_insert(void *map, const char *key, const char *value) {
+    (*static_cast<stdmap *>(map))[key] = value;
+}
+
+int stdmap_search(void *map, const char *key) {
+    const stdmap *m = static_cast<stdmap *>(map);
+    return m->find(key) != m->end();
+}
+
+void stdmap_delete(void *map, const char *key) {
+    static_cast<stdmap *>(map)->erase(key);
+}
+
+}
@@ -0,0 +1,74 @@
+// key generation and argument parsing shared by the benchmarks
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <malloc.h>
+#include "bench_util.h"
+
+const char bench_alphabet[] =
+    "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
+
+// the SplitMix64 finalizer, turns consecutive numbers into unrelated ones
+uint64_t bench_mix(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+// spell 'index' in the BENCH_INDEX_CHARS characters of 'p', most significant first
+void bench_index_chars(char *p, long index) {
+    int i;
+    for (i = BENCH_INDEX_CHARS - 1; i >= 0; i--) {
+        p[i] = bench_alphabet[index % BENCH_ALPHABET_SIZE];
+        index /= BENCH_ALPHABET_SIZE;
+    }
+}
+
+/* Fill the 'len' characters of 'p' from 'seed'. A mixed number yields
+ * several characters before it is mixed again.
+ */
+void bench_random_chars(char *p, long len, uint64_t seed) {
+    uint64_t r = bench_mix(seed);
+    long i;
+    for (i = 0; i < len; i++) {
+        if (r < BENCH_ALPHABET_SIZE) {
+            r = bench_mix(r + i + 1);
+        }
+        p[i] = bench_alphabet[r % BENCH_ALPHABET_SIZE];
+        r /= BENCH_ALPHABET_SIZE;
+    }
+}
+
+/* Parse a comma separated list of at most 'max' positive numbers, each with
+ * an optional K or M suffix. Returns its length or -1.
+ */
+int bench_parse_list(const char *arg, long *list, int max) {
+    int n = 0;
+    const char *p = arg;
+    while (*p != '\0') {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || v < 1 || n == max) {
+            return -1;
+        }
+        switch (*end) {
+        case 'K': case 'k': v *= 1e3; end++; break;
+        case 'M': case 'm': v *= 1e6; end++; break;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return -1;
+        }
+        list[n++] = (long) v;
+        p = end;
+    }
+    return n;
+}
+
+// bytes allocated by malloc, mmap()ed blocks such as large bucket arrays included
+size_t bench_heap_bytes(void) {
+    const struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
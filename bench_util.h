@@ -0,0 +1,27 @@
+#ifndef BENCH_UTIL_HEADER
+#define BENCH_UTIL_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Helpers shared by the benchmarks to generate keys and parse arguments.
+ *
+ * Keys are made of the 62 letters and digits of bench_alphabet. Their index
+ * is spelled in BENCH_INDEX_CHARS characters so keys are unique, and the
+ * other characters are pseudo-random.
+ */
+
+// characters of a key holding its index, enough for 62^5 keys
+#define BENCH_INDEX_CHARS 5
+#define BENCH_MAX_INDEX 916132831L
+#define BENCH_ALPHABET_SIZE 62
+
+extern const char bench_alphabet[];
+
+uint64_t bench_mix(uint64_t x);
+void bench_index_chars(char *p, long index);
+void bench_random_chars(char *p, long len, uint64_t seed);
+int bench_parse_list(const char *arg, long *list, int max);
+size_t bench_heap_bytes(void);
+
+#endif
@@ -0,0 +1,513 @@
+/* Comparison of two result files written by bench -j.
+ *
+ * Every operation measured in both files is compared on the times of their
+ * runs: the change of the median, and the two-sided p-value of the
+ * Mann-Whitney U test that the runs of both files come from the same
+ * distribution, exact for small samples without ties and from the normal
+ * approximation otherwise. A change is flagged as a regression or an
+ * improvement when it is larger than the threshold and significant at the
+ * given level. Differences between the environments the files were
+ * recorded in are listed first, as they may explain the changes better
+ * than the code.
+ *
+ * The exit status is 2 when the files cannot be compared, 1 when there is
+ * a regression, 0 otherwise, so it can gate changes to the table.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "xmalloc.h"
+
+// largest samples the exact distribution of U is computed for
+#define CMP_EXACT_MAX 20
+
+typedef enum {
+    JSON_NULL,
+    JSON_BOOL,
+    JSON_NUMBER,
+    JSON_STRING,
+    JSON_ARRAY,
+    JSON_OBJECT
+} json_type;
+
+typedef struct json_value {
+    json_type type;
+    double number;
+    char *string;
+    // elements of arrays, values of objects along with their keys
+    struct json_value *items;
+    char **keys;
+    int count;
+} json_value;
+
+typedef struct {
+    const char *p;
+} json_parser;
+
+static void json_skip(json_parser *j) {
+    while (*j->p == ' ' || *j->p == '\t' || *j->p == '\n' || *j->p == '\r') {
+        j->p++;
+    }
+}
+
+// parse a string, the cursor on its opening quote, returns NULL on errors
+static char *json_parse_string(json_parser *j) {
+    size_t len = 0;
+    size_t cap = 16;
+    char *s = xmalloc(cap);
+    j->p++;
+    while (*j->p != '"') {
+        char c = *j->p++;
+        if (c == '\0') {
+            free(s);
+            return NULL;
+        }
+        if (c == '\\') {
+            c = *j->p++;
+            switch (c) {
+            case 'n': c = '\n'; break;
+            case 't': c = '\t'; break;
+            case 'r': c = '\r'; break;
+            case 'b': c = '\b'; break;
+            case 'f': c = '\f'; break;
+            case 'u': {
+                // only what bench writes, control characters
+                unsigned code;
+                if (sscanf(j->p, "%4x", &code) != 1) {
+                    free(s);
+                    return NULL;
+                }
+                j->p += 4;
+                c = code < 0x80 ? (char) code : '?';
+                break;
+            }
+            case '"': case '\\': case '/':
+                break;
+            default:
+                free(s);
+                return NULL;
+            }
+        }
+        if (len + 1 == cap) {
+            cap *= 2;
+            s = xrealloc(s, cap);
+        }
+        s[len++] = c;
+    }
+    j->p++;
+    s[len] = '\0';
+    return s;
+}
+
+static int json_parse(json_parser *j, json_value *v);
+
+// parse the elements of an array or the members of an object
+static int json_parse_items(json_parser *j, json_value *v, char close) {
+    int cap = 0;
+    j->p++;
+    json_skip(j);
+    if (*j->p == close) {
+        j->p++;
+        return 0;
+    }
+    for (;;) {
+        if (v->count == cap) {
+            cap = cap > 0 ? cap * 2 : 8;
+            v->items = xrealloc(v->items, cap * sizeof(json_value));
+            if (v->type == JSON_OBJECT) {
+                v->keys = xrealloc(v->keys, cap * sizeof(char *));
+            }
+        }
+        json_skip(j);
+        if (v->type == JSON_OBJECT) {
+            if (*j->p != '"') {
+                return -1;
+            }
+            v->keys[v->count] = json_parse_string(j);
+            if (v->keys[v->count] == NULL) {
+                return -1;
+            }
+            json_skip(j);
+            if (*j->p++ != ':') {
+                free(v->keys[v->count]);
+                return -1;
+            }
+        }
+        if (json_parse(j, &v->items[v->count]) == -1) {
+            if (v->type == JSON_OBJECT) {
+                free(v->keys[v->count]);
+            }
+            return -1;
+        }
+        v->count++;
+        json_skip(j);
+        if (*j->p == close) {
+            j->p++;
+            return 0;
+        }
+        if (*j->p++ != ',') {
+            return -1;
+        }
+    }
+}
+
+static int json_parse(json_parser *j, json_value *v) {
+    memset(v, 0, sizeof(json_value));
+    json_skip(j);
+    switch (*j->p) {
+    case '{':
+        v->type = JSON_OBJECT;
+        return json_parse_items(j, v, '}');
+    case '[':
+        v->type = JSON_ARRAY;
+        return json_parse_items(j, v, ']');
+    case '"':
+        v->type = JSON_STRING;
+        v->string = json_parse_string(j);
+        return v->string != NULL ? 0 : -1;
+    }
+    if (strncmp(j->p, "true", 4) == 0 || strncmp(j->p, "null", 4) == 0) {
+        v->type = *j->p == 't' ? JSON_BOOL : JSON_NULL;
+        v->number = *j->p == 't';
+        j->p += 4;
+        return 0;
+    }
+    if (strncmp(j->p, "false", 5) == 0) {
+        v->type = JSON_BOOL;
+        j->p += 5;
+        return 0;
+    }
+    char *end;
+    v->type = JSON_NUMBER;
+    v->number = strtod(j->p, &end);
+    if (end == j->p) {
+        return -1;
+    }
+    j->p = end;
+    return 0;
+}
+
+static void json_free(json_value *v) {
+    int i;
+    for (i = 0; i < v->count; i++) {
+        json_free(&v->items[i]);
+        if (v->type == JSON_OBJECT) {
+            free(v->keys[i]);
+        }
+    }
+    free(v->items);
+    free(v->keys);
+    free(v->string);
+}
+
+// member 'key' of object 'v' with type 'type', NULL when there is none
+static const json_value *json_get(const json_value *v, const char *key, json_type type) {
+    int i;
+    for (i = 0; v != NULL && v->type == JSON_OBJECT && i < v->count; i++) {
+        if (strcmp(v->keys[i], key) == 0) {
+            return v->items[i].type == type ? &v->items[i] : NULL;
+        }
+    }
+    return NULL;
+}
+
+// read and parse the file at 'path', returns -1 with a message on errors
+static int json_load(const char *path, json_value *v) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    size_t len = 0;
+    size_t cap = 4096;
+    char *data = xmalloc(cap);
+    size_t n;
+    while ((n = fread(data + len, 1, cap - len - 1, f)) > 0) {
+        len += n;
+        if (len + 1 == cap) {
+            cap *= 2;
+            data = xrealloc(data, cap);
+        }
+    }
+    fclose(f);
+    data[len] = '\0';
+    json_parser j = {data};
+    int ret = json_parse(&j, v);
+    json_skip(&j);
+    if (ret == -1 || *j.p != '\0' || json_get(v, "results", JSON_ARRAY) == NULL) {
+        fprintf(stderr, "%s: not a bench result file.\n", path);
+        if (ret == 0) {
+            json_free(v);
+        }
+        ret = -1;
+    }
+    free(data);
+    return ret;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return x < y ? -1 : x > y;
+}
+
+static double median(const double *sorted, int n) {
+    return n % 2 == 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+}
+
+/* Number of orderings of 'm' and 'n' values in which the U statistic of the
+ * first ones is at most 'u', through counts[m][n][u] = counts[m - 1][n][u - n]
+ * + counts[m][n - 1][u], the largest value belonging to either sample.
+ */
+static double mann_whitney_exact(int m, int n, int u) {
+    const int max_u = m * n;
+    double *counts = xcalloc((size_t) (m + 1) * (n + 1) * (max_u + 1), sizeof(double));
+#define COUNT(i, j, k) counts[((size_t) (i) * (n + 1) + (j)) * (max_u + 1) + (k)]
+    int i, j, k;
+    for (i = 0; i <= m; i++) {
+        for (j = 0; j <= n; j++) {
+            for (k = 0; k <= i * j; k++) {
+                if (i == 0 || j == 0) {
+                    COUNT(i, j, k) = 1;
+                    continue;
+                }
+                COUNT(i, j, k) = (k >= j ? COUNT(i - 1, j, k - j) : 0)
+                    + (k <= i * (j - 1) ? COUNT(i, j - 1, k) : 0);
+            }
+        }
+    }
+    double at_most = 0;
+    for (k = 0; k <= u; k++) {
+        at_most += COUNT(m, n, k);
+    }
+#undef COUNT
+    free(counts);
+    return at_most;
+}
+
+/* Two-sided p-value of the Mann-Whitney U test between the samples 'a' and
+ * 'b', sorted.
+ */
+static double mann_whitney(const double *a, int m, const double *b, int n) {
+    // U of 'a' counts the pairs where its value is larger, ties counting half
+    double u = 0;
+    int ties = 0;
+    int i, j;
+    for (i = 0; i < m; i++) {
+        for (j = 0; j < n; j++) {
+            u += a[i] > b[j] ? 1 : a[i] == b[j] ? 0.5 : 0;
+            ties += a[i] == b[j];
+        }
+    }
+    const double mean = m * n / 2.0;
+    const double small = u < mean ? u : m * n - u;
+    if (ties == 0 && m <= CMP_EXACT_MAX && n <= CMP_EXACT_MAX) {
+        double total = 1;
+        // binomial(m + n, m) orderings
+        for (i = 1; i <= m; i++) {
+            total = total * (n + i) / i;
+        }
+        const double p = 2 * mann_whitney_exact(m, n, (int) small) / total;
+        return p < 1 ? p : 1;
+    }
+    // normal approximation, with the variance corrected for tied values
+    double *all = xmalloc((m + n) * sizeof(double));
+    memcpy(all, a, m * sizeof(double));
+    memcpy(all + m, b, n * sizeof(double));
+    qsort(all, m + n, sizeof(double), compare_doubles);
+    double tie_sum = 0;
+    for (i = 0; i < m + n; i = j) {
+        for (j = i; j < m + n && all[j] == all[i]; j++);
+        const double t = j - i;
+        tie_sum += t * t * t - t;
+    }
+    free(all);
+    const double total = m + n;
+    const double var = m * n / 12.0 * ((total + 1) - tie_sum / (total * (total - 1)));
+    if (var <= 0) {
+        return 1;
+    }
+    const double z = (mean - small - 0.5) / sqrt(var);
+    return z > 0 ? erfc(z / sqrt(2)) : 1;
+}
+
+// times of the runs of 'result' sorted in 'ns', returns their number
+static int result_runs(const json_value *result, double **ns) {
+    const json_value *runs = json_get(result, "ns", JSON_ARRAY);
+    if (runs == NULL || runs->count == 0) {
+        return 0;
+    }
+    *ns = xmalloc(runs->count * sizeof(double));
+    int i;
+    for (i = 0; i < runs->count; i++) {
+        (*ns)[i] = runs->items[i].number;
+    }
+    qsort(*ns, runs->count, sizeof(double), compare_doubles);
+    return runs->count;
+}
+
+// whether 'a' and 'b' are results of the same size, key length, engine and op
+static int same_result(const json_value *a, const json_value *b) {
+    static const char *numbers[] = {"size", "key_len"};
+    static const char *strings[] = {"engine", "op"};
+    int i;
+    for (i = 0; i < 2; i++) {
+        const json_value *x = json_get(a, numbers[i], JSON_NUMBER);
+        const json_value *y = json_get(b, numbers[i], JSON_NUMBER);
+        if (x == NULL || y == NULL || x->number != y->number) {
+            return 0;
+        }
+        x = json_get(a, strings[i], JSON_STRING);
+        y = json_get(b, strings[i], JSON_STRING);
+        if (x == NULL || y == NULL || strcmp(x->string, y->string) != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void print_environment_changes(const json_value *old_env, const json_value *new_env) {
+    int i;
+    for (i = 0; new_env != NULL && i < new_env->count; i++) {
+        const char *key = new_env->keys[i];
+        if (strcmp(key, "date") == 0) {
+            continue;
+        }
+        const json_value *v = &new_env->items[i];
+        const json_value *old = json_get(old_env, key, v->type);
+        if (v->type == JSON_STRING && (old == NULL || strcmp(old->string, v->string) != 0)) {
+            printf("# %s: %s -> %s\n", key, old != NULL ? old->string : "?", v->string);
+        } else if (v->type != JSON_STRING && (old == NULL || old->number != v->number)) {
+            printf("# %s: ", key);
+            if (old != NULL) {
+                printf("%g", old->number);
+            } else {
+                printf("?");
+            }
+            printf(" -> %g\n", v->number);
+        }
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-t threshold] [-a alpha] [-q] old.json new.json\n"
+        "  -t  smallest change of the median in percent flagged (default: 5)\n"
+        "  -a  significance level of the changes flagged (default: 0.05)\n"
+        "  -q  only print the flagged changes\n",
+        prog
+    );
+}
+
+int main(int argc, char *argv[]) {
+    double threshold = 5;
+    double alpha = 0.05;
+    int quiet = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "t:a:qh")) != -1) {
+        switch (opt) {
+        case 't':
+            threshold = atof(optarg);
+            break;
+        case 'a':
+            alpha = atof(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 2;
+        }
+    }
+    if (argc - optind != 2 || threshold < 0 || alpha <= 0 || alpha >= 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    json_value old_doc, new_doc;
+    if (json_load(argv[optind], &old_doc) == -1) {
+        return 2;
+    }
+    if (json_load(argv[optind + 1], &new_doc) == -1) {
+        json_free(&old_doc);
+        return 2;
+    }
+
+    print_environment_changes(
+        json_get(&old_doc, "environment", JSON_OBJECT),
+        json_get(&new_doc, "environment", JSON_OBJECT)
+    );
+    const json_value *old_results = json_get(&old_doc, "results", JSON_ARRAY);
+    const json_value *new_results = json_get(&new_doc, "results", JSON_ARRAY);
+    printf(
+        "%10s %5s %-7s %-12s %12s %12s %8s %9s\n",
+        "size", "key", "engine", "op", "old_ns", "new_ns", "change", "p"
+    );
+    int regressions = 0;
+    int improvements = 0;
+    int compared = 0;
+    int i, k;
+    for (i = 0; i < new_results->count; i++) {
+        const json_value *result = &new_results->items[i];
+        const json_value *old = NULL;
+        for (k = 0; k < old_results->count && old == NULL; k++) {
+            if (same_result(&old_results->items[k], result)) {
+                old = &old_results->items[k];
+            }
+        }
+        double *a = NULL;
+        double *b = NULL;
+        const int m = old != NULL ? result_runs(old, &a) : 0;
+        const int n = m > 0 ? result_runs(result, &b) : 0;
+        if (n == 0) {
+            free(a);
+            continue;
+        }
+        compared++;
+        const double old_median = median(a, m);
+        const double new_median = median(b, n);
+        const double change = old_median > 0 ? (new_median - old_median) * 100 / old_median : 0;
+        const double p = mann_whitney(a, m, b, n);
+        const char *flag = "";
+        if (p < alpha && change > threshold) {
+            flag = "regression";
+            regressions++;
+        } else if (p < alpha && change < -threshold) {
+            flag = "improvement";
+            improvements++;
+        }
+        if (!quiet || flag[0] != '\0') {
+            printf(
+                "%10.0f %5.0f %-7s %-12s %12.1f %12.1f %+7.1f%% %9.4f%s%s\n",
+                json_get(result, "size", JSON_NUMBER)->number,
+                json_get(result, "key_len", JSON_NUMBER)->number,
+                json_get(result, "engine", JSON_STRING)->string,
+                json_get(result, "op", JSON_STRING)->string,
+                old_median,
+                new_median,
+                change,
+                p,
+                flag[0] != '\0' ? " " : "",
+                flag
+            );
+        }
+        free(a);
+        free(b);
+    }
+    printf(
+        "# %d compared, %d regressions, %d improvements (threshold %.1f%%, alpha %g)\n",
+        compared,
+        regressions,
+        improvements,
+        threshold,
+        alpha
+    );
+    json_free(&old_doc);
+    json_free(&new_doc);
+    return regressions > 0;
+}
@@ -0,0 +1,160 @@
+/* Compact binary protocol of the key-value server.
+ *
+ * Requests and replies are an 8 byte header followed by a body, integers are
+ * in network byte order:
+ *
+ *   request  opcode:8 reserved:8 key_length:16 value_length:32 key value
+ *   reply    opcode:8 status:8 reserved:16 value_length:32 value
+ *
+ * GET answers with the value of the key, SET stores the value of the request,
+ * DEL deletes the key and NOOP only answers, which lets a client find the end
+ * of a pipeline. The status of a reply is OK, NOT_FOUND when the key does not
+ * exist or ERROR, with the error message as its value. Large values are
+ * written to the socket straight from the table, see server_out_value().
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "buffer.h"
+#include "server_internal.h"
+
+#define BIN_HEADER_SIZE 8
+#define BIN_MAX_VALUE (512L << 20)
+
+enum { BIN_NOOP, BIN_GET, BIN_SET, BIN_DEL };
+enum { BIN_OK, BIN_NOT_FOUND, BIN_ERROR };
+
+static void bin_header(buffer *b, int opcode, int status, size_t len) {
+    const unsigned char header[BIN_HEADER_SIZE] = {
+        (unsigned char) opcode,
+        (unsigned char) status,
+        0,
+        0,
+        (unsigned char) (len >> 24),
+        (unsigned char) (len >> 16),
+        (unsigned char) (len >> 8),
+        (unsigned char) len
+    };
+    buf_append(b, header, sizeof(header));
+}
+
+static void bin_error(server_conn *c, int opcode, const char *msg) {
+    const size_t len = strlen(msg);
+    bin_header(&c->out, opcode, BIN_ERROR, len);
+    buf_append(&c->out, msg, len);
+}
+
+static void bin_cmd_get(server *srv, server_conn *c, const char *key) {
+    const char *value = server_lookup(srv, key);
+    if (value == NULL) {
+        bin_header(&c->out, BIN_GET, BIN_NOT_FOUND, 0);
+        return;
+    }
+    const size_t len = strlen(value);
+    bin_header(&c->out, BIN_GET, BIN_OK, len);
+    server_out_value(srv, c, value, len);
+}
+
+/* Execute the request at the start of 'buf'. Returns the number of bytes
+ * consumed, or 0 if the request is incomplete.
+ */
+static long bin_process_command(
+        server *srv,
+        server_conn *c,
+        const char *buf,
+        size_t len
+) {
+    if (len < BIN_HEADER_SIZE) {
+        return 0;
+    }
+    const unsigned char *h = (const unsigned char *) buf;
+    const int opcode = h[0];
+    const size_t key_len = (size_t) h[2] << 8 | h[3];
+    const size_t value_len = (size_t) h[4] << 24 | (size_t) h[5] << 16
+        | (size_t) h[6] << 8 | h[7];
+    if (value_len > BIN_MAX_VALUE) {
+        // the rest of the stream cannot be trusted
+        bin_error(c, opcode, "value too large");
+        c->closing = 1;
+        return (long) len;
+    }
+    const size_t total = BIN_HEADER_SIZE + key_len + value_len;
+    if (len < total) {
+        return 0;
+    }
+    const char *key = buf + BIN_HEADER_SIZE;
+    const char *value = key + key_len;
+
+    if (opcode == BIN_NOOP) {
+        bin_header(&c->out, opcode, BIN_OK, 0);
+        return (long) total;
+    }
+    if (opcode != BIN_GET && opcode != BIN_SET && opcode != BIN_DEL) {
+        bin_error(c, opcode, "unknown opcode");
+        return (long) total;
+    }
+    // keys and values are stored as C strings
+    if (memchr(key, '\0', key_len) != NULL || memchr(value, '\0', value_len) != NULL) {
+        bin_error(c, opcode, "keys and values must not contain NUL bytes");
+        return (long) total;
+    }
+    if (opcode != BIN_GET && srv->cfg->replicaof != NULL) {
+        bin_error(c, opcode, "read only replica");
+        return (long) total;
+    }
+    buffer *args = &srv->args;
+    args->pos = args->len = 0;
+    buf_append(args, key, key_len);
+    buf_append(args, "", 1);
+    buf_append(args, value, value_len);
+    buf_append(args, "", 1);
+    key = args->data;
+    value = args->data + key_len + 1;
+
+    if (srv->shards != NULL && c != srv->scratch) {
+        const int shard = server_shard_of(srv, key);
+        if (shard != srv->shard_id) {
+            server_forward(srv, c, shard, buf, total);
+            c->routed = 1;
+            return (long) total;
+        }
+    }
+    switch (opcode) {
+    case BIN_GET:
+        bin_cmd_get(srv, c, key);
+        break;
+    case BIN_SET:
+        server_store(srv, key, value);
+        bin_header(&c->out, opcode, BIN_OK, 0);
+        break;
+    case BIN_DEL:
+        if (server_lookup(srv, key) != NULL && server_remove(srv, key)) {
+            bin_header(&c->out, opcode, BIN_OK, 0);
+        } else {
+            bin_header(&c->out, opcode, BIN_NOT_FOUND, 0);
+        }
+        break;
+    }
+    return (long) total;
+}
+
+// execute every complete binary request in the input buffer
+void bin_process_input(server *srv, server_conn *c) {
+    const int sharded = srv->shards != NULL && c != srv->scratch;
+    while (!c->closing && server_pending_replies(c) < SERVER_MAX_INFLIGHT
+            && buf_pending(&c->in) > 0) {
+        const size_t mark = buf_pending(&c->out);
+        c->routed = 0;
+        const long n = bin_process_command(
+            srv, c, c->in.data + c->in.pos, buf_pending(&c->in)
+        );
+        if (n == 0) {
+            break;
+        }
+        buf_consume(&c->in, n);
+        if (sharded && !c->routed) {
+            server_local_reply(c, mark);
+        }
+    }
+}
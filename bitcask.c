@@ -0,0 +1,502 @@
+// log-structured value store indexed by a hash table
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "bitcask.h"
+
+#define BC_HEADER_SIZE 8
+
+// return the path of a file of segment 'id' with extension 'ext'
+static char *bc_path(bc_store *bc, int id, const char *ext) {
+    char *path = xmalloc(strlen(bc->dir) + 32);
+    sprintf(path, "%s/%09d.%s", bc->dir, id, ext);
+    return path;
+}
+
+// return a file descriptor for segment 'id', opening it with 'flags' if needed
+static int bc_open_segment(bc_store *bc, int id, int flags) {
+    if (id >= bc->fds_size) {
+        const int old_size = bc->fds_size;
+        bc->fds_size = id + 16;
+        bc->fds = xrealloc(bc->fds, bc->fds_size * sizeof(int));
+        int i;
+        for (i = old_size; i < bc->fds_size; i++) {
+            bc->fds[i] = -1;
+        }
+    }
+    if (bc->fds[id] < 0) {
+        char *path = bc_path(bc, id, "data");
+        bc->fds[id] = open(path, flags, 0644);
+        free(path);
+    }
+    return bc->fds[id];
+}
+
+// read segment 'id', a missing segment is an error rather than created
+static int bc_fd(bc_store *bc, int id) {
+    return bc_open_segment(bc, id, O_RDONLY);
+}
+
+// append to the active segment, creating it if needed
+static int bc_active_fd(bc_store *bc) {
+    return bc_open_segment(bc, bc->active_id, O_RDWR | O_CREAT | O_APPEND);
+}
+
+static void bc_close_segment(bc_store *bc, int id) {
+    if (id < bc->fds_size && bc->fds[id] >= 0) {
+        close(bc->fds[id]);
+        bc->fds[id] = -1;
+    }
+}
+
+static int bc_write_all(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        const ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int bc_read_all(int fd, void *buf, size_t len, int64_t offset) {
+    char *p = buf;
+    while (len > 0) {
+        const ssize_t n = pread(fd, p, len, offset);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// append a record to the segment open as 'fd'
+static int bc_append(
+        int fd,
+        const char *key,
+        const char *value,
+        uint32_t value_len
+) {
+    const uint32_t key_len = strlen(key);
+    const size_t data_len = value_len == BC_TOMBSTONE ? 0 : value_len;
+    const size_t len = BC_HEADER_SIZE + key_len + data_len;
+    /* The record is assembled in one buffer and written with a single call so
+     * a crash cannot leave a header without its key.
+     */
+    char *buf = xmalloc(len);
+    memcpy(buf, &key_len, sizeof(key_len));
+    memcpy(buf + 4, &value_len, sizeof(value_len));
+    memcpy(buf + BC_HEADER_SIZE, key, key_len);
+    memcpy(buf + BC_HEADER_SIZE + key_len, value, data_len);
+    const int err = bc_write_all(fd, buf, len);
+    free(buf);
+    return err;
+}
+
+static void bc_encode_location(
+        char *buf,
+        int segment,
+        int64_t offset,
+        uint32_t length
+) {
+    sprintf(buf, "%d %" PRId64 " %" PRIu32, segment, offset, length);
+}
+
+static int bc_decode_location(
+        const char *s,
+        int *segment,
+        int64_t *offset,
+        uint32_t *length
+) {
+    return sscanf(s, "%d %" SCNd64 " %" SCNu32, segment, offset, length) == 3
+        ? 0 : -1;
+}
+
+/* Point the index at a new location for 'key', the record previously holding
+ * its value becomes dead.
+ */
+static void bc_index_set(
+        bc_store *bc,
+        const char *key,
+        int segment,
+        int64_t offset,
+        uint32_t length
+) {
+    char location[64];
+    const char *old = ht_search(bc->index, key);
+    int old_segment;
+    int64_t old_offset;
+    uint32_t old_length;
+    if (old != NULL
+            && bc_decode_location(old, &old_segment, &old_offset, &old_length) == 0) {
+        bc->dead_bytes += BC_HEADER_SIZE + strlen(key) + old_length;
+    }
+    bc_encode_location(location, segment, offset, length);
+    ht_insert(bc->index, key, location);
+}
+
+static void bc_index_delete(bc_store *bc, const char *key) {
+    const char *old = ht_search(bc->index, key);
+    int old_segment;
+    int64_t old_offset;
+    uint32_t old_length;
+    if (old != NULL
+            && bc_decode_location(old, &old_segment, &old_offset, &old_length) == 0) {
+        bc->dead_bytes += BC_HEADER_SIZE + strlen(key) + old_length;
+        ht_delete(bc->index, key);
+    }
+}
+
+// rebuild the index entries of a segment from its hint file
+static int bc_load_hint(bc_store *bc, int id) {
+    char *path = bc_path(bc, id, "hint");
+    FILE *fp = fopen(path, "rb");
+    free(path);
+    if (fp == NULL) {
+        return -1;
+    }
+    uint32_t key_len, value_len;
+    uint64_t offset;
+    char *key = NULL;
+    while (fread(&key_len, sizeof(key_len), 1, fp) == 1
+            && fread(&value_len, sizeof(value_len), 1, fp) == 1
+            && fread(&offset, sizeof(offset), 1, fp) == 1) {
+        key = xrealloc(key, key_len + 1);
+        if (fread(key, 1, key_len, fp) != key_len) {
+            break;
+        }
+        key[key_len] = '\0';
+        bc_index_set(bc, key, id, offset, value_len);
+        bc->total_bytes += BC_HEADER_SIZE + key_len + value_len;
+    }
+    free(key);
+    fclose(fp);
+    return 0;
+}
+
+// rebuild the index entries of a segment by scanning its records
+static int bc_load_data(bc_store *bc, int id) {
+    const int fd = bc_fd(bc, id);
+    if (fd < 0) {
+        return -1;
+    }
+    int64_t offset = 0;
+    uint32_t header[2];
+    char *key = NULL;
+    while (bc_read_all(fd, header, BC_HEADER_SIZE, offset) == 0) {
+        const uint32_t key_len = header[0];
+        const uint32_t value_len = header[1];
+        key = xrealloc(key, key_len + 1);
+        // a truncated record at the end of a segment is ignored
+        if (bc_read_all(fd, key, key_len, offset + BC_HEADER_SIZE) < 0) {
+            break;
+        }
+        key[key_len] = '\0';
+        const int64_t value_offset = offset + BC_HEADER_SIZE + key_len;
+        if (value_len == BC_TOMBSTONE) {
+            bc_index_delete(bc, key);
+            bc->dead_bytes += BC_HEADER_SIZE + key_len;
+            offset = value_offset;
+        } else {
+            bc_index_set(bc, key, id, value_offset, value_len);
+            offset = value_offset + value_len;
+        }
+    }
+    bc->total_bytes += offset;
+    free(key);
+    return 0;
+}
+
+static int bc_id_cmp(const void *a, const void *b) {
+    return *(const int *) a - *(const int *) b;
+}
+
+// return the sorted ids of the segments in the store directory
+static int *bc_list_segments(bc_store *bc, int *n) {
+    DIR *dir = opendir(bc->dir);
+    if (dir == NULL) {
+        return NULL;
+    }
+    int cap = 16;
+    int *ids = xmalloc(cap * sizeof(int));
+    *n = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        int id;
+        char ext[8];
+        if (sscanf(entry->d_name, "%d.%7s", &id, ext) == 2
+                && strcmp(ext, "data") == 0) {
+            if (*n == cap) {
+                cap *= 2;
+                ids = xrealloc(ids, cap * sizeof(int));
+            }
+            ids[(*n)++] = id;
+        }
+    }
+    closedir(dir);
+    qsort(ids, *n, sizeof(int), bc_id_cmp);
+    return ids;
+}
+
+/* Open the store in directory 'dir', creating it if needed. Segments are
+ * replayed from oldest to newest so later records override earlier ones, and
+ * writes go to a new active segment.
+ */
+bc_store *bc_open(const char *dir) {
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+        return NULL;
+    }
+    bc_store *bc = xcalloc(1, sizeof(bc_store));
+    bc->dir = xstrdup(dir);
+    bc->index = ht_new();
+    bc->segment_size = BC_SEGMENT_SIZE;
+
+    int n;
+    int *ids = bc_list_segments(bc, &n);
+    if (ids == NULL) {
+        bc_close(bc);
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < n; i++) {
+        if (bc_load_hint(bc, ids[i]) < 0 && bc_load_data(bc, ids[i]) < 0) {
+            free(ids);
+            bc_close(bc);
+            return NULL;
+        }
+    }
+    bc->active_id = n > 0 ? ids[n - 1] + 1 : 0;
+    free(ids);
+    if (bc_active_fd(bc) < 0) {
+        bc_close(bc);
+        return NULL;
+    }
+    return bc;
+}
+
+void bc_close(bc_store *bc) {
+    int i;
+    for (i = 0; i < bc->fds_size; i++) {
+        if (bc->fds[i] >= 0) close(bc->fds[i]);
+    }
+    free(bc->fds);
+    ht_del_hash_table(bc->index);
+    free(bc->dir);
+    free(bc);
+}
+
+// start a new active segment with id 'id'
+static int bc_roll(bc_store *bc, int id) {
+    bc_close_segment(bc, bc->active_id);
+    bc->active_id = id;
+    bc->active_size = 0;
+    return bc_active_fd(bc) < 0 ? -1 : 0;
+}
+
+static int bc_append_active(
+        bc_store *bc,
+        const char *key,
+        const char *value,
+        uint32_t value_len,
+        int64_t *value_offset
+) {
+    if (bc->active_size >= bc->segment_size
+            && bc_roll(bc, bc->active_id + 1) < 0) {
+        return -1;
+    }
+    const uint32_t key_len = strlen(key);
+    if (bc_append(bc_active_fd(bc), key, value, value_len) < 0) {
+        return -1;
+    }
+    const int64_t len = BC_HEADER_SIZE + key_len
+        + (value_len == BC_TOMBSTONE ? 0 : value_len);
+    *value_offset = bc->active_size + BC_HEADER_SIZE + key_len;
+    bc->active_size += len;
+    bc->total_bytes += len;
+    return 0;
+}
+
+// store a key:value pair
+int bc_put(bc_store *bc, const char *key, const char *value) {
+    const uint32_t value_len = strlen(value);
+    int64_t offset;
+    if (bc_append_active(bc, key, value, value_len, &offset) < 0) {
+        return -1;
+    }
+    bc_index_set(bc, key, bc->active_id, offset, value_len);
+    return 0;
+}
+
+// return a copy of the value associated with a key, or NULL if it does not exist
+char *bc_get(bc_store *bc, const char *key) {
+    const char *location = ht_search(bc->index, key);
+    int segment;
+    int64_t offset;
+    uint32_t length;
+    if (location == NULL
+            || bc_decode_location(location, &segment, &offset, &length) < 0) {
+        return NULL;
+    }
+    const int fd = bc_fd(bc, segment);
+    char *value = xmalloc((size_t) length + 1);
+    if (fd < 0 || bc_read_all(fd, value, length, offset) < 0) {
+        free(value);
+        return NULL;
+    }
+    value[length] = '\0';
+    return value;
+}
+
+// delete a key, or do nothing if it does not exist
+int bc_delete(bc_store *bc, const char *key) {
+    if (ht_search(bc->index, key) == NULL) {
+        return 0;
+    }
+    int64_t offset;
+    if (bc_append_active(bc, key, "", BC_TOMBSTONE, &offset) < 0) {
+        return -1;
+    }
+    bc_index_delete(bc, key);
+    bc->dead_bytes += BC_HEADER_SIZE + strlen(key);
+    return 0;
+}
+
+static int bc_write_hint(FILE *fp, const char *key, uint32_t value_len, uint64_t offset) {
+    const uint32_t key_len = strlen(key);
+    return fwrite(&key_len, sizeof(key_len), 1, fp) == 1
+        && fwrite(&value_len, sizeof(value_len), 1, fp) == 1
+        && fwrite(&offset, sizeof(offset), 1, fp) == 1
+        && fwrite(key, 1, key_len, fp) == key_len ? 0 : -1;
+}
+
+/* Rewrite the live records of all immutable segments into a single segment.
+ *
+ * Segment ids order records by age, so the merged segment must sit between
+ * the segments it replaces and the active one: the active segment is rolled
+ * to 'active_id + 2' and the merge output takes 'active_id + 1'. Records the
+ * index does not point to, including tombstones, are dropped since every
+ * older segment they could refer to is removed by the merge.
+ */
+int bc_merge(bc_store *bc) {
+    const int last_id = bc->active_id;
+    const int merge_id = last_id + 1;
+    if (bc_roll(bc, last_id + 2) < 0) {
+        return -1;
+    }
+
+    char *data_path = bc_path(bc, merge_id, "data");
+    char *hint_path = bc_path(bc, merge_id, "hint.tmp");
+    const int out = open(data_path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    FILE *hint = fopen(hint_path, "wb");
+    ht_hash_table *moved = ht_new();
+    int n = 0;
+    int *ids = bc_list_segments(bc, &n);
+    int err = out < 0 || hint == NULL || ids == NULL ? -1 : 0;
+
+    int64_t out_size = 0;
+    char *key = NULL;
+    char *value = NULL;
+    int i;
+    for (i = 0; i < n && err == 0 && ids[i] <= last_id; i++) {
+        const int fd = bc_fd(bc, ids[i]);
+        int64_t offset = 0;
+        uint32_t header[2];
+        while (err == 0 && fd >= 0
+                && bc_read_all(fd, header, BC_HEADER_SIZE, offset) == 0) {
+            const uint32_t key_len = header[0];
+            const uint32_t value_len = header[1];
+            const uint32_t data_len = value_len == BC_TOMBSTONE ? 0 : value_len;
+            key = xrealloc(key, key_len + 1);
+            value = xrealloc(value, (size_t) data_len + 1);
+            if (bc_read_all(fd, key, key_len, offset + BC_HEADER_SIZE) < 0
+                    || bc_read_all(fd, value, data_len,
+                                   offset + BC_HEADER_SIZE + key_len) < 0) {
+                break;
+            }
+            key[key_len] = '\0';
+            value[data_len] = '\0';
+            const int64_t value_offset = offset + BC_HEADER_SIZE + key_len;
+            offset = value_offset + data_len;
+
+            // a record is live if the index points to it
+            const char *location = ht_search(bc->index, key);
+            int segment;
+            int64_t live_offset;
+            uint32_t length;
+            if (value_len == BC_TOMBSTONE || location == NULL
+                    || bc_decode_location(location, &segment, &live_offset, &length) < 0
+                    || segment != ids[i] || live_offset != value_offset) {
+                continue;
+            }
+            const int64_t new_offset = out_size + BC_HEADER_SIZE + key_len;
+            char new_location[64];
+            bc_encode_location(new_location, merge_id, new_offset, value_len);
+            if (bc_append(out, key, value, value_len) < 0
+                    || bc_write_hint(hint, key, value_len, new_offset) < 0) {
+                err = -1;
+            }
+            ht_insert(moved, key, new_location);
+            out_size += BC_HEADER_SIZE + key_len + value_len;
+        }
+    }
+    free(key);
+    free(value);
+
+    if (hint != NULL && fclose(hint) != 0) {
+        err = -1;
+    }
+    if (out >= 0 && (fsync(out) < 0 || close(out) < 0)) {
+        err = -1;
+    }
+    char *final_hint_path = bc_path(bc, merge_id, "hint");
+    if (err == 0 && rename(hint_path, final_hint_path) < 0) {
+        err = -1;
+    }
+
+    if (err == 0) {
+        // the index now points into the merged segment
+        int index = 0;
+        ht_item *item;
+        while ((item = ht_next_item(moved, &index)) != NULL) {
+            ht_insert(bc->index, item->key, item->value);
+        }
+        for (i = 0; i < n && ids[i] <= last_id; i++) {
+            char *path = bc_path(bc, ids[i], "data");
+            bc_close_segment(bc, ids[i]);
+            unlink(path);
+            free(path);
+            path = bc_path(bc, ids[i], "hint");
+            unlink(path);
+            free(path);
+        }
+        // the new active segment is empty so no dead record is left
+        bc->total_bytes = out_size;
+        bc->dead_bytes = 0;
+    } else {
+        unlink(data_path);
+        unlink(hint_path);
+    }
+
+    ht_del_hash_table(moved);
+    free(ids);
+    free(final_hint_path);
+    free(hint_path);
+    free(data_path);
+    return err;
+}
@@ -0,0 +1,46 @@
+#ifndef BITCASK_HEADER
+#define BITCASK_HEADER
+
+#include <stdint.h>
+#include "hash_table.h"
+
+/* Log-structured value store.
+ *
+ * Values are appended to segment files named "<id>.data" in a directory and
+ * an in-memory hash table maps each key to the location of its latest value,
+ * encoded as the string "<segment> <offset> <length>". Each record is:
+ *   uint32 key_len | uint32 value_len | key | value
+ * A value_len of BC_TOMBSTONE marks a deleted key and has no value bytes.
+ *
+ * Merging rewrites the live records of all immutable segments into a single
+ * segment, along with a "<id>.hint" file listing its keys and value
+ * locations so the index can be rebuilt without reading the values:
+ *   uint32 key_len | uint32 value_len | uint64 offset | key
+ */
+
+#define BC_TOMBSTONE UINT32_MAX
+#define BC_SEGMENT_SIZE (64L << 20)
+
+typedef struct {
+    char *dir;
+    ht_hash_table *index;
+    // file descriptors of opened segments, indexed by segment id
+    int *fds;
+    int fds_size;
+    int active_id;
+    int64_t active_size;
+    // a new active segment is started when this size is reached
+    int64_t segment_size;
+    // bytes used by overwritten or deleted records, reclaimed by bc_merge()
+    int64_t dead_bytes;
+    int64_t total_bytes;
+} bc_store;
+
+bc_store *bc_open(const char *dir);
+void bc_close(bc_store *bc);
+int bc_put(bc_store *bc, const char *key, const char *value);
+char *bc_get(bc_store *bc, const char *key);
+int bc_delete(bc_store *bc, const char *key);
+int bc_merge(bc_store *bc);
+
+#endif
@@ -0,0 +1,82 @@
+// growable byte buffer used for network input and output
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <stdlib.h>
+#include "xmalloc.h"
+#include "buffer.h"
+
+void buf_init(buffer *b) {
+    b->data = NULL;
+    b->pos = 0;
+    b->len = 0;
+    b->cap = 0;
+}
+
+void buf_free(buffer *b) {
+    free(b->data);
+    buf_init(b);
+}
+
+// make room for at least 'n' more bytes after 'len'
+void buf_reserve(buffer *b, size_t n) {
+    if (b->len + n <= b->cap) {
+        return;
+    }
+    // reclaim consumed bytes before growing
+    buf_compact(b);
+    if (b->len + n <= b->cap) {
+        return;
+    }
+    size_t cap = b->cap == 0 ? 4096 : b->cap;
+    while (cap < b->len + n) {
+        cap *= 2;
+    }
+    b->data = xrealloc(b->data, cap);
+    b->cap = cap;
+}
+
+void buf_append(buffer *b, const void *data, size_t n) {
+    buf_reserve(b, n);
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+void buf_append_str(buffer *b, const char *s) {
+    buf_append(b, s, strlen(s));
+}
+
+void buf_printf(buffer *b, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return;
+    }
+    buf_reserve(b, (size_t) n + 1);
+    va_start(ap, fmt);
+    vsnprintf(b->data + b->len, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    b->len += n;
+}
+
+// mark 'n' pending bytes as consumed
+void buf_consume(buffer *b, size_t n) {
+    b->pos += n;
+    if (b->pos == b->len) {
+        b->pos = 0;
+        b->len = 0;
+    }
+}
+
+// move the pending bytes to the start of the buffer
+void buf_compact(buffer *b) {
+    if (b->pos == 0) {
+        return;
+    }
+    memmove(b->data, b->data + b->pos, b->len - b->pos);
+    b->len -= b->pos;
+    b->pos = 0;
+}
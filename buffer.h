@@ -0,0 +1,28 @@
+#ifndef BUFFER_HEADER
+#define BUFFER_HEADER
+
+#include <stddef.h>
+
+/* Growable byte buffer. Bytes are appended at 'len' and consumed from 'pos',
+ * so data[pos..len) holds the pending bytes.
+ */
+typedef struct {
+    char *data;
+    size_t pos;
+    size_t len;
+    size_t cap;
+} buffer;
+
+void buf_init(buffer *b);
+void buf_free(buffer *b);
+void buf_reserve(buffer *b, size_t n);
+void buf_append(buffer *b, const void *data, size_t n);
+void buf_append_str(buffer *b, const char *s);
+void buf_printf(buffer *b, const char *fmt, ...);
+void buf_consume(buffer *b, size_t n);
+void buf_compact(buffer *b);
+
+// number of pending bytes
+#define buf_pending(b) ((b)->len - (b)->pos)
+
+#endif
@@ -0,0 +1,349 @@
+/* Client of a cluster of key-value servers.
+ *
+ * Every node has a non-blocking connection with its own output and input
+ * buffers. An operation appends the command of each key to the output of its
+ * node, remembering which command of the operation it is, then polls all the
+ * nodes at once until every one of them answered all of its commands.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "xmalloc.h"
+#include "fnv.h"
+#include "buffer.h"
+#include "resp.h"
+#include "net.h"
+#include "cluster.h"
+
+#define CLUSTER_READ_SIZE 16384
+
+typedef struct {
+    int fd;
+    buffer out;
+    buffer in;
+    // commands of the current operation waiting for a reply, in order
+    int *waiting;
+    int num_waiting;
+    int waiting_cap;
+    int replied;
+} cluster_node;
+
+// reply to one command of an operation, 'value' is set for bulk replies
+typedef struct {
+    int type;
+    long long integer;
+    char *value;
+} cluster_result;
+
+struct cluster {
+    int num_nodes;
+    cluster_node *nodes;
+    cluster_result *results;
+    int results_cap;
+    struct pollfd *pfds;
+    // node of each entry of pfds
+    int *polled;
+};
+
+/* Jump consistent hash of Lamping and Veach: walks the buckets a key jumps to
+ * as the number of buckets grows, and returns the last one below num_buckets.
+ */
+static int cluster_jump(uint64_t key, int num_buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31) / (double) ((key >> 33) + 1)));
+    }
+    return (int) b;
+}
+
+int cluster_node_of(const cluster *cl, const char *key) {
+    return cluster_jump(fnv1a_64(key, strlen(key)), cl->num_nodes);
+}
+
+/* Connect to every node of the cluster, each one given as "host:port" or as
+ * the path of a Unix socket. Returns NULL if one of them cannot be reached.
+ */
+cluster *cluster_connect(const char **addrs, int num_nodes) {
+    if (num_nodes <= 0) {
+        return NULL;
+    }
+    cluster *cl = xcalloc(1, sizeof(cluster));
+    cl->num_nodes = num_nodes;
+    cl->nodes = xcalloc((size_t) num_nodes, sizeof(cluster_node));
+    cl->pfds = xcalloc((size_t) num_nodes, sizeof(struct pollfd));
+    cl->polled = xcalloc((size_t) num_nodes, sizeof(int));
+    int i;
+    for (i = 0; i < num_nodes; i++) {
+        cl->nodes[i].fd = -1;
+    }
+    for (i = 0; i < num_nodes; i++) {
+        cluster_node *node = &cl->nodes[i];
+        node->fd = net_connect(addrs[i]);
+        if (node->fd < 0) {
+            cluster_free(cl);
+            return NULL;
+        }
+        fcntl(node->fd, F_SETFL, fcntl(node->fd, F_GETFL, 0) | O_NONBLOCK);
+        // fails harmlessly on Unix sockets
+        int one = 1;
+        setsockopt(node->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    return cl;
+}
+
+void cluster_free(cluster *cl) {
+    int i;
+    for (i = 0; i < cl->num_nodes; i++) {
+        cluster_node *node = &cl->nodes[i];
+        if (node->fd >= 0) {
+            close(node->fd);
+        }
+        buf_free(&node->out);
+        buf_free(&node->in);
+        free(node->waiting);
+    }
+    for (i = 0; i < cl->results_cap; i++) {
+        free(cl->results[i].value);
+    }
+    free(cl->nodes);
+    free(cl->results);
+    free(cl->pfds);
+    free(cl->polled);
+    free(cl);
+}
+
+// start an operation of 'n' commands, all failed until they get a reply
+static void cluster_begin(cluster *cl, int n) {
+    int i;
+    if (n > cl->results_cap) {
+        cl->results = xrealloc(cl->results, n * sizeof(cluster_result));
+        for (i = cl->results_cap; i < n; i++) {
+            cl->results[i].value = NULL;
+        }
+        cl->results_cap = n;
+    }
+    for (i = 0; i < n; i++) {
+        cl->results[i].type = RESP_REPLY_ERROR;
+        cl->results[i].integer = 0;
+        free(cl->results[i].value);
+        cl->results[i].value = NULL;
+    }
+    for (i = 0; i < cl->num_nodes; i++) {
+        cl->nodes[i].num_waiting = 0;
+        cl->nodes[i].replied = 0;
+    }
+}
+
+// queue command 'op' of the operation on the node of 'key'
+static void cluster_append(cluster *cl, int op, const char *key, int argc, const char **argv) {
+    cluster_node *node = &cl->nodes[cluster_node_of(cl, key)];
+    if (node->fd < 0) {
+        return;
+    }
+    resp_array(&node->out, argc);
+    int i;
+    for (i = 0; i < argc; i++) {
+        resp_bulk(&node->out, argv[i], strlen(argv[i]));
+    }
+    if (node->num_waiting == node->waiting_cap) {
+        node->waiting_cap = node->waiting_cap == 0 ? 16 : node->waiting_cap * 2;
+        node->waiting = xrealloc(node->waiting, node->waiting_cap * sizeof(int));
+    }
+    node->waiting[node->num_waiting++] = op;
+}
+
+// drop a node whose connection failed, its remaining commands stay failed
+static void cluster_fail(cluster_node *node) {
+    close(node->fd);
+    node->fd = -1;
+    node->num_waiting = node->replied;
+    node->out.pos = node->out.len = 0;
+    node->in.pos = node->in.len = 0;
+}
+
+// match the replies received by a node with its commands
+static int cluster_read_replies(cluster *cl, cluster_node *node) {
+    buffer *in = &node->in;
+    while (node->replied < node->num_waiting) {
+        resp_reply reply;
+        const long used = resp_parse_reply(in->data + in->pos, buf_pending(in), &reply);
+        if (used == 0) {
+            break;
+        }
+        // none of the commands sent by the client answers with an array
+        if (used < 0 || reply.type == RESP_REPLY_ARRAY) {
+            return -1;
+        }
+        cluster_result *result = &cl->results[node->waiting[node->replied++]];
+        result->type = reply.type;
+        result->integer = reply.integer;
+        if (reply.type == RESP_REPLY_BULK) {
+            result->value = xmalloc(reply.len + 1);
+            memcpy(result->value, reply.str, reply.len);
+            result->value[reply.len] = '\0';
+        }
+        buf_consume(in, used);
+    }
+    return 0;
+}
+
+static int cluster_io_failed(ssize_t n) {
+    return n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR);
+}
+
+// send the queued commands and wait until every node answered them
+static void cluster_exec(cluster *cl) {
+    for (;;) {
+        int num_polled = 0;
+        int i;
+        for (i = 0; i < cl->num_nodes; i++) {
+            cluster_node *node = &cl->nodes[i];
+            if (node->fd < 0 || node->replied == node->num_waiting) {
+                continue;
+            }
+            cl->pfds[num_polled].fd = node->fd;
+            cl->pfds[num_polled].events = POLLIN;
+            if (buf_pending(&node->out) > 0) {
+                cl->pfds[num_polled].events |= POLLOUT;
+            }
+            cl->pfds[num_polled].revents = 0;
+            cl->polled[num_polled++] = i;
+        }
+        if (num_polled == 0) {
+            return;
+        }
+        if (poll(cl->pfds, num_polled, -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            for (i = 0; i < num_polled; i++) {
+                cluster_fail(&cl->nodes[cl->polled[i]]);
+            }
+            return;
+        }
+
+        for (i = 0; i < num_polled; i++) {
+            cluster_node *node = &cl->nodes[cl->polled[i]];
+            const short revents = cl->pfds[i].revents;
+            if (revents & POLLOUT) {
+                buffer *out = &node->out;
+                const ssize_t n = send(
+                    node->fd, out->data + out->pos, buf_pending(out), MSG_NOSIGNAL
+                );
+                if (cluster_io_failed(n)) {
+                    cluster_fail(node);
+                    continue;
+                }
+                if (n > 0) {
+                    buf_consume(out, n);
+                }
+            }
+            if (revents & (POLLIN | POLLHUP | POLLERR)) {
+                buffer *in = &node->in;
+                buf_reserve(in, CLUSTER_READ_SIZE);
+                const ssize_t n = recv(node->fd, in->data + in->len, in->cap - in->len, 0);
+                if (cluster_io_failed(n)) {
+                    cluster_fail(node);
+                    continue;
+                }
+                if (n > 0) {
+                    in->len += n;
+                }
+                if (cluster_read_replies(cl, node) < 0) {
+                    cluster_fail(node);
+                }
+            }
+        }
+    }
+}
+
+/* Get the values of 'n' keys. Each value is stored in 'values' and must be
+ * freed by the caller, missing keys get NULL. Returns 0, or -1 if a node
+ * failed to answer, in which case its keys get NULL too.
+ */
+int cluster_mget(cluster *cl, const char **keys, int n, char **values) {
+    cluster_begin(cl, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        const char *argv[] = {"GET", keys[i]};
+        cluster_append(cl, i, keys[i], 2, argv);
+    }
+    cluster_exec(cl);
+    int status = 0;
+    for (i = 0; i < n; i++) {
+        cluster_result *result = &cl->results[i];
+        values[i] = result->value;
+        result->value = NULL;
+        if (result->type != RESP_REPLY_BULK && result->type != RESP_REPLY_NIL) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+// set the values of 'n' keys, returns -1 if one of them could not be set
+int cluster_mset(cluster *cl, const char **keys, const char **values, int n) {
+    cluster_begin(cl, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        const char *argv[] = {"SET", keys[i], values[i]};
+        cluster_append(cl, i, keys[i], 3, argv);
+    }
+    cluster_exec(cl);
+    int status = 0;
+    for (i = 0; i < n; i++) {
+        if (cl->results[i].type != RESP_REPLY_STATUS) {
+            status = -1;
+        }
+    }
+    return status;
+}
+
+// delete 'n' keys, returns the number of keys removed or -1 on errors
+long cluster_mdel(cluster *cl, const char **keys, int n) {
+    cluster_begin(cl, n);
+    int i;
+    for (i = 0; i < n; i++) {
+        const char *argv[] = {"DEL", keys[i]};
+        cluster_append(cl, i, keys[i], 2, argv);
+    }
+    cluster_exec(cl);
+    long removed = 0;
+    for (i = 0; i < n; i++) {
+        if (cl->results[i].type != RESP_REPLY_INTEGER) {
+            return -1;
+        }
+        removed += cl->results[i].integer;
+    }
+    return removed;
+}
+
+// returns 1 and stores the value to free in '*value' if the key exists
+int cluster_get(cluster *cl, const char *key, char **value) {
+    if (cluster_mget(cl, &key, 1, value) < 0) {
+        return -1;
+    }
+    return *value != NULL;
+}
+
+int cluster_set(cluster *cl, const char *key, const char *value) {
+    return cluster_mset(cl, &key, &value, 1);
+}
+
+// returns 1 if the key was removed, 0 if it did not exist
+int cluster_del(cluster *cl, const char *key) {
+    return (int) cluster_mdel(cl, &key, 1);
+}
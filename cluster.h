@@ -0,0 +1,30 @@
+#ifndef CLUSTER_HEADER
+#define CLUSTER_HEADER
+
+/* Client of a cluster of key-value servers.
+ *
+ * Keys are spread over the nodes with a jump consistent hash of their FNV-1a
+ * hash, so growing the cluster from N to N + 1 nodes moves only 1 / (N + 1)
+ * of the keys, all of them to the new node. The nodes must be given in the
+ * same order by every client. Multi-key operations pipeline the commands of
+ * each node on its connection and wait for the replies of all the nodes in
+ * parallel.
+ *
+ * Once a node fails, every later operation touching one of its keys fails.
+ */
+
+typedef struct cluster cluster;
+
+cluster *cluster_connect(const char **addrs, int num_nodes);
+void cluster_free(cluster *cl);
+int cluster_node_of(const cluster *cl, const char *key);
+
+int cluster_get(cluster *cl, const char *key, char **value);
+int cluster_set(cluster *cl, const char *key, const char *value);
+int cluster_del(cluster *cl, const char *key);
+
+int cluster_mget(cluster *cl, const char **keys, int n, char **values);
+int cluster_mset(cluster *cl, const char **keys, const char **values, int n);
+long cluster_mdel(cluster *cl, const char **keys, int n);
+
+#endif
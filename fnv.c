@@ -0,0 +1,23 @@
+// FNV-1a hashes
+
+#include "fnv.h"
+
+uint32_t fnv1a_32(const char *s, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+uint64_t fnv1a_64(const char *s, size_t len) {
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char) s[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
@@ -0,0 +1,15 @@
+#ifndef FNV_HEADER
+#define FNV_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* FNV-1a hashes of 'len' bytes, used where a simple hash independent of the
+ * table's own is needed: trace records, the linear probing baseline, the
+ * benchmarks spreading keys, and the server's shards and cluster nodes
+ * owning keys.
+ */
+uint32_t fnv1a_32(const char *s, size_t len);
+uint64_t fnv1a_64(const char *s, size_t len);
+
+#endif
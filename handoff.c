@@ -0,0 +1,268 @@
+// hand a hash table over to another process through a sealed memory file
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "handoff.h"
+
+#define HANDOFF_HEADER_SIZE 16
+
+static int handoff_address(const char *socket_path, struct sockaddr_un *addr) {
+    if (strlen(socket_path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, socket_path);
+    return 0;
+}
+
+// copy the table into a new sealed memory file and return its descriptor
+static int handoff_snapshot(ht_hash_table *ht) {
+    size_t len = HANDOFF_HEADER_SIZE;
+    int index = 0;
+    ht_item *item;
+    while ((item = ht_next_item(ht, &index)) != NULL) {
+        len += 8 + strlen(item->key) + strlen(item->value);
+    }
+
+    const int fd = memfd_create("ht_handoff", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd < 0) {
+        return -1;
+    }
+    if (ftruncate(fd, len) < 0) {
+        close(fd);
+        return -1;
+    }
+    char *map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+
+    const uint32_t header[4] = {
+        HANDOFF_MAGIC, (uint32_t) ht->size_index, (uint32_t) ht->count, 0
+    };
+    memcpy(map, header, HANDOFF_HEADER_SIZE);
+    char *p = map + HANDOFF_HEADER_SIZE;
+    index = 0;
+    while ((item = ht_next_item(ht, &index)) != NULL) {
+        const uint32_t key_len = strlen(item->key);
+        const uint32_t value_len = strlen(item->value);
+        memcpy(p, &key_len, 4);
+        memcpy(p + 4, &value_len, 4);
+        memcpy(p + 8, item->key, key_len);
+        memcpy(p + 8 + key_len, item->value, value_len);
+        p += 8 + key_len + value_len;
+    }
+    munmap(map, len);
+
+    // the receiver can trust the snapshot not to change under its mapping
+    if (fcntl(fd, F_ADD_SEALS,
+              F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Listen for the next process on 'socket_path' and return the listening
+ * socket, or -1 on error. The caller keeps serving and polls the socket for
+ * a connection before calling ht_handoff_send(), then closes it and unlinks
+ * 'socket_path'.
+ */
+int ht_handoff_listen(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (handoff_address(socket_path, &addr) < 0) {
+        return -1;
+    }
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        return -1;
+    }
+    unlink(socket_path);
+    if (bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(listen_fd, 1) < 0) {
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
+
+/* Accept a process connecting to 'listen_fd' and send it a snapshot of the
+ * table. The snapshot is taken once the process has connected, so the
+ * caller must stop changing the table before the call: writes made after it
+ * are not handed off. Blocks until a process connects.
+ */
+int ht_handoff_send(ht_hash_table *ht, int listen_fd) {
+    int conn_fd;
+    do {
+        conn_fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+    } while (conn_fd < 0 && errno == EINTR);
+    if (conn_fd < 0) {
+        return -1;
+    }
+    const int memfd = handoff_snapshot(ht);
+    if (memfd < 0) {
+        close(conn_fd);
+        return -1;
+    }
+
+    // the descriptor travels as ancillary data alongside a single byte
+    char byte = 'H';
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &memfd, sizeof(int));
+
+    ssize_t n;
+    do {
+        n = sendmsg(conn_fd, &msg, MSG_NOSIGNAL);
+    } while (n < 0 && errno == EINTR);
+    close(conn_fd);
+    close(memfd);
+    return n == 1 ? 0 : -1;
+}
+
+// receive a memory file descriptor from the process listening on 'socket_path'
+static int handoff_receive_fd(const char *socket_path) {
+    struct sockaddr_un addr;
+    if (handoff_address(socket_path, &addr) < 0) {
+        return -1;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    char byte;
+    struct iovec iov = {&byte, 1};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    do {
+        n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+    } while (n < 0 && errno == EINTR);
+    close(fd);
+
+    struct cmsghdr *cmsg = n == 1 ? CMSG_FIRSTHDR(&msg) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET
+            || cmsg->cmsg_type != SCM_RIGHTS) {
+        return -1;
+    }
+    int memfd;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+    return memfd;
+}
+
+/* Rebuild a table from the snapshot in 'memfd'. The snapshot comes from
+ * another process, so it is only mapped once sealed against changes and its
+ * header is checked against its length. Returns NULL if it is invalid.
+ */
+ht_hash_table *ht_handoff_load(int memfd) {
+    const int seals = fcntl(memfd, F_GET_SEALS);
+    const int required = F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+    if (seals < 0 || (seals & required) != required) {
+        return NULL;
+    }
+    const off_t len = lseek(memfd, 0, SEEK_END);
+    if (len < HANDOFF_HEADER_SIZE) {
+        return NULL;
+    }
+    const char *map = mmap(NULL, len, PROT_READ, MAP_PRIVATE, memfd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    uint32_t header[4];
+    memcpy(header, map, HANDOFF_HEADER_SIZE);
+    const uint32_t count = header[2];
+    if (header[0] != HANDOFF_MAGIC || header[1] > HANDOFF_MAX_SIZE_INDEX
+            || count > (len - HANDOFF_HEADER_SIZE) / 8) {
+        munmap((void *) map, len);
+        return NULL;
+    }
+    /* Tables shrink below 10% load, so a sender has at most ten buckets per
+     * key past the initial size. A larger size is not trusted, the table
+     * grows as needed instead.
+     */
+    int size_index = (int) header[1];
+    while (size_index > 0 && (50L << size_index) > 20L * count) {
+        size_index--;
+    }
+
+    ht_hash_table *ht = ht_new_sized(size_index);
+    const char *p = map + HANDOFF_HEADER_SIZE;
+    const char *end = map + len;
+    char *key = NULL;
+    char *value = NULL;
+    uint32_t i;
+    for (i = 0; i < count; i++) {
+        uint32_t key_len, value_len;
+        if (end - p < 8) break;
+        memcpy(&key_len, p, 4);
+        memcpy(&value_len, p + 4, 4);
+        if ((size_t) (end - p - 8) < (size_t) key_len + value_len) break;
+        key = xrealloc(key, key_len + 1);
+        value = xrealloc(value, value_len + 1);
+        memcpy(key, p + 8, key_len);
+        memcpy(value, p + 8 + key_len, value_len);
+        key[key_len] = '\0';
+        value[value_len] = '\0';
+        ht_insert(ht, key, value);
+        p += 8 + key_len + value_len;
+    }
+    free(key);
+    free(value);
+    munmap((void *) map, len);
+
+    if (i != count) {
+        ht_del_hash_table(ht);
+        return NULL;
+    }
+    return ht;
+}
+
+/* Connect to a process sending a table with ht_handoff_send() and rebuild the
+ * table from its snapshot. Returns NULL if the handoff failed.
+ */
+ht_hash_table *ht_handoff_receive(const char *socket_path) {
+    const int memfd = handoff_receive_fd(socket_path);
+    if (memfd < 0) {
+        return NULL;
+    }
+    ht_hash_table *ht = ht_handoff_load(memfd);
+    close(memfd);
+    return ht;
+}
@@ -0,0 +1,39 @@
+#ifndef HANDOFF_HEADER
+#define HANDOFF_HEADER
+
+#include "hash_table.h"
+
+/* Hand a hash table over to another process on the same host.
+ *
+ * The sending process copies the table into an anonymous memory file
+ * (memfd), seals it and passes its file descriptor over a Unix socket. The
+ * receiving process maps the file and rebuilds the table at the same size, so
+ * no resize happens while loading. The handoff is not instant: both the copy
+ * and the rebuild take time proportional to the number of keys, only without
+ * the parsing and system calls of reading the keys back from a file or a
+ * replica. The memory file holds a header:
+ *   uint32 magic | uint32 size_index | uint32 count | uint32 reserved
+ * followed by 'count' records:
+ *   uint32 key_len | uint32 value_len | key | value
+ *
+ * The old process listens with ht_handoff_listen() and keeps serving until
+ * the new one connects. It then stops changing the table and calls
+ * ht_handoff_send(), which snapshots the table as of that moment.
+ *
+ * The server restarts this way when given a handoff socket: the new process
+ * takes the tables over before listening, and the old one, once stopped,
+ * closes its listeners and hands them over if the new process is waiting.
+ * Clients are not served from the stop of the old process until the new one
+ * has rebuilt the tables.
+ */
+
+#define HANDOFF_MAGIC 0x48544831
+// largest size index whose bucket count fits an int
+#define HANDOFF_MAX_SIZE_INDEX 25
+
+int ht_handoff_listen(const char *socket_path);
+int ht_handoff_send(ht_hash_table *ht, int listen_fd);
+ht_hash_table *ht_handoff_receive(const char *socket_path);
+ht_hash_table *ht_handoff_load(int memfd);
+
+#endif
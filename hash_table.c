@@ -1,15 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <math.h>
+#include <time.h>
 #include "xmalloc.h"
 #include "hash_table.h"
 #include "prime.h"
+#include "probes.h"
 
 // parameters for the hashing algorithm
 static const int HT_PRIME_1 = 151;
 static const int HT_PRIME_2 = 163;
 
+// keys taking at least this many buckets fire the long_chain probe
+#define HT_LONG_CHAIN HT_PROBE_HIST
+#define HT_CHAIN_PROBE(ht, key, buckets) do { \
+    if ((buckets) >= HT_LONG_CHAIN) \
+        HT_PROBE(long_chain, ht, key, buckets); \
+} while (0)
+
+#ifdef HT_COUNTERS
+#define HT_COUNT(ht, op, field, n) ((ht)->counters.op.field += (n))
+#define HT_COUNT_PROBES(ht, n) \
+    ((ht)->counters.search_probes[((n) < HT_PROBE_HIST ? (n) : HT_PROBE_HIST) - 1]++)
+#else
+#define HT_COUNT(ht, op, field, n) ((void) 0)
+#define HT_COUNT_PROBES(ht, n) ((void) 0)
+#endif
+
 /* Deleting from an open-addressed hash table is complicated because the item
  * we wish to delete may be part of a collision chain. Removing it from the
  * table would break the chain and make finding items in the tail of the chain
@@ -25,21 +42,40 @@ static ht_item *ht_new_item(const char *k, const char *v) {
     return i;
 }
 
+// release a value leaving the table
+static void ht_free_value(ht_hash_table *ht, char *value) {
+    if (ht->free_value != NULL) {
+        ht->free_value(value, ht->free_value_arg);
+    } else {
+        free(value);
+    }
+}
+
 // delete an item
-static void ht_del_item(ht_item *i) {
+static void ht_del_item(ht_hash_table *ht, ht_item *i) {
+    ht->data_bytes -= strlen(i->key) + strlen(i->value) + 2;
     free(i->key);
-    free(i->value);
+    ht_free_value(ht, i->value);
     free(i);
 }
 
 //create a new hash table at a particular size
-static ht_hash_table *ht_new_sized(const int size_index) {
+ht_hash_table *ht_new_sized(const int size_index) {
     ht_hash_table *ht = xmalloc(sizeof(ht_hash_table));
     ht->size_index = size_index;
     const int base_size = 50 << ht->size_index;
     ht->size = next_prime(base_size);
     ht->count = 0;
     ht->items = xcalloc((size_t)ht->size, sizeof(ht_item*));
+    ht->free_value = NULL;
+    ht->free_value_arg = NULL;
+    ht->deleted = 0;
+    ht->resizes = 0;
+    ht->resize_ns = 0;
+    ht->data_bytes = 0;
+    memset(&ht->counters, 0, sizeof(ht->counters));
+    ht->latency = NULL;
+    ht->trace = NULL;
     return ht;
 }
 
@@ -53,15 +89,65 @@ void ht_del_hash_table(ht_hash_table *ht) {
     int i;
     for (i = 0; i < ht->size; i++) {
         ht_item *item = ht->items[i];
-        if (item != NULL) {
-            ht_del_item(item);
+        if (item != NULL && item != &HT_DELETED_ITEM) {
+            ht_del_item(ht, item);
         }
     }
     free(ht->items);
+    free(ht->latency);
     free(ht);
 }
 
-// resize the hash table
+/* Record the latency of every insert, search and delete, and the duration and
+ * sizes of every resize, in ht->latency. Tracking costs two clock reads per
+ * operation, or per batch for the batched operations whose keys are each
+ * given the mean latency. Disabling it drops what was recorded.
+ */
+void ht_track_latency(ht_hash_table *ht, int enable) {
+    if (enable && ht->latency == NULL) {
+        ht->latency = xcalloc(1, sizeof(ht_latency));
+    } else if (!enable) {
+        free(ht->latency);
+        ht->latency = NULL;
+    }
+}
+
+// record 'n' operations which started at 'start'
+static void ht_record(histogram *h, const uint64_t start, const int n) {
+    hist_record(h, (hist_now_ns() - start) / n, n);
+}
+
+// return the hash of 's' between 0 and 'm'
+static int ht_hash(const char *s, const int a, const int m) {
+    /* The polynomial is evaluated with Horner's rule so intermediate values
+     * stay below 'a * m' and never overflow, whatever the key length.
+     */
+    long hash = 0;
+    const unsigned char *c;
+    for (c = (const unsigned char *) s; *c != '\0'; c++) {
+        hash = (hash * a + *c) % m;
+    }
+    return (int) hash;
+}
+
+/* Return the bucket visited by the 'attempt'-th probe for a key whose hashes
+ * are 'hash_a' and 'hash_b'. The hashes are computed once per operation and
+ * every probe of the operation derives from them.
+ */
+static int ht_probe(
+        const int hash_a,
+        const int hash_b,
+        const int num_buckets,
+        const int attempt
+) {
+    // the step must not be a multiple of the (prime) number of buckets
+    const long step = 1 + hash_b % (num_buckets - 1);
+    return (int) ((hash_a + (long) attempt * step) % num_buckets);
+}
+
+/* Resize the hash table. Items are moved to the new buckets as they are, so
+ * keys and values keep their address and nothing is copied.
+ */
 static void ht_resize(ht_hash_table *ht, const int direction) {
     // we make sure we're not attempting to reduce the size below minimum
     const int new_size_index = ht->size_index + direction;
@@ -70,54 +156,49 @@ static void ht_resize(ht_hash_table *ht, const int direction) {
         return;
     }
 
-    // we initialize a new hash table at the desired size
-    ht_hash_table *new_ht = ht_new_sized(new_size_index);
+    const uint64_t start = hist_now_ns();
+    const int new_size = next_prime(50 << new_size_index);
+    HT_PROBE(resize_start, ht, ht->size, new_size, ht->count);
+    ht_item **new_items = xcalloc((size_t)new_size, sizeof(ht_item*));
 
-    // all non-NULL or deleted items are inserted into the new table
+    // all non-NULL or deleted items are placed in the new buckets
     int i;
     for (i = 0; i < ht->size; i++) {
         ht_item *item = ht->items[i];
         if (item != NULL && item != &HT_DELETED_ITEM) {
-            ht_insert(new_ht, item->key, item->value);
+            const int hash_a = ht_hash(item->key, HT_PRIME_1, new_size);
+            const int hash_b = ht_hash(item->key, HT_PRIME_2, new_size);
+            // keys are unique and the new buckets hold no deleted item
+            int index = hash_a;
+            int attempt = 1;
+            while (new_items[index] != NULL) {
+                index = ht_probe(hash_a, hash_b, new_size, attempt++);
+            }
+            new_items[index] = item;
         }
     }
 
-    ht->size_index = new_ht->size_index;
-    ht->count = new_ht->count;
-
-    // we swap attributes of our original and resized hash tables
-    // first, we give new_ht ht's size and items
-    const int tmp_size = ht->size;
-    ht->size = new_ht->size;
-    new_ht->size = tmp_size;
-
-    ht_item **tmp_items = ht->items;
-    ht->items = new_ht->items;
-    new_ht->items = tmp_items;
-
-    ht_del_hash_table(new_ht);
-}
+    free(ht->items);
+    const int old_size = ht->size;
+    ht->items = new_items;
+    ht->size = new_size;
+    ht->size_index = new_size_index;
+    ht->deleted = 0;
 
-// return the hash of 's' between 0 and 'm'
-static int ht_hash(const char *s, const int a, const int m) {
-    long hash = 0;
-    const int len_s = strlen(s);
-    int i;
-    for (i = 0; i < len_s; i++) {
-        hash += (long) pow(a, len_s - i + 1) * s[i];
-        hash = hash % m;
+    const uint64_t duration = hist_now_ns() - start;
+    ht->resizes++;
+    ht->resize_ns += duration;
+    HT_PROBE(resize_end, ht, old_size, new_size, ht->count, duration);
+    if (ht->latency != NULL) {
+        ht_latency *l = ht->latency;
+        hist_record(&l->resize, duration, 1);
+        ht_resize_event *event = &l->events[l->num_events++ % HT_RESIZE_EVENTS];
+        event->start_ns = start;
+        event->duration_ns = duration;
+        event->old_size = old_size;
+        event->new_size = new_size;
+        event->moved = ht->count;
     }
-    return (int) hash;
-}
-
-static int ht_get_hash(
-        const char *s,
-        const int num_buckets,
-        const int attempt
-) {
-    const int hash_a = ht_hash(s, HT_PRIME_1, num_buckets);
-    const int hash_b = ht_hash(s, HT_PRIME_2, num_buckets);
-    return (hash_a + attempt * (hash_b + 1)) % num_buckets;
 }
 
 /* To resize, we check the load on hash tables during 'insert' and 'delete'.
@@ -126,68 +207,365 @@ static int ht_get_hash(
  * if it is above 70 or below 10.
  */
 
-// insert a key:value pair in the hash table
-void ht_insert(ht_hash_table *ht, const char *key, const char *value) {
-    // we check if we need to resize up
-    const int load = ht->count * 100 / ht->size;
-    if (load > 70)
+/* Deleted items fill buckets as much as live ones: a miss only stops at an
+ * empty bucket, so once deletes and inserts have turned most empty buckets
+ * into deleted items every miss scans the whole table. Before adding 'n'
+ * items, the table is grown if the live items need it, and otherwise rebuilt
+ * at the same size, which drops the deleted items, when they push the load
+ * above 0.7.
+ */
+static void ht_reserve(ht_hash_table *ht, const int n) {
+    while ((long) (ht->count + n) * 100 / ht->size > 70)
         ht_resize(ht, 1);
+    if ((long) (ht->count + ht->deleted + n) * 100 / ht->size > 70)
+        ht_resize(ht, 0);
+}
 
-    ht_item *item = ht_new_item(key, value);
-    int index = ht_get_hash(item->key, ht->size, 0);
+/* Lookups must continue past deleted items since the key may sit further
+ * along the collision chain, and only stop at an empty bucket. Since the
+ * number of buckets is prime, 'size' attempts visit every bucket, which bounds
+ * the chain when the table holds no empty bucket.
+ */
+
+// insert an item given the hashes of its key, without resizing the table
+static void ht_insert_hashed(
+        ht_hash_table *ht,
+        const char *key,
+        const char *value,
+        const int hash_a,
+        const int hash_b
+) {
+    int index = hash_a;
     ht_item *cur_item = ht->items[index];
+    // first deleted bucket of the chain, reused if the key is not found
+    int free_index = -1;
     int i = 1;
-    // cycle through filled buckets until we hit an empty of deleted one
-    while (cur_item != NULL && cur_item != &HT_DELETED_ITEM) {
-        if (strcmp(cur_item->key, key) == 0) {
-            ht_del_item(cur_item);
-            ht->items[index] = item;
-            return;
+    HT_COUNT(ht, insert, calls, 1);
+    // cycle through the chain until we hit an empty bucket
+    while (cur_item != NULL && i <= ht->size) {
+        if (cur_item == &HT_DELETED_ITEM) {
+            HT_COUNT(ht, insert, tombstones, 1);
+            if (free_index < 0)
+                free_index = index;
+        } else {
+            HT_COUNT(ht, insert, compares, 1);
+            if (strcmp(cur_item->key, key) == 0) {
+                // the item of the key is kept, only its value is replaced
+                char *old = cur_item->value;
+                cur_item->value = xstrdup(value);
+                ht->data_bytes += strlen(value) - strlen(old);
+                ht_free_value(ht, old);
+                HT_COUNT(ht, insert, slots, i);
+                HT_CHAIN_PROBE(ht, key, i);
+                return;
+            }
         }
-        index = ht_get_hash(item->key, ht->size, i);
+        index = ht_probe(hash_a, hash_b, ht->size, i);
         cur_item = ht->items[index];
         i++;
     }
+    HT_COUNT(ht, insert, slots, i);
+    HT_CHAIN_PROBE(ht, key, i);
+    if (free_index >= 0) {
+        index = free_index;
+        ht->deleted--;
+    }
     // index points to a free bucket
-    ht->items[index] = item;
+    ht->items[index] = ht_new_item(key, value);
+    ht->data_bytes += strlen(key) + strlen(value) + 2;
     ht->count++;
 }
 
-// return the value associated with a key, or NULL if key does not exist
-char *ht_search(ht_hash_table *ht, const char *key) {
-    int index = ht_get_hash(key, ht->size, 0);
+// insert a key:value pair in the hash table
+void ht_insert(ht_hash_table *ht, const char *key, const char *value) {
+    const uint64_t start = ht->latency != NULL ? hist_now_ns() : 0;
+    // we check if we need to resize up or drop the deleted items
+    ht_reserve(ht, 0);
+
+    ht_insert_hashed(
+        ht,
+        key,
+        value,
+        ht_hash(key, HT_PRIME_1, ht->size),
+        ht_hash(key, HT_PRIME_2, ht->size)
+    );
+    if (ht->latency != NULL)
+        ht_record(&ht->latency->insert, start, 1);
+    if (ht->trace != NULL)
+        trace_record(ht->trace, TRACE_INSERT, key, strlen(value), 0);
+}
+
+static char *ht_search_hashed(
+        ht_hash_table *ht,
+        const char *key,
+        const int hash_a,
+        const int hash_b
+) {
+    int index = hash_a;
     ht_item *item = ht->items[index];
     int i = 1;
-    while (item != NULL && item != &HT_DELETED_ITEM) {
-        if (strcmp(item->key, key) == 0) {
+    HT_COUNT(ht, search, calls, 1);
+    while (item != NULL && i <= ht->size) {
+        if (item == &HT_DELETED_ITEM) {
+            HT_COUNT(ht, search, tombstones, 1);
+        } else {
+            HT_COUNT(ht, search, compares, 1);
+            if (strcmp(item->key, key) == 0) {
+                HT_COUNT(ht, search, slots, i);
+                HT_COUNT_PROBES(ht, i);
+                HT_CHAIN_PROBE(ht, key, i);
                 return item->value;
+            }
         }
-        index = ht_get_hash(key, ht->size, i);
+        index = ht_probe(hash_a, hash_b, ht->size, i);
         item = ht->items[index];
         i++;
     }
+    HT_COUNT(ht, search, slots, i);
+    HT_COUNT_PROBES(ht, i);
+    HT_CHAIN_PROBE(ht, key, i);
     return NULL;
 }
 
+// return the value associated with a key, or NULL if key does not exist
+char *ht_search(ht_hash_table *ht, const char *key) {
+    const uint64_t start = ht->latency != NULL ? hist_now_ns() : 0;
+    char *value = ht_search_hashed(
+        ht,
+        key,
+        ht_hash(key, HT_PRIME_1, ht->size),
+        ht_hash(key, HT_PRIME_2, ht->size)
+    );
+    if (ht->latency != NULL)
+        ht_record(&ht->latency->search, start, 1);
+    if (ht->trace != NULL)
+        trace_record(ht->trace, TRACE_SEARCH, key, 0, value != NULL);
+    return value;
+}
 
-// delete an item from the hash table or do nothing if key does not exist
-void ht_delete(ht_hash_table *ht, const char *key) {
+
+static void ht_delete_key(ht_hash_table *ht, const char *key) {
     // we check if we need to resize down
     const int load = ht->count * 100 / ht->size;
     if (load < 10)
         ht_resize(ht, -1);
 
-    int index = ht_get_hash(key, ht->size, 0);
+    const int hash_a = ht_hash(key, HT_PRIME_1, ht->size);
+    const int hash_b = ht_hash(key, HT_PRIME_2, ht->size);
+    int index = hash_a;
     ht_item *item = ht->items[index];
     int i = 1;
-    while (item != NULL && item != &HT_DELETED_ITEM) {
-        if (strcmp(item->key, key) == 0) {
-            ht_del_item(item);
-            ht->items[index] = &HT_DELETED_ITEM;
-            ht->count--;
+    HT_COUNT(ht, delete, calls, 1);
+    while (item != NULL && i <= ht->size) {
+        if (item == &HT_DELETED_ITEM) {
+            HT_COUNT(ht, delete, tombstones, 1);
+        } else {
+            HT_COUNT(ht, delete, compares, 1);
+            if (strcmp(item->key, key) == 0) {
+                ht_del_item(ht, item);
+                ht->items[index] = &HT_DELETED_ITEM;
+                ht->count--;
+                ht->deleted++;
+                HT_COUNT(ht, delete, slots, i);
+                HT_CHAIN_PROBE(ht, key, i);
+                return;
+            }
         }
-        index = ht_get_hash(key, ht->size, i);
+        index = ht_probe(hash_a, hash_b, ht->size, i);
         item = ht->items[index];
         i++;
     }
+    HT_COUNT(ht, delete, slots, i);
+    HT_CHAIN_PROBE(ht, key, i);
+}
+
+// delete an item from the hash table or do nothing if key does not exist
+void ht_delete(ht_hash_table *ht, const char *key) {
+    const uint64_t start = ht->latency != NULL ? hist_now_ns() : 0;
+    ht_delete_key(ht, key);
+    if (ht->latency != NULL)
+        ht_record(&ht->latency->delete, start, 1);
+    if (ht->trace != NULL)
+        trace_record(ht->trace, TRACE_DELETE, key, 0, 0);
+}
+
+/* Batched operations hash up to HT_BATCH_SIZE keys and prefetch the first
+ * bucket of each one, then the item it points to, before probing. The cache
+ * misses of the keys of a batch then overlap instead of being paid one after
+ * the other.
+ */
+#define HT_BATCH_SIZE 16
+
+static void ht_prefetch_batch(
+        ht_hash_table *ht,
+        const char **keys,
+        const int n,
+        int *hash_a,
+        int *hash_b
+) {
+    int j;
+    for (j = 0; j < n; j++) {
+        hash_a[j] = ht_hash(keys[j], HT_PRIME_1, ht->size);
+        hash_b[j] = ht_hash(keys[j], HT_PRIME_2, ht->size);
+        __builtin_prefetch(&ht->items[hash_a[j]]);
+    }
+    for (j = 0; j < n; j++) {
+        const ht_item *item = ht->items[hash_a[j]];
+        if (item != NULL && item != &HT_DELETED_ITEM) {
+            __builtin_prefetch(item);
+        }
+    }
+}
+
+// look up 'n' keys, values[i] is set as ht_search(ht, keys[i]) would return it
+void ht_search_batch(ht_hash_table *ht, const char **keys, int n, char **values) {
+    const uint64_t start_ns = ht->latency != NULL ? hist_now_ns() : 0;
+    int hash_a[HT_BATCH_SIZE];
+    int hash_b[HT_BATCH_SIZE];
+    int start;
+    for (start = 0; start < n; start += HT_BATCH_SIZE) {
+        const int m = n - start < HT_BATCH_SIZE ? n - start : HT_BATCH_SIZE;
+        ht_prefetch_batch(ht, keys + start, m, hash_a, hash_b);
+        int j;
+        for (j = 0; j < m; j++) {
+            values[start + j] = ht_search_hashed(ht, keys[start + j], hash_a[j], hash_b[j]);
+            if (ht->trace != NULL) {
+                trace_record(
+                    ht->trace,
+                    TRACE_SEARCH,
+                    keys[start + j],
+                    0,
+                    values[start + j] != NULL
+                );
+            }
+        }
+    }
+    if (ht->latency != NULL && n > 0)
+        ht_record(&ht->latency->search, start_ns, n);
+}
+
+/* Insert 'n' key:value pairs in order, as many calls to ht_insert() would. The
+ * table is grown before each group of keys is hashed so their buckets stay
+ * valid while they are inserted.
+ */
+void ht_insert_batch(
+        ht_hash_table *ht,
+        const char **keys,
+        const char **values,
+        int n
+) {
+    const uint64_t start_ns = ht->latency != NULL ? hist_now_ns() : 0;
+    int hash_a[HT_BATCH_SIZE];
+    int hash_b[HT_BATCH_SIZE];
+    int start;
+    for (start = 0; start < n; start += HT_BATCH_SIZE) {
+        const int m = n - start < HT_BATCH_SIZE ? n - start : HT_BATCH_SIZE;
+        ht_reserve(ht, m);
+        ht_prefetch_batch(ht, keys + start, m, hash_a, hash_b);
+        int j;
+        for (j = 0; j < m; j++) {
+            ht_insert_hashed(
+                ht,
+                keys[start + j],
+                values[start + j],
+                hash_a[j],
+                hash_b[j]
+            );
+            if (ht->trace != NULL) {
+                trace_record(
+                    ht->trace,
+                    TRACE_INSERT,
+                    keys[start + j],
+                    strlen(values[start + j]),
+                    0
+                );
+            }
+        }
+    }
+    if (ht->latency != NULL && n > 0)
+        ht_record(&ht->latency->insert, start_ns, n);
+}
+
+/* Iterate over the items of the hash table in bucket order. 'index' holds the
+ * iteration state and must be set to 0 before the first call. Returns NULL
+ * when all items have been visited.
+ */
+ht_item *ht_next_item(ht_hash_table *ht, int *index) {
+    while (*index < ht->size) {
+        ht_item *item = ht->items[(*index)++];
+        if (item != NULL && item != &HT_DELETED_ITEM) {
+            return item;
+        }
+    }
+    return NULL;
+}
+
+// number of buckets a lookup of 'key' visits to reach bucket 'target'
+static int ht_probe_length(const ht_hash_table *ht, const char *key, const int target) {
+    const int hash_a = ht_hash(key, HT_PRIME_1, ht->size);
+    const int hash_b = ht_hash(key, HT_PRIME_2, ht->size);
+    int index = hash_a;
+    int i = 1;
+    while (index != target && i < ht->size) {
+        index = ht_probe(hash_a, hash_b, ht->size, i);
+        i++;
+    }
+    return i;
+}
+
+/* Describe how the items are laid out in the buckets. The probe length of
+ * each item is found by replaying the probe sequence of its key up to its
+ * bucket, which costs a lookup per item. With 'sample' set below the size of
+ * the table, only that many consecutive buckets from a random one are
+ * examined, and the clusters crossing the edges of the window are cut short.
+ */
+void ht_stats(const ht_hash_table *ht, int sample, ht_table_stats *stats) {
+    memset(stats, 0, sizeof(*stats));
+    int n = ht->size;
+    int start = 0;
+    if (sample > 0 && sample < ht->size) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        start = (int) (ts.tv_nsec % ht->size);
+        n = sample;
+    } else {
+        // start after an empty bucket so no cluster wraps around the end
+        while (start < ht->size && ht->items[start] != NULL) {
+            start++;
+        }
+        if (start == ht->size) {
+            start = 0;
+        }
+    }
+    long total_probes = 0;
+    long total_cluster = 0;
+    int run = 0;
+    int j;
+    for (j = 0; j <= n; j++) {
+        const ht_item *item = j < n ? ht->items[(start + j) % ht->size] : NULL;
+        if (item == NULL) {
+            if (run > 0) {
+                stats->clusters++;
+                total_cluster += run;
+                if (run > stats->max_cluster)
+                    stats->max_cluster = run;
+                run = 0;
+            }
+            continue;
+        }
+        run++;
+        if (item == &HT_DELETED_ITEM) {
+            stats->tombstones++;
+            continue;
+        }
+        const int probes = ht_probe_length(ht, item->key, (start + j) % ht->size);
+        stats->items++;
+        stats->probes[(probes < HT_PROBE_HIST ? probes : HT_PROBE_HIST) - 1]++;
+        total_probes += probes;
+        if (probes - 1 > stats->max_displacement)
+            stats->max_displacement = probes - 1;
+    }
+    stats->buckets = n;
+    stats->mean_probes = stats->items > 0 ? (double) total_probes / stats->items : 0;
+    stats->mean_cluster = stats->clusters > 0 ? (double) total_cluster / stats->clusters : 0;
 }
@@ -1,22 +1,117 @@
 #ifndef HASH_TABLE_HEADER
 #define HASH_TABLE_HEADER
 
+#include <stdint.h>
+#include "histogram.h"
+#include "trace.h"
+
 typedef struct {
     char *key;
     char *value;
 } ht_item;
 
+// chains are counted by buckets visited, the last counter takes longer ones
+#define HT_PROBE_HIST 16
+
+#define HT_RESIZE_EVENTS 64
+
+typedef struct {
+    // hist_now_ns() when the resize started
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    int old_size;
+    int new_size;
+    int moved;
+} ht_resize_event;
+
+// latencies of the operations on a table, see ht_track_latency()
+typedef struct {
+    histogram insert;
+    histogram search;
+    histogram delete;
+    histogram resize;
+    // the last HT_RESIZE_EVENTS resizes, the oldest at num_events % HT_RESIZE_EVENTS
+    ht_resize_event events[HT_RESIZE_EVENTS];
+    unsigned long num_events;
+} ht_latency;
+
+// work done by the operations of one kind on a table
+typedef struct {
+    unsigned long long calls;
+    // buckets read, the empty one ending a chain included
+    unsigned long long slots;
+    unsigned long long compares;
+    // deleted buckets passed over
+    unsigned long long tombstones;
+} ht_op_cost;
+
+/* Costs of the operations, only counted when built with -DHT_COUNTERS and
+ * left at zero otherwise. Batched operations count with the single ones.
+ * Counting makes every search write to the table, so it is off by default
+ * and searches can run concurrently.
+ */
+typedef struct {
+    ht_op_cost insert;
+    ht_op_cost search;
+    ht_op_cost delete;
+    // searches by buckets visited
+    unsigned long long search_probes[HT_PROBE_HIST];
+} ht_counters;
+
 typedef struct {
     int size_index;
     int size;
     int count;
     ht_item **items;
+    /* Called instead of free() with the values leaving the table when set, so
+     * the owner can keep them alive while they are still referenced.
+     */
+    void (*free_value)(char *value, void *arg);
+    void *free_value_arg;
+    // statistics, maintained as the table changes
+    int deleted;
+    unsigned long resizes;
+    unsigned long long resize_ns;
+    // bytes of the keys and values, terminators included
+    size_t data_bytes;
+    // recorded only when set
+    ht_latency *latency;
+    // every operation is appended to the trace when set, it is not owned
+    ht_trace *trace;
+    ht_counters counters;
 } ht_hash_table;
 
+// layout of the buckets examined by ht_stats()
+typedef struct {
+    int buckets;
+    int items;
+    int tombstones;
+    // buckets visited to reach each item, the last counter takes longer chains
+    unsigned long probes[HT_PROBE_HIST];
+    double mean_probes;
+    // most buckets an item sits past the first bucket of its key
+    int max_displacement;
+    // runs of consecutive non-empty buckets
+    int clusters;
+    int max_cluster;
+    double mean_cluster;
+} ht_table_stats;
+
 ht_hash_table *ht_new();
+ht_hash_table *ht_new_sized(const int size_index);
 void ht_del_hash_table(ht_hash_table *ht);
 void ht_insert(ht_hash_table *ht, const char *key, const char *value);
 char *ht_search(ht_hash_table *ht, const char *key);
 void ht_delete(ht_hash_table *h, const char *key);
+ht_item *ht_next_item(ht_hash_table *ht, int *index);
+void ht_search_batch(ht_hash_table *ht, const char **keys, int n, char **values);
+void ht_insert_batch(
+        ht_hash_table *ht,
+        const char **keys,
+        const char **values,
+        int n
+);
+void ht_track_latency(ht_hash_table *ht, int enable);
+void ht_stats(const ht_hash_table *ht, int sample, ht_table_stats *stats);
 
 #endif
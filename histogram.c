@@ -0,0 +1,68 @@
+// log-linear histograms of latencies
+
+#include <string.h>
+#include <time.h>
+#include "histogram.h"
+
+static int hist_bucket(uint64_t value) {
+    if (value < HIST_SUB) {
+        return (int) value;
+    }
+    const int shift = 63 - __builtin_clzll(value) - HIST_SUB_BITS;
+    return HIST_SUB * (shift + 1) + (int) ((value >> shift) & (HIST_SUB - 1));
+}
+
+// largest value counted in a bucket
+static uint64_t hist_bound(int bucket) {
+    if (bucket < HIST_SUB) {
+        return (uint64_t) bucket;
+    }
+    const int shift = bucket / HIST_SUB - 1;
+    const uint64_t lowest = (uint64_t) (HIST_SUB + bucket % HIST_SUB) << shift;
+    return lowest + ((1ULL << shift) - 1);
+}
+
+// count 'n' values whose sum is 'value' * 'n'
+void hist_record(histogram *h, uint64_t value, unsigned long long n) {
+    h->count += n;
+    h->total += value * n;
+    if (value > h->max) {
+        h->max = value;
+    }
+    h->buckets[hist_bucket(value)] += n;
+}
+
+void hist_merge(histogram *dst, const histogram *src) {
+    dst->count += src->count;
+    dst->total += src->total;
+    if (src->max > dst->max) {
+        dst->max = src->max;
+    }
+    int i;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        dst->buckets[i] += src->buckets[i];
+    }
+}
+
+/* Upper bound of the value under which a fraction 'p' of the values fall,
+ * never above the largest value recorded.
+ */
+uint64_t hist_percentile(const histogram *h, double p) {
+    const unsigned long long rank = (unsigned long long) (p * h->count);
+    unsigned long long seen = 0;
+    int i;
+    for (i = 0; i < HIST_BUCKETS - 1; i++) {
+        seen += h->buckets[i];
+        if (seen > rank) {
+            break;
+        }
+    }
+    const uint64_t bound = hist_bound(i);
+    return bound < h->max ? bound : h->max;
+}
+
+uint64_t hist_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
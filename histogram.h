@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_HEADER
+#define HISTOGRAM_HEADER
+
+#include <stdint.h>
+
+/* Log-linear histogram of latencies in nanoseconds, in the manner of HDR
+ * histograms. Values below HIST_SUB have a bucket each, then every power of
+ * two is split in HIST_SUB buckets, so a value is known within 1/HIST_SUB
+ * over the whole range of 64 bit integers.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB * (64 - HIST_SUB_BITS + 1))
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long total;
+    uint64_t max;
+    unsigned long long buckets[HIST_BUCKETS];
+} histogram;
+
+void hist_record(histogram *h, uint64_t value, unsigned long long n);
+void hist_merge(histogram *dst, const histogram *src);
+uint64_t hist_percentile(const histogram *h, double p);
+uint64_t hist_now_ns(void);
+
+#endif
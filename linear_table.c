@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include "xmalloc.h"
+#include "fnv.h"
+#include "linear_table.h"
+
+#define LP_MIN_SIZE 64
+
+// FNV-1a, 0 marks empty entries so it is never returned
+static uint64_t lp_hash(const char *key) {
+    const uint64_t hash = fnv1a_64(key, strlen(key));
+    return hash != 0 ? hash : 1;
+}
+
+lp_table *lp_new(void) {
+    lp_table *t = xmalloc(sizeof(lp_table));
+    t->mask = LP_MIN_SIZE - 1;
+    t->count = 0;
+    t->entries = xcalloc(LP_MIN_SIZE, sizeof(lp_entry));
+    return t;
+}
+
+void lp_free(lp_table *t) {
+    size_t i;
+    for (i = 0; i <= t->mask; i++) {
+        if (t->entries[i].hash != 0) {
+            free(t->entries[i].key);
+            free(t->entries[i].value);
+        }
+    }
+    free(t->entries);
+    free(t);
+}
+
+// index of the entry of 'key', or of the empty entry ending its run
+static size_t lp_find(const lp_table *t, const char *key, uint64_t hash) {
+    size_t i = hash & t->mask;
+    while (t->entries[i].hash != 0) {
+        if (t->entries[i].hash == hash && strcmp(t->entries[i].key, key) == 0) {
+            break;
+        }
+        i = (i + 1) & t->mask;
+    }
+    return i;
+}
+
+static void lp_grow(lp_table *t) {
+    const size_t old_size = t->mask + 1;
+    lp_entry *old = t->entries;
+    t->mask = old_size * 2 - 1;
+    t->entries = xcalloc(old_size * 2, sizeof(lp_entry));
+    size_t i;
+    for (i = 0; i < old_size; i++) {
+        if (old[i].hash != 0) {
+            size_t j = old[i].hash & t->mask;
+            while (t->entries[j].hash != 0) {
+                j = (j + 1) & t->mask;
+            }
+            t->entries[j] = old[i];
+        }
+    }
+    free(old);
+}
+
+void lp_insert(lp_table *t, const char *key, const char *value) {
+    if ((t->count + 1) * 4 > (t->mask + 1) * 3) {
+        lp_grow(t);
+    }
+    const uint64_t hash = lp_hash(key);
+    lp_entry *e = &t->entries[lp_find(t, key, hash)];
+    if (e->hash != 0) {
+        char *old = e->value;
+        e->value = xstrdup(value);
+        free(old);
+        return;
+    }
+    e->hash = hash;
+    e->key = xstrdup(key);
+    e->value = xstrdup(value);
+    t->count++;
+}
+
+char *lp_search(lp_table *t, const char *key) {
+    const lp_entry *e = &t->entries[lp_find(t, key, lp_hash(key))];
+    return e->hash != 0 ? e->value : NULL;
+}
+
+void lp_delete(lp_table *t, const char *key) {
+    size_t i = lp_find(t, key, lp_hash(key));
+    if (t->entries[i].hash == 0) {
+        return;
+    }
+    free(t->entries[i].key);
+    free(t->entries[i].value);
+    t->count--;
+    /* Move back the entries of the run that may take the freed place, those
+     * whose home is not cyclically between the hole and themselves.
+     */
+    size_t j = i;
+    for (;;) {
+        j = (j + 1) & t->mask;
+        if (t->entries[j].hash == 0) {
+            break;
+        }
+        const size_t home = t->entries[j].hash & t->mask;
+        if (((j - home) & t->mask) >= ((j - i) & t->mask)) {
+            t->entries[i] = t->entries[j];
+            i = j;
+        }
+    }
+    t->entries[i].hash = 0;
+    t->entries[i].key = NULL;
+    t->entries[i].value = NULL;
+}
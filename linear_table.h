@@ -0,0 +1,33 @@
+#ifndef LINEAR_TABLE_HEADER
+#define LINEAR_TABLE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Linear probing hash table, the baseline the main table is measured
+ * against.
+ *
+ * Entries are stored flat in a power of two array with the 64 bit hash of
+ * their key, which is compared before the keys. The table doubles when it is
+ * 3/4 full. Deleting shifts the following entries of the run back, so there
+ * are no tombstones.
+ */
+typedef struct {
+    uint64_t hash;
+    char *key;
+    char *value;
+} lp_entry;
+
+typedef struct {
+    size_t mask;
+    size_t count;
+    lp_entry *entries;
+} lp_table;
+
+lp_table *lp_new(void);
+void lp_free(lp_table *t);
+void lp_insert(lp_table *t, const char *key, const char *value);
+char *lp_search(lp_table *t, const char *key);
+void lp_delete(lp_table *t, const char *key);
+
+#endif
@@ -0,0 +1,523 @@
+/* Load generator for the key-value server.
+ *
+ * Each thread drives its share of the connections with an epoll loop. Every
+ * connection keeps up to 'depth' requests in flight, GETs or SETs picked at
+ * random in the configured proportion, on keys drawn from a Zipfian
+ * distribution. The latency of a request runs from the moment it is queued to
+ * the moment its reply is parsed. With -l every key is first set once, so
+ * GETs find their key.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "xmalloc.h"
+#include "buffer.h"
+#include "resp.h"
+#include "histogram.h"
+#include "net.h"
+#include "zipf.h"
+
+#define LG_READ_SIZE 65536
+#define LG_MAX_EVENTS 256
+
+enum { LG_RESP, LG_BINARY };
+enum { LG_GET, LG_SET };
+
+typedef struct {
+    const char *addr;
+    int protocol;
+    int threads;
+    int connections;
+    long requests;
+    double duration;
+    long keys;
+    // percentage of GET requests
+    int get_ratio;
+    // exponent of the Zipfian distribution, 0 for uniform keys
+    double zipf;
+    int depth;
+    int value_size;
+    int preload;
+} lg_config;
+
+typedef struct {
+    int fd;
+    buffer out;
+    buffer in;
+    // kinds and start times of the requests in flight, a ring of 'depth'
+    int *kinds;
+    uint64_t *started;
+    int head;
+    int inflight;
+    uint32_t events;
+} lg_conn;
+
+typedef struct {
+    const lg_config *cfg;
+    const zipf *zipf;
+    const char *value;
+    lg_conn *conns;
+    int num_conns;
+    // preload phase: keys [next_key, end_key) are set in order
+    int preloading;
+    long next_key;
+    long end_key;
+    // requests left to issue, and time after which none is issued when set
+    long quota;
+    uint64_t deadline;
+    uint64_t rng;
+    histogram latency[2];
+    unsigned long long hits;
+    unsigned long long errors;
+    int failed;
+} lg_thread;
+
+// xorshift64*, a uniform number in [0, 1)
+static double lg_random(lg_thread *t) {
+    t->rng ^= t->rng >> 12;
+    t->rng ^= t->rng << 25;
+    t->rng ^= t->rng >> 27;
+    return ((t->rng * 2685821657736338717ULL) >> 11) * 0x1.0p-53;
+}
+
+static void lg_encode(lg_thread *t, buffer *b, int kind, long key) {
+    char name[32];
+    const int key_len = snprintf(name, sizeof(name), "key:%ld", key);
+    const size_t value_len = kind == LG_SET ? (size_t) t->cfg->value_size : 0;
+    if (t->cfg->protocol == LG_BINARY) {
+        const unsigned char header[8] = {
+            kind == LG_GET ? 1 : 2,
+            0,
+            (unsigned char) (key_len >> 8),
+            (unsigned char) key_len,
+            (unsigned char) (value_len >> 24),
+            (unsigned char) (value_len >> 16),
+            (unsigned char) (value_len >> 8),
+            (unsigned char) value_len
+        };
+        buf_append(b, header, sizeof(header));
+        buf_append(b, name, key_len);
+        buf_append(b, t->value, value_len);
+        return;
+    }
+    resp_array(b, kind == LG_GET ? 2 : 3);
+    resp_bulk(b, kind == LG_GET ? "GET" : "SET", 3);
+    resp_bulk(b, name, key_len);
+    if (kind == LG_SET) {
+        resp_bulk(b, t->value, value_len);
+    }
+}
+
+// queue the next request on a connection, returns 0 when there is none left
+static int lg_issue(lg_thread *t, lg_conn *c, uint64_t now) {
+    int kind;
+    long key;
+    if (t->preloading) {
+        if (t->next_key == t->end_key) {
+            return 0;
+        }
+        kind = LG_SET;
+        key = t->next_key++;
+    } else {
+        if (t->quota == 0 || (t->deadline != 0 && now >= t->deadline)) {
+            return 0;
+        }
+        if (t->quota > 0) {
+            t->quota--;
+        }
+        kind = lg_random(t) * 100 < t->cfg->get_ratio ? LG_GET : LG_SET;
+        key = zipf_rank(t->zipf, lg_random(t));
+    }
+    lg_encode(t, &c->out, kind, key);
+    const int slot = (c->head + c->inflight) % t->cfg->depth;
+    c->kinds[slot] = kind;
+    c->started[slot] = now;
+    c->inflight++;
+    return 1;
+}
+
+static void lg_complete(lg_thread *t, lg_conn *c, int ok, int hit, uint64_t now) {
+    const int kind = c->kinds[c->head];
+    hist_record(&t->latency[kind], now - c->started[c->head], 1);
+    if (!ok) {
+        t->errors++;
+    } else if (hit && kind == LG_GET) {
+        t->hits++;
+    }
+    c->head = (c->head + 1) % t->cfg->depth;
+    c->inflight--;
+}
+
+// match the replies received with the requests, returns -1 on protocol errors
+static int lg_parse(lg_thread *t, lg_conn *c) {
+    buffer *in = &c->in;
+    const uint64_t now = hist_now_ns();
+    while (c->inflight > 0) {
+        const char *p = in->data + in->pos;
+        const size_t pending = buf_pending(in);
+        long used;
+        if (t->cfg->protocol == LG_BINARY) {
+            if (pending < 8) {
+                break;
+            }
+            const unsigned char *h = (const unsigned char *) p;
+            const size_t len = (size_t) h[4] << 24 | (size_t) h[5] << 16
+                | (size_t) h[6] << 8 | h[7];
+            if (pending < 8 + len) {
+                break;
+            }
+            used = (long) (8 + len);
+            lg_complete(t, c, h[1] != 2, h[1] == 0, now);
+        } else {
+            resp_reply reply;
+            used = resp_parse_reply(in->data + in->pos, pending, &reply);
+            if (used == 0) {
+                break;
+            }
+            if (used < 0 || reply.type == RESP_REPLY_ARRAY) {
+                return -1;
+            }
+            lg_complete(
+                t,
+                c,
+                reply.type != RESP_REPLY_ERROR,
+                reply.type == RESP_REPLY_BULK,
+                now
+            );
+        }
+        buf_consume(in, used);
+    }
+    return 0;
+}
+
+static int lg_flush(lg_conn *c) {
+    while (buf_pending(&c->out) > 0) {
+        const ssize_t n = send(
+            c->fd, c->out.data + c->out.pos, buf_pending(&c->out), MSG_NOSIGNAL
+        );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return 0;
+            return -1;
+        }
+        buf_consume(&c->out, n);
+    }
+    return 0;
+}
+
+// top up the requests of a connection and send them
+static int lg_fill(lg_thread *t, lg_conn *c, int epoll_fd) {
+    const uint64_t now = hist_now_ns();
+    while (c->inflight < t->cfg->depth && lg_issue(t, c, now));
+    if (lg_flush(c) < 0) {
+        return -1;
+    }
+    const uint32_t events = EPOLLIN | (buf_pending(&c->out) > 0 ? EPOLLOUT : 0);
+    if (events != c->events) {
+        struct epoll_event ev = {0};
+        ev.events = events;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, c->events == 0 ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, c->fd, &ev);
+        c->events = events;
+    }
+    return 0;
+}
+
+static void lg_fail(lg_thread *t, lg_conn *c, const char *what) {
+    if (!t->failed) {
+        fprintf(stderr, "Connection failed: %s.\n", what);
+    }
+    t->failed = 1;
+    c->inflight = 0;
+}
+
+static void *lg_run(void *arg) {
+    lg_thread *t = arg;
+    const int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        t->failed = 1;
+        return NULL;
+    }
+    int i;
+    for (i = 0; i < t->num_conns; i++) {
+        t->conns[i].events = 0;
+        if (lg_fill(t, &t->conns[i], epoll_fd) < 0) {
+            lg_fail(t, &t->conns[i], strerror(errno));
+        }
+    }
+    struct epoll_event events[LG_MAX_EVENTS];
+    while (!t->failed) {
+        int busy = 0;
+        for (i = 0; i < t->num_conns; i++) {
+            busy |= t->conns[i].inflight > 0;
+        }
+        if (!busy) {
+            break;
+        }
+        const int n = epoll_wait(epoll_fd, events, LG_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            t->failed = 1;
+            break;
+        }
+        for (i = 0; i < n && !t->failed; i++) {
+            lg_conn *c = events[i].data.ptr;
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+                buf_reserve(&c->in, LG_READ_SIZE);
+                const ssize_t r = recv(c->fd, c->in.data + c->in.len, c->in.cap - c->in.len, 0);
+                if (r == 0 || (r < 0 && errno != EAGAIN && errno != EINTR)) {
+                    lg_fail(t, c, r == 0 ? "closed by the server" : strerror(errno));
+                    break;
+                }
+                if (r > 0) {
+                    c->in.len += r;
+                }
+                if (lg_parse(t, c) < 0) {
+                    lg_fail(t, c, "invalid reply");
+                    break;
+                }
+            }
+            if (lg_fill(t, c, epoll_fd) < 0) {
+                lg_fail(t, c, strerror(errno));
+            }
+        }
+    }
+    for (i = 0; i < t->num_conns; i++) {
+        if (t->conns[i].events != 0) {
+            epoll_ctl(epoll_fd, EPOLL_CTL_DEL, t->conns[i].fd, NULL);
+        }
+    }
+    close(epoll_fd);
+    return NULL;
+}
+
+// run every thread once, returns -1 if one of them failed
+static int lg_phase(lg_thread *threads, int n) {
+    pthread_t *ids = xcalloc(n, sizeof(pthread_t));
+    int i;
+    int err = 0;
+    for (i = 1; i < n; i++) {
+        if (pthread_create(&ids[i], NULL, lg_run, &threads[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    lg_run(&threads[0]);
+    for (i = 0; i < n; i++) {
+        if (i > 0) {
+            pthread_join(ids[i], NULL);
+        }
+        err |= threads[i].failed;
+    }
+    free(ids);
+    return err ? -1 : 0;
+}
+
+static void lg_report(const char *name, const histogram *h, unsigned long long hits) {
+    if (h->count == 0) {
+        return;
+    }
+    printf("%s %llu requests", name, h->count);
+    if (hits != (unsigned long long) -1) {
+        printf(", %.1f%% hits", 100.0 * hits / h->count);
+    }
+    printf(
+        "\n    latency us: avg %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p99.9 %.1f, max %.1f\n",
+        h->total / 1000.0 / h->count,
+        hist_percentile(h, 0.5) / 1000.0,
+        hist_percentile(h, 0.9) / 1000.0,
+        hist_percentile(h, 0.99) / 1000.0,
+        hist_percentile(h, 0.999) / 1000.0,
+        h->max / 1000.0
+    );
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-a address] [-B] [-t threads] [-c connections] [-n requests]\n"
+        "          [-d seconds] [-k keys] [-r get_percent] [-z exponent] [-p depth]\n"
+        "          [-v value_size] [-l]\n"
+        "  -a  server, 'host:port' or the path of a Unix socket\n"
+        "      (default: 127.0.0.1:6379)\n"
+        "  -B  speak the binary protocol instead of RESP\n"
+        "  -t  threads (default: 1)\n"
+        "  -c  connections, spread over the threads (default: 50)\n"
+        "  -n  requests to send (default: 100000)\n"
+        "  -d  send requests for this many seconds instead\n"
+        "  -k  number of distinct keys (default: 100000)\n"
+        "  -r  percentage of GET requests, the others are SETs (default: 90)\n"
+        "  -z  exponent of the Zipfian key popularity, below 1, 0 for uniform\n"
+        "      (default: 0.99)\n"
+        "  -p  requests in flight per connection (default: 1)\n"
+        "  -v  size of the values set (default: 32)\n"
+        "  -l  set every key once before sending requests\n",
+        prog
+    );
+}
+
+int main(int argc, char *argv[]) {
+    lg_config cfg = {
+        .addr = "127.0.0.1:6379",
+        .protocol = LG_RESP,
+        .threads = 1,
+        .connections = 50,
+        .requests = 100000,
+        .duration = 0,
+        .keys = 100000,
+        .get_ratio = 90,
+        .zipf = 0.99,
+        .depth = 1,
+        .value_size = 32,
+        .preload = 0
+    };
+    int opt;
+    while ((opt = getopt(argc, argv, "a:Bt:c:n:d:k:r:z:p:v:lh")) != -1) {
+        switch (opt) {
+        case 'a': cfg.addr = optarg; break;
+        case 'B': cfg.protocol = LG_BINARY; break;
+        case 't': cfg.threads = atoi(optarg); break;
+        case 'c': cfg.connections = atoi(optarg); break;
+        case 'n': cfg.requests = atol(optarg); break;
+        case 'd': cfg.duration = atof(optarg); break;
+        case 'k': cfg.keys = atol(optarg); break;
+        case 'r': cfg.get_ratio = atoi(optarg); break;
+        case 'z': cfg.zipf = atof(optarg); break;
+        case 'p': cfg.depth = atoi(optarg); break;
+        case 'v': cfg.value_size = atoi(optarg); break;
+        case 'l': cfg.preload = 1; break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc || cfg.threads < 1 || cfg.connections < cfg.threads
+            || cfg.requests < 1 || cfg.duration < 0 || cfg.keys < 1
+            || cfg.get_ratio < 0 || cfg.get_ratio > 100
+            || cfg.zipf < 0 || cfg.zipf >= 1 || cfg.depth < 1
+            || cfg.value_size < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    zipf popularity;
+    zipf_init(&popularity, cfg.keys, cfg.zipf);
+    char *value = xmalloc(cfg.value_size + 1);
+    memset(value, 'x', cfg.value_size);
+
+    lg_thread *threads = xcalloc(cfg.threads, sizeof(lg_thread));
+    int i;
+    for (i = 0; i < cfg.threads; i++) {
+        lg_thread *t = &threads[i];
+        t->cfg = &cfg;
+        t->zipf = &popularity;
+        t->value = value;
+        t->rng = 0x9e3779b97f4a7c15ULL * (i + 1);
+        t->num_conns = cfg.connections / cfg.threads + (i < cfg.connections % cfg.threads);
+        t->conns = xcalloc(t->num_conns, sizeof(lg_conn));
+        int j;
+        for (j = 0; j < t->num_conns; j++) {
+            lg_conn *c = &t->conns[j];
+            c->fd = net_connect(cfg.addr);
+            if (c->fd < 0) {
+                fprintf(stderr, "Could not connect to %s.\n", cfg.addr);
+                return 1;
+            }
+            fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL, 0) | O_NONBLOCK);
+            const int one = 1;
+            setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+            c->kinds = xcalloc(cfg.depth, sizeof(int));
+            c->started = xcalloc(cfg.depth, sizeof(uint64_t));
+        }
+    }
+
+    int err = 0;
+    if (cfg.preload) {
+        for (i = 0; i < cfg.threads; i++) {
+            threads[i].preloading = 1;
+            threads[i].next_key = cfg.keys * i / cfg.threads;
+            threads[i].end_key = cfg.keys * (i + 1) / cfg.threads;
+        }
+        const uint64_t start = hist_now_ns();
+        err = lg_phase(threads, cfg.threads);
+        printf("Preloaded %ld keys in %.2f s.\n", cfg.keys, (hist_now_ns() - start) / 1e9);
+        for (i = 0; i < cfg.threads; i++) {
+            lg_thread *t = &threads[i];
+            t->preloading = 0;
+            memset(t->latency, 0, sizeof(t->latency));
+            t->hits = 0;
+            t->errors = 0;
+        }
+    }
+
+    const uint64_t start = hist_now_ns();
+    for (i = 0; i < cfg.threads && err == 0; i++) {
+        lg_thread *t = &threads[i];
+        if (cfg.duration > 0) {
+            t->quota = -1;
+            t->deadline = start + (uint64_t) (cfg.duration * 1e9);
+        } else {
+            t->quota = cfg.requests / cfg.threads + (i < cfg.requests % cfg.threads);
+        }
+    }
+    if (err == 0) {
+        err = lg_phase(threads, cfg.threads);
+    }
+    const double elapsed = (hist_now_ns() - start) / 1e9;
+
+    histogram latency[2];
+    memset(latency, 0, sizeof(latency));
+    unsigned long long hits = 0;
+    unsigned long long errors = 0;
+    for (i = 0; i < cfg.threads; i++) {
+        hist_merge(&latency[LG_GET], &threads[i].latency[LG_GET]);
+        hist_merge(&latency[LG_SET], &threads[i].latency[LG_SET]);
+        hits += threads[i].hits;
+        errors += threads[i].errors;
+    }
+    const unsigned long long total = latency[LG_GET].count + latency[LG_SET].count;
+    printf(
+        "%s %s, %d threads, %d connections, depth %d, %d%% GET, zipf %.2f over %ld keys\n",
+        cfg.addr,
+        cfg.protocol == LG_BINARY ? "binary" : "resp",
+        cfg.threads,
+        cfg.connections,
+        cfg.depth,
+        cfg.get_ratio,
+        cfg.zipf,
+        cfg.keys
+    );
+    printf("%llu requests in %.2f s: %.0f requests/s, %llu errors\n",
+           total, elapsed, elapsed > 0 ? total / elapsed : 0.0, errors);
+    lg_report("GET", &latency[LG_GET], hits);
+    lg_report("SET", &latency[LG_SET], (unsigned long long) -1);
+
+    for (i = 0; i < cfg.threads; i++) {
+        int j;
+        for (j = 0; j < threads[i].num_conns; j++) {
+            lg_conn *c = &threads[i].conns[j];
+            close(c->fd);
+            buf_free(&c->out);
+            buf_free(&c->in);
+            free(c->kinds);
+            free(c->started);
+        }
+        free(threads[i].conns);
+    }
+    free(threads);
+    free(value);
+    return err == 0 ? 0 : 1;
+}
@@ -1,15 +1,93 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include "hash_table.h"
+#include <string.h>
+#include <unistd.h>
+#include "server.h"
 
-int main(int argc, char *argv[]) {
-
-    ht_hash_table *ht = ht_new();
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-b address] [-p port] [-s unix_socket] [-m port] [-B port]\n"
+        "          [-e backend] [-t threads] [-r primary] [-T trace] [-H socket]\n"
+        "  -b  address to bind the TCP listener to (default: all)\n"
+        "  -p  TCP port, 0 to disable TCP (default: 6379)\n"
+        "  -s  path of a Unix socket to listen on\n"
+        "  -m  TCP port for memcached protocol clients (default: disabled)\n"
+        "  -B  TCP port for binary protocol clients (default: disabled)\n"
+        "  -e  event loop, 'epoll' or 'io_uring' (default: epoll)\n"
+        "  -t  threads each serving a shard of the keys, 0 for one per CPU\n"
+        "      (default: 1, more require epoll)\n"
+        "  -r  run as a read-only replica of the server at 'host:port' or at the\n"
+        "      path of a Unix socket\n"
+        "  -T  record every operation on the keys to this file, see replay\n"
+        "  -H  take the keys over from the server listening on this Unix socket\n"
+        "      before serving, and hand them to the next server started with\n"
+        "      the same socket when stopped\n",
+        prog
+    );
+}
 
-    ht_insert(ht, "chien", "dog");
+int main(int argc, char *argv[]) {
+    server_config cfg;
+    server_config_init(&cfg);
 
-    printf("Key = 'chien', Value = %s\n", ht_search(ht, "chien"));
+    int opt;
+    while ((opt = getopt(argc, argv, "b:p:s:m:B:e:t:r:T:H:h")) != -1) {
+        switch (opt) {
+        case 'b':
+            cfg.bind_addr = optarg;
+            break;
+        case 'p':
+            cfg.port = atoi(optarg);
+            break;
+        case 's':
+            cfg.unix_path = optarg;
+            break;
+        case 'm':
+            cfg.memcache_port = atoi(optarg);
+            break;
+        case 'B':
+            cfg.binary_port = atoi(optarg);
+            break;
+        case 'e':
+            if (strcmp(optarg, "epoll") == 0) {
+                cfg.backend = SERVER_BACKEND_EPOLL;
+            } else if (strcmp(optarg, "io_uring") == 0) {
+                cfg.backend = SERVER_BACKEND_URING;
+            } else {
+                fprintf(stderr, "Unknown event loop '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 't':
+            cfg.threads = atoi(optarg);
+            if (cfg.threads == 0) {
+                cfg.threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+            }
+            if (cfg.threads < 1) {
+                fprintf(stderr, "Invalid number of threads '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'r':
+            cfg.replicaof = optarg;
+            break;
+        case 'T':
+            cfg.trace_path = optarg;
+            break;
+        case 'H':
+            cfg.handoff_path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (cfg.port <= 0 && cfg.unix_path == NULL && cfg.memcache_port <= 0
+            && cfg.binary_port <= 0) {
+        fprintf(stderr, "No listener configured.\n");
+        return 1;
+    }
 
-    ht_del_hash_table(ht);
-    return 0;
+    return server_run(&cfg) == 0 ? 0 : 1;
 }
@@ -0,0 +1,732 @@
+// memcached text and meta protocol frontend of the key-value server
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "buffer.h"
+#include "server_internal.h"
+
+#define MC_MAX_LINE 2048
+#define MC_MAX_TOKENS 24
+#define MC_MAX_KEY 250
+#define MC_MAX_DATA (1L << 20)
+// expiration times above this are absolute Unix times, as in memcached
+#define MC_REALTIME_MAXDELTA (60 * 60 * 24 * 30)
+
+typedef struct {
+    int ntokens;
+    char *tokens[MC_MAX_TOKENS];
+    // data block of storage commands, NUL-terminated
+    char *data;
+    long data_len;
+    // fields of the text storage commands, parsed with the command line
+    unsigned long long flags;
+    long exptime;
+    unsigned long long cas;
+    int noreply;
+} mc_request;
+
+// storage modes shared by the text and meta commands
+enum { MC_SET, MC_ADD, MC_REPLACE, MC_APPEND, MC_PREPEND, MC_CAS };
+
+// outcomes of a storage command
+enum { MC_STORED, MC_NOT_STORED, MC_EXISTS, MC_NOT_FOUND };
+
+static void mc_reply(server_conn *c, mc_request *req, const char *s) {
+    if (!req->noreply) {
+        buf_append_str(&c->out, s);
+    }
+}
+
+static long mc_exptime(long exptime) {
+    if (exptime == 0) {
+        return 0;
+    }
+    if (exptime < 0) {
+        // already expired
+        return 1;
+    }
+    if (exptime <= MC_REALTIME_MAXDELTA) {
+        return time(NULL) + exptime;
+    }
+    return exptime;
+}
+
+static int mc_valid_key(const char *key) {
+    const size_t len = strlen(key);
+    if (len == 0 || len > MC_MAX_KEY) {
+        return 0;
+    }
+    const unsigned char *p;
+    for (p = (const unsigned char *) key; *p != '\0'; p++) {
+        if (*p <= ' ' || *p == 0x7f) return 0;
+    }
+    return 1;
+}
+
+static int mc_parse_ulong(const char *s, unsigned long long *n) {
+    char *end;
+    if (*s == '-' || *s == '\0') {
+        return -1;
+    }
+    errno = 0;
+    *n = strtoull(s, &end, 10);
+    return *end == '\0' && errno == 0 ? 0 : -1;
+}
+
+static int mc_parse_long(const char *s, long *n) {
+    char *end;
+    if (*s == '\0') {
+        return -1;
+    }
+    errno = 0;
+    *n = strtol(s, &end, 10);
+    return *end == '\0' && errno == 0 ? 0 : -1;
+}
+
+/* Store 'data' under 'key' according to 'mode'. For MC_CAS, 'cas' must match
+ * the CAS unique of the existing item. The flags and expiration time of the
+ * existing item are kept by MC_APPEND and MC_PREPEND.
+ */
+static int mc_store(
+        server *srv,
+        int mode,
+        const char *key,
+        const char *data,
+        unsigned flags,
+        long exptime,
+        unsigned long long cas
+) {
+    const char *old = server_lookup(srv, key);
+    server_meta m;
+    if (old != NULL) {
+        server_get_meta(srv, key, &m);
+    }
+    switch (mode) {
+    case MC_ADD:
+        if (old != NULL) return MC_NOT_STORED;
+        break;
+    case MC_REPLACE:
+    case MC_APPEND:
+    case MC_PREPEND:
+        if (old == NULL) return MC_NOT_STORED;
+        break;
+    case MC_CAS:
+        if (old == NULL) return MC_NOT_FOUND;
+        if (m.cas != cas) return MC_EXISTS;
+        break;
+    }
+
+    if (mode == MC_APPEND || mode == MC_PREPEND) {
+        const size_t old_len = strlen(old);
+        const size_t data_len = strlen(data);
+        char *value = xmalloc(old_len + data_len + 1);
+        if (mode == MC_APPEND) {
+            memcpy(value, old, old_len);
+            memcpy(value + old_len, data, data_len + 1);
+        } else {
+            memcpy(value, data, data_len);
+            memcpy(value + data_len, old, old_len + 1);
+        }
+        server_put(srv, key, value);
+        free(value);
+    } else {
+        server_put(srv, key, data);
+        m.flags = flags;
+        m.exptime = exptime;
+    }
+    m.cas = ++srv->next_cas;
+    server_set_meta(srv, key, &m);
+    return MC_STORED;
+}
+
+/* Add 'delta' to the decimal value of 'key', or subtract it if 'incr' is 0.
+ * Decrementing below 0 yields 0 and incrementing wraps around at 2^64.
+ * Returns -1 if the key does not exist, -2 if its value is not a number.
+ */
+static int mc_arith(
+        server *srv,
+        const char *key,
+        int incr,
+        unsigned long long delta,
+        unsigned long long *result
+) {
+    const char *old = server_lookup(srv, key);
+    if (old == NULL) {
+        return -1;
+    }
+    unsigned long long n;
+    if (mc_parse_ulong(old, &n) < 0) {
+        return -2;
+    }
+    if (incr) {
+        n += delta;
+    } else {
+        n = delta > n ? 0 : n - delta;
+    }
+    server_meta m;
+    server_get_meta(srv, key, &m);
+    char value[32];
+    sprintf(value, "%llu", n);
+    server_put(srv, key, value);
+    m.cas = ++srv->next_cas;
+    server_set_meta(srv, key, &m);
+    *result = n;
+    return 0;
+}
+
+// text protocol
+
+static void mc_cmd_get(server *srv, server_conn *c, mc_request *req, int with_cas) {
+    int i;
+    for (i = 1; i < req->ntokens; i++) {
+        const char *key = req->tokens[i];
+        const char *value = server_lookup(srv, key);
+        server_meta m;
+        if (value == NULL || server_get_meta(srv, key, &m) < 0) {
+            continue;
+        }
+        const size_t len = strlen(value);
+        if (with_cas) {
+            buf_printf(&c->out, "VALUE %s %u %zu %llu\r\n", key, m.flags, len, m.cas);
+        } else {
+            buf_printf(&c->out, "VALUE %s %u %zu\r\n", key, m.flags, len);
+        }
+        buf_append(&c->out, value, len);
+        buf_append(&c->out, "\r\n", 2);
+    }
+    buf_append_str(&c->out, "END\r\n");
+}
+
+static void mc_cmd_store(server *srv, server_conn *c, mc_request *req, int mode) {
+    static const char *replies[] = {
+        "STORED\r\n", "NOT_STORED\r\n", "EXISTS\r\n", "NOT_FOUND\r\n"
+    };
+    const int r = mc_store(
+        srv, mode, req->tokens[1], req->data,
+        (unsigned) req->flags, mc_exptime(req->exptime), req->cas
+    );
+    mc_reply(c, req, replies[r]);
+}
+
+static void mc_cmd_delete(server *srv, server_conn *c, mc_request *req) {
+    if (server_lookup(srv, req->tokens[1]) == NULL) {
+        mc_reply(c, req, "NOT_FOUND\r\n");
+        return;
+    }
+    server_remove(srv, req->tokens[1]);
+    mc_reply(c, req, "DELETED\r\n");
+}
+
+static void mc_cmd_arith(server *srv, server_conn *c, mc_request *req, int incr) {
+    unsigned long long delta, result;
+    if (mc_parse_ulong(req->tokens[2], &delta) < 0) {
+        mc_reply(c, req, "CLIENT_ERROR invalid numeric delta argument\r\n");
+        return;
+    }
+    const int r = mc_arith(srv, req->tokens[1], incr, delta, &result);
+    if (r == -1) {
+        mc_reply(c, req, "NOT_FOUND\r\n");
+    } else if (r == -2) {
+        mc_reply(c, req,
+            "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+    } else if (!req->noreply) {
+        buf_printf(&c->out, "%llu\r\n", result);
+    }
+}
+
+static void mc_cmd_touch(server *srv, server_conn *c, mc_request *req) {
+    long exptime;
+    server_meta m;
+    if (mc_parse_long(req->tokens[2], &exptime) < 0) {
+        mc_reply(c, req, "CLIENT_ERROR invalid exptime argument\r\n");
+        return;
+    }
+    if (server_lookup(srv, req->tokens[1]) == NULL
+            || server_get_meta(srv, req->tokens[1], &m) < 0) {
+        mc_reply(c, req, "NOT_FOUND\r\n");
+        return;
+    }
+    m.exptime = mc_exptime(exptime);
+    server_set_meta(srv, req->tokens[1], &m);
+    mc_reply(c, req, "TOUCHED\r\n");
+}
+
+// meta protocol
+
+/* Append the return flags requested in a meta command, 'value' is NULL when
+ * the item does not exist.
+ */
+static void mc_meta_flags(
+        server_conn *c,
+        mc_request *req,
+        int first_flag,
+        const char *key,
+        const char *value,
+        const server_meta *m
+) {
+    int i;
+    for (i = first_flag; i < req->ntokens; i++) {
+        const char *f = req->tokens[i];
+        switch (f[0]) {
+        case 'O':
+            buf_printf(&c->out, " %s", f);
+            break;
+        case 'k':
+            buf_printf(&c->out, " k%s", key);
+            break;
+        case 'c':
+            if (value != NULL) buf_printf(&c->out, " c%llu", m->cas);
+            break;
+        case 'f':
+            if (value != NULL) buf_printf(&c->out, " f%u", m->flags);
+            break;
+        case 's':
+            if (value != NULL) buf_printf(&c->out, " s%zu", strlen(value));
+            break;
+        case 't':
+            if (value != NULL) {
+                const long ttl = m->exptime == 0 ? -1 : m->exptime - time(NULL);
+                buf_printf(&c->out, " t%ld", ttl < -1 ? 0 : ttl);
+            }
+            break;
+        }
+    }
+    buf_append(&c->out, "\r\n", 2);
+}
+
+// return the token of flag 'flag' in a meta command, or NULL if it is absent
+static const char *mc_meta_flag(mc_request *req, int first_flag, char flag) {
+    int i;
+    for (i = first_flag; i < req->ntokens; i++) {
+        if (req->tokens[i][0] == flag) {
+            return req->tokens[i] + 1;
+        }
+    }
+    return NULL;
+}
+
+static void mc_cmd_mg(server *srv, server_conn *c, mc_request *req) {
+    const char *key = req->tokens[1];
+    const char *value = server_lookup(srv, key);
+    server_meta m;
+    if (value == NULL || server_get_meta(srv, key, &m) < 0) {
+        mc_reply(c, req, "EN\r\n");
+        return;
+    }
+    const char *ttl = mc_meta_flag(req, 2, 'T');
+    long exptime;
+    if (ttl != NULL && mc_parse_long(ttl, &exptime) == 0) {
+        m.exptime = mc_exptime(exptime);
+        server_set_meta(srv, key, &m);
+    }
+    if (mc_meta_flag(req, 2, 'v') != NULL) {
+        const size_t len = strlen(value);
+        buf_printf(&c->out, "VA %zu", len);
+        mc_meta_flags(c, req, 2, key, value, &m);
+        buf_append(&c->out, value, len);
+        buf_append(&c->out, "\r\n", 2);
+    } else if (!req->noreply) {
+        buf_append_str(&c->out, "HD");
+        mc_meta_flags(c, req, 2, key, value, &m);
+    }
+}
+
+static void mc_cmd_ms(server *srv, server_conn *c, mc_request *req) {
+    const char *key = req->tokens[1];
+    int mode = MC_SET;
+    const char *f;
+    if ((f = mc_meta_flag(req, 3, 'M')) != NULL) {
+        switch (f[0]) {
+        case 'E': case 'e': mode = MC_ADD; break;
+        case 'A': case 'a': mode = MC_APPEND; break;
+        case 'P': case 'p': mode = MC_PREPEND; break;
+        case 'R': case 'r': mode = MC_REPLACE; break;
+        case 'S': case 's': mode = MC_SET; break;
+        default:
+            buf_append_str(&c->out, "CLIENT_ERROR invalid mode for ms\r\n");
+            return;
+        }
+    }
+    unsigned long long flags = 0, cas = 0;
+    long exptime = 0;
+    if ((f = mc_meta_flag(req, 3, 'F')) != NULL) mc_parse_ulong(f, &flags);
+    if ((f = mc_meta_flag(req, 3, 'T')) != NULL) mc_parse_long(f, &exptime);
+    if ((f = mc_meta_flag(req, 3, 'C')) != NULL) {
+        mc_parse_ulong(f, &cas);
+        // a compare is only meaningful for plain sets
+        if (mode == MC_SET) mode = MC_CAS;
+    }
+
+    const int r = mc_store(
+        srv, mode, key, req->data, (unsigned) flags, mc_exptime(exptime), cas
+    );
+    static const char *codes[] = {"HD", "NS", "EX", "NF"};
+    if (r == MC_STORED && req->noreply) {
+        return;
+    }
+    buf_append_str(&c->out, codes[r]);
+    server_meta m;
+    const char *value = r == MC_STORED ? server_lookup(srv, key) : NULL;
+    if (value != NULL) {
+        server_get_meta(srv, key, &m);
+    }
+    mc_meta_flags(c, req, 3, key, value, &m);
+}
+
+static void mc_cmd_md(server *srv, server_conn *c, mc_request *req) {
+    const char *key = req->tokens[1];
+    server_meta m;
+    if (server_lookup(srv, key) == NULL || server_get_meta(srv, key, &m) < 0) {
+        if (!req->noreply) {
+            buf_append_str(&c->out, "NF");
+            mc_meta_flags(c, req, 2, key, NULL, &m);
+        }
+        return;
+    }
+    const char *f = mc_meta_flag(req, 2, 'C');
+    unsigned long long cas;
+    if (f != NULL && (mc_parse_ulong(f, &cas) < 0 || cas != m.cas)) {
+        buf_append_str(&c->out, "EX");
+        mc_meta_flags(c, req, 2, key, NULL, &m);
+        return;
+    }
+    server_remove(srv, key);
+    if (!req->noreply) {
+        buf_append_str(&c->out, "HD");
+        mc_meta_flags(c, req, 2, key, NULL, &m);
+    }
+}
+
+static void mc_cmd_ma(server *srv, server_conn *c, mc_request *req) {
+    const char *key = req->tokens[1];
+    int incr = 1;
+    unsigned long long delta = 1, initial = 0, result;
+    const char *f;
+    if ((f = mc_meta_flag(req, 2, 'M')) != NULL) {
+        incr = !(f[0] == 'D' || f[0] == 'd' || f[0] == '-');
+    }
+    if ((f = mc_meta_flag(req, 2, 'D')) != NULL
+            && mc_parse_ulong(f, &delta) < 0) {
+        buf_append_str(&c->out, "CLIENT_ERROR bad token in command line format\r\n");
+        return;
+    }
+    if ((f = mc_meta_flag(req, 2, 'J')) != NULL) mc_parse_ulong(f, &initial);
+
+    int r = mc_arith(srv, key, incr, delta, &result);
+    // autovivify a missing counter with the initial value
+    const char *vivify = mc_meta_flag(req, 2, 'N');
+    if (r == -1 && vivify != NULL) {
+        long ttl = 0;
+        char value[32];
+        mc_parse_long(vivify, &ttl);
+        sprintf(value, "%llu", initial);
+        mc_store(srv, MC_SET, key, value, 0, mc_exptime(ttl), 0);
+        result = initial;
+        r = 0;
+    }
+    if (r == -2) {
+        buf_append_str(&c->out,
+            "CLIENT_ERROR cannot increment or decrement non-numeric value\r\n");
+        return;
+    }
+    server_meta m;
+    if (r == -1) {
+        if (!req->noreply) {
+            buf_append_str(&c->out, "NF");
+            mc_meta_flags(c, req, 2, key, NULL, &m);
+        }
+        return;
+    }
+    long exptime;
+    server_get_meta(srv, key, &m);
+    if ((f = mc_meta_flag(req, 2, 'T')) != NULL && mc_parse_long(f, &exptime) == 0) {
+        m.exptime = mc_exptime(exptime);
+        server_set_meta(srv, key, &m);
+    }
+    const char *value = server_lookup(srv, key);
+    if (mc_meta_flag(req, 2, 'v') != NULL) {
+        char number[32];
+        const int len = sprintf(number, "%llu", result);
+        buf_printf(&c->out, "VA %d", len);
+        mc_meta_flags(c, req, 2, key, value, &m);
+        buf_printf(&c->out, "%s\r\n", number);
+    } else if (!req->noreply) {
+        buf_append_str(&c->out, "HD");
+        mc_meta_flags(c, req, 2, key, value, &m);
+    }
+}
+
+// request parsing
+
+static int mc_tokenize(char *line, mc_request *req) {
+    req->ntokens = 0;
+    char *p = line;
+    while (*p != '\0') {
+        while (*p == ' ') p++;
+        if (*p == '\0') break;
+        if (req->ntokens == MC_MAX_TOKENS) {
+            return -1;
+        }
+        req->tokens[req->ntokens++] = p;
+        while (*p != ' ' && *p != '\0') p++;
+        if (*p == ' ') *p++ = '\0';
+    }
+    return 0;
+}
+
+static int mc_is(const mc_request *req, const char *name) {
+    return strcmp(req->tokens[0], name) == 0;
+}
+
+// commands whose first argument is a key
+static const char *mc_key_commands[] = {
+    "get", "gets", "set", "add", "replace", "append", "prepend", "cas",
+    "delete", "incr", "decr", "touch", "mg", "ms", "md", "ma", NULL
+};
+
+// commands modifying the data, which replicas refuse
+static const char *mc_write_commands[] = {
+    "set", "add", "replace", "append", "prepend", "cas", "delete", "incr",
+    "decr", "touch", "ms", "md", "ma", "flush_all", NULL
+};
+
+static int mc_is_any(const mc_request *req, const char **names) {
+    while (*names != NULL && !mc_is(req, *names)) {
+        names++;
+    }
+    return *names != NULL;
+}
+
+/* Thread-per-core mode: send a command to the shards owning its keys. The
+ * command line is 'line', up to its newline. Retrievals of keys owned by
+ * several shards are split into one command per key. Returns 1 if the
+ * command was forwarded or split, 0 if it must be executed here.
+ */
+static int mc_route(
+        server *srv,
+        server_conn *c,
+        mc_request *req,
+        const char *line,
+        size_t line_len
+) {
+    buffer *b = &srv->encode;
+    b->pos = b->len = 0;
+    if (mc_is(req, "flush_all")) {
+        server_broadcast(srv, c, SERVER_MERGE_FIRST, line, line_len);
+        return 0;
+    }
+    if (!mc_is_any(req, mc_key_commands) || req->ntokens < 2) {
+        return 0;
+    }
+    const int shard = server_shard_of(srv, req->tokens[1]);
+    if (mc_is(req, "get") || mc_is(req, "gets")) {
+        int i = 2;
+        while (i < req->ntokens && server_shard_of(srv, req->tokens[i]) == shard) {
+            i++;
+        }
+        if (i < req->ntokens) {
+            for (i = 1; i < req->ntokens; i++) {
+                buf_printf(&c->split, "%s %s\r\n", req->tokens[0], req->tokens[i]);
+            }
+            server_group_begin(c, SERVER_MERGE_VALUES, req->ntokens - 1);
+            return 1;
+        }
+    }
+    if (shard == srv->shard_id) {
+        return 0;
+    }
+    buf_append(b, line, line_len);
+    if (req->data != NULL) {
+        buf_append(b, req->data, req->data_len);
+        buf_append(b, "\r\n", 2);
+    }
+    server_forward(srv, c, shard, b->data, b->len);
+    return 1;
+}
+
+/* Execute the command at the start of 'buf', returns the number of bytes
+ * consumed, or 0 if the command is incomplete.
+ */
+static long mc_process_command(server *srv, server_conn *c, char *buf, size_t len) {
+    char *eol = memchr(buf, '\n', len);
+    if (eol == NULL) {
+        if (len > MC_MAX_LINE) {
+            buf_append_str(&c->out, "CLIENT_ERROR line too long\r\n");
+            c->closing = 1;
+            return len;
+        }
+        return 0;
+    }
+    size_t line_len = eol - buf;
+    if (line_len > 0 && buf[line_len - 1] == '\r') line_len--;
+    if (line_len > MC_MAX_LINE) {
+        buf_append_str(&c->out, "CLIENT_ERROR line too long\r\n");
+        c->closing = 1;
+        return len;
+    }
+    long consumed = eol + 1 - buf;
+
+    /* The line is tokenized in a copy so an incomplete data block leaves the
+     * input untouched until the rest arrives.
+     */
+    char line[MC_MAX_LINE + 1];
+    memcpy(line, buf, line_len);
+    line[line_len] = '\0';
+    mc_request req;
+    memset(&req, 0, sizeof(req));
+    if (mc_tokenize(line, &req) < 0) {
+        buf_append_str(&c->out, "CLIENT_ERROR too many tokens\r\n");
+        return consumed;
+    }
+    if (req.ntokens == 0) {
+        buf_append_str(&c->out, "ERROR\r\n");
+        return consumed;
+    }
+
+    // 'noreply' is not counted among the arguments of the command
+    const char *last = req.tokens[req.ntokens - 1];
+    if (req.tokens[0][0] == 'm' && req.tokens[0][1] != '\0'
+            && req.tokens[0][2] == '\0') {
+        // meta commands use the 'q' flag for quiet mode
+        int i;
+        for (i = 2; i < req.ntokens; i++) {
+            if (strcmp(req.tokens[i], "q") == 0) req.noreply = 1;
+        }
+    } else if (strcmp(last, "noreply") == 0) {
+        req.noreply = 1;
+        req.ntokens--;
+    }
+
+    // the data block of storage commands follows the command line
+    const int is_ms = mc_is(&req, "ms");
+    const int is_storage = mc_is(&req, "set") || mc_is(&req, "add")
+        || mc_is(&req, "replace") || mc_is(&req, "append")
+        || mc_is(&req, "prepend") || mc_is(&req, "cas");
+    if (is_storage || is_ms) {
+        const int min_tokens = is_ms ? 3 : mc_is(&req, "cas") ? 6 : 5;
+        const int size_token = is_ms ? 2 : 4;
+        if (req.ntokens < min_tokens || !mc_valid_key(req.tokens[1])) {
+            buf_append_str(&c->out, "CLIENT_ERROR bad command line format\r\n");
+            return consumed;
+        }
+        unsigned long long size;
+        if (mc_parse_ulong(req.tokens[size_token], &size) < 0 || size > MC_MAX_DATA
+                || (!is_ms && (mc_parse_ulong(req.tokens[2], &req.flags) < 0
+                               || mc_parse_long(req.tokens[3], &req.exptime) < 0))
+                || (mc_is(&req, "cas")
+                    && mc_parse_ulong(req.tokens[5], &req.cas) < 0)) {
+            buf_append_str(&c->out, "CLIENT_ERROR bad command line format\r\n");
+            c->closing = 1;
+            return len;
+        }
+        req.data_len = (long) size;
+        // the data block ends with "\r\n" or a lone '\n'
+        const long avail = (long) (len - consumed);
+        if (avail < req.data_len + 1) {
+            return 0;
+        }
+        req.data = buf + consumed;
+        char *end = req.data + req.data_len;
+        if (end[0] == '\n') {
+            consumed += req.data_len + 1;
+        } else if (end[0] == '\r' && avail < req.data_len + 2) {
+            return 0;
+        } else if (end[0] == '\r' && end[1] == '\n') {
+            consumed += req.data_len + 2;
+        } else {
+            buf_append_str(&c->out, "CLIENT_ERROR bad data chunk\r\n");
+            c->closing = 1;
+            return len;
+        }
+        end[0] = '\0';
+        if (memchr(req.data, '\0', req.data_len) != NULL) {
+            buf_append_str(&c->out,
+                "SERVER_ERROR values must not contain NUL bytes\r\n");
+            return consumed;
+        }
+    }
+
+    if (srv->cfg->replicaof != NULL && mc_is_any(&req, mc_write_commands)) {
+        buf_append_str(&c->out, "SERVER_ERROR read only replica\r\n");
+        return consumed;
+    }
+    if (srv->shards != NULL && c != srv->scratch
+            && mc_route(srv, c, &req, buf, eol + 1 - buf)) {
+        c->routed = 1;
+        return consumed;
+    }
+
+    if (mc_is(&req, "get") || mc_is(&req, "gets")) {
+        if (req.ntokens < 2) {
+            buf_append_str(&c->out, "ERROR\r\n");
+        } else {
+            mc_cmd_get(srv, c, &req, mc_is(&req, "gets"));
+        }
+    } else if (mc_is(&req, "set")) {
+        mc_cmd_store(srv, c, &req, MC_SET);
+    } else if (mc_is(&req, "add")) {
+        mc_cmd_store(srv, c, &req, MC_ADD);
+    } else if (mc_is(&req, "replace")) {
+        mc_cmd_store(srv, c, &req, MC_REPLACE);
+    } else if (mc_is(&req, "append")) {
+        mc_cmd_store(srv, c, &req, MC_APPEND);
+    } else if (mc_is(&req, "prepend")) {
+        mc_cmd_store(srv, c, &req, MC_PREPEND);
+    } else if (mc_is(&req, "cas")) {
+        mc_cmd_store(srv, c, &req, MC_CAS);
+    } else if (mc_is(&req, "delete") && req.ntokens == 2) {
+        mc_cmd_delete(srv, c, &req);
+    } else if ((mc_is(&req, "incr") || mc_is(&req, "decr")) && req.ntokens == 3) {
+        mc_cmd_arith(srv, c, &req, mc_is(&req, "incr"));
+    } else if (mc_is(&req, "touch") && req.ntokens == 3) {
+        mc_cmd_touch(srv, c, &req);
+    } else if (is_ms) {
+        mc_cmd_ms(srv, c, &req);
+    } else if (mc_is(&req, "mg") && req.ntokens >= 2) {
+        mc_cmd_mg(srv, c, &req);
+    } else if (mc_is(&req, "md") && req.ntokens >= 2) {
+        mc_cmd_md(srv, c, &req);
+    } else if (mc_is(&req, "ma") && req.ntokens >= 2) {
+        mc_cmd_ma(srv, c, &req);
+    } else if (mc_is(&req, "mn")) {
+        buf_append_str(&c->out, "MN\r\n");
+    } else if (mc_is(&req, "flush_all")) {
+        server_flush_all(srv);
+        mc_reply(c, &req, "OK\r\n");
+    } else if (mc_is(&req, "version")) {
+        buf_append_str(&c->out, "VERSION 1.6.0-hashtab\r\n");
+    } else if (mc_is(&req, "verbosity")) {
+        mc_reply(c, &req, "OK\r\n");
+    } else if (mc_is(&req, "quit")) {
+        c->closing = 1;
+    } else {
+        buf_append_str(&c->out, "ERROR\r\n");
+    }
+    return consumed;
+}
+
+// execute every complete memcached command in the input buffer
+void mc_process_input(server *srv, server_conn *c) {
+    const int sharded = srv->shards != NULL && c != srv->scratch;
+    while (!c->closing && server_pending_replies(c) < SERVER_MAX_INFLIGHT
+            && (buf_pending(&c->split) > 0 || buf_pending(&c->in) > 0)) {
+        buffer *in = buf_pending(&c->split) > 0 ? &c->split : &c->in;
+        const size_t mark = buf_pending(&c->out);
+        c->routed = 0;
+        const long n = mc_process_command(
+            srv, c, in->data + in->pos, buf_pending(in)
+        );
+        if (n == 0) {
+            break;
+        }
+        buf_consume(in, n);
+        if (sharded && !c->routed) {
+            server_local_reply(c, mark);
+        }
+    }
+}
@@ -0,0 +1,416 @@
+/* Memory overhead of the table layouts.
+ *
+ * For every number of entries, keys and values with lengths drawn uniformly
+ * from the given ranges are inserted in each layout, and the memory the
+ * filled layout holds is reported per entry, both as allocated according to
+ * malloc (mallinfo2(), allocator headers and padding included) and as
+ * resident set size, along with what it costs beyond the bytes of the keys
+ * and values themselves.
+ *
+ * The layouts are:
+ *   pointer  the table of hash_table.c, an array of pointers to items
+ *            allocated on their own, each pointing to its key and value
+ *   inline   the linear probing table of linear_table.c, whose array holds
+ *            the entries with their hash and key and value pointers
+ *   pooled   the pointer layout with the items, keys and values carved out
+ *            of 1 MiB chunks instead of being allocated one by one
+ *   compact  an array of 32 bit references to records holding the lengths,
+ *            key and value bytes back to back in 1 MiB chunks
+ *
+ * pooled and compact are models of layouts the table does not have: they
+ * only place the entries as such a table would, with as many buckets as the
+ * pointer layout ended up with, so their figures are what moving the table
+ * to them would save.
+ */
+
+#define _GNU_SOURCE
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "bench_util.h"
+#include "fnv.h"
+#include "hash_table.h"
+#include "linear_table.h"
+#include "xmalloc.h"
+
+#define MEM_MAX_LIST 16
+#define MEM_MIN_KEY (BENCH_INDEX_CHARS + 1)
+#define MEM_MAX_LEN 65536
+#define MEM_CHUNK (1 << 20)
+
+typedef struct {
+    long n;
+    char *data;
+    const char **keys;
+    const char **values;
+    // bytes of the keys and values, without terminators
+    size_t payload;
+} mem_entries;
+
+// memory of the process, see mem_usage()
+typedef struct {
+    size_t heap;
+    size_t rss;
+} mem_snapshot;
+
+typedef struct {
+    const char *name;
+    // build the layout holding 'e', with 'buckets' buckets when it has to
+    void *(*build)(const mem_entries *e, int buckets);
+    void (*destroy)(void *t);
+    int (*buckets)(const void *t);
+} mem_layout;
+
+// allocated bytes, mmap()ed blocks included, and resident set size
+static void mem_usage(mem_snapshot *usage) {
+    usage->heap = bench_heap_bytes();
+    usage->rss = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    unsigned long size, resident;
+    if (statm != NULL) {
+        if (fscanf(statm, "%lu %lu", &size, &resident) == 2) {
+            usage->rss = resident * (size_t) sysconf(_SC_PAGESIZE);
+        }
+        fclose(statm);
+    }
+}
+
+static long mem_length(long min, long max, uint64_t r) {
+    return min + (long) (r % (uint64_t) (max - min + 1));
+}
+
+/* Generate 'n' entries. Keys start with their index so they are unique and
+ * are padded with pseudo-random characters, values are repeated letters.
+ */
+static void mem_entries_init(
+        mem_entries *e,
+        long n,
+        const long *key_len,
+        const long *value_len
+) {
+    e->n = n;
+    e->keys = xmalloc((size_t) n * sizeof(char *));
+    e->values = xmalloc((size_t) n * sizeof(char *));
+    e->payload = 0;
+    size_t total = 0;
+    long i;
+    for (i = 0; i < n; i++) {
+        total += mem_length(key_len[0], key_len[1], bench_mix(2 * i))
+            + mem_length(value_len[0], value_len[1], bench_mix(2 * i + 1)) + 2;
+    }
+    e->data = xmalloc(total);
+    char *p = e->data;
+    for (i = 0; i < n; i++) {
+        const long klen = mem_length(key_len[0], key_len[1], bench_mix(2 * i));
+        const long vlen = mem_length(value_len[0], value_len[1], bench_mix(2 * i + 1));
+        bench_index_chars(p, i);
+        bench_random_chars(p + BENCH_INDEX_CHARS, klen - BENCH_INDEX_CHARS, i);
+        p[klen] = '\0';
+        e->keys[i] = p;
+        p += klen + 1;
+        memset(p, 'a' + i % 26, vlen);
+        p[vlen] = '\0';
+        e->values[i] = p;
+        p += vlen + 1;
+        e->payload += klen + vlen;
+    }
+}
+
+static void mem_entries_free(mem_entries *e) {
+    free(e->data);
+    free(e->keys);
+    free(e->values);
+}
+
+static void *pointer_build(const mem_entries *e, int buckets) {
+    (void) buckets;
+    ht_hash_table *ht = ht_new();
+    long i;
+    for (i = 0; i < e->n; i++) {
+        ht_insert(ht, e->keys[i], e->values[i]);
+    }
+    return ht;
+}
+
+static void pointer_destroy(void *t) {
+    ht_del_hash_table(t);
+}
+
+static int pointer_buckets(const void *t) {
+    return ((const ht_hash_table *) t)->size;
+}
+
+static void *inline_build(const mem_entries *e, int buckets) {
+    (void) buckets;
+    lp_table *t = lp_new();
+    long i;
+    for (i = 0; i < e->n; i++) {
+        lp_insert(t, e->keys[i], e->values[i]);
+    }
+    return t;
+}
+
+static void inline_destroy(void *t) {
+    lp_free(t);
+}
+
+static int inline_buckets(const void *t) {
+    return (int) (((const lp_table *) t)->mask + 1);
+}
+
+// chunks the pooled and compact layouts allocate their entries from
+typedef struct {
+    char **chunks;
+    int num_chunks;
+    int max_chunks;
+    size_t used;
+} mem_pool;
+
+// 'size' bytes aligned on 'align' from the last chunk, or from a new one
+static char *pool_alloc(mem_pool *pool, size_t size, size_t align, int *chunk, size_t *offset) {
+    pool->used = (pool->used + align - 1) & ~(align - 1);
+    if (pool->num_chunks == 0 || pool->used + size > MEM_CHUNK) {
+        if (pool->num_chunks == pool->max_chunks) {
+            pool->max_chunks = pool->max_chunks > 0 ? pool->max_chunks * 2 : 16;
+            pool->chunks = xrealloc(pool->chunks, pool->max_chunks * sizeof(char *));
+        }
+        pool->chunks[pool->num_chunks++] = xmalloc(MEM_CHUNK);
+        pool->used = 0;
+    }
+    *chunk = pool->num_chunks - 1;
+    *offset = pool->used;
+    pool->used += size;
+    return pool->chunks[*chunk] + *offset;
+}
+
+static void pool_free(mem_pool *pool) {
+    int i;
+    for (i = 0; i < pool->num_chunks; i++) {
+        free(pool->chunks[i]);
+    }
+    free(pool->chunks);
+}
+
+typedef struct {
+    int size;
+    ht_item **items;
+    mem_pool pool;
+} pooled_table;
+
+static void *pooled_build(const mem_entries *e, int buckets) {
+    pooled_table *t = xcalloc(1, sizeof(pooled_table));
+    t->size = buckets;
+    t->items = xcalloc(buckets, sizeof(ht_item *));
+    long i;
+    for (i = 0; i < e->n; i++) {
+        const size_t klen = strlen(e->keys[i]) + 1;
+        const size_t vlen = strlen(e->values[i]) + 1;
+        int chunk;
+        size_t offset;
+        ht_item *item = (ht_item *) pool_alloc(
+            &t->pool,
+            sizeof(ht_item) + klen + vlen,
+            sizeof(void *),
+            &chunk,
+            &offset
+        );
+        item->key = (char *) (item + 1);
+        item->value = item->key + klen;
+        memcpy(item->key, e->keys[i], klen);
+        memcpy(item->value, e->values[i], vlen);
+        size_t b = fnv1a_64(e->keys[i], klen - 1) % buckets;
+        while (t->items[b] != NULL) {
+            b = (b + 1) % buckets;
+        }
+        t->items[b] = item;
+    }
+    return t;
+}
+
+static void pooled_destroy(void *t) {
+    pooled_table *p = t;
+    pool_free(&p->pool);
+    free(p->items);
+    free(p);
+}
+
+static int pooled_buckets(const void *t) {
+    return ((const pooled_table *) t)->size;
+}
+
+/* A record is its key and value lengths as two uint32_t followed by their
+ * bytes, without terminators. Buckets hold the position of the record in
+ * the chunks plus one, 0 being empty.
+ */
+typedef struct {
+    int size;
+    uint32_t *refs;
+    mem_pool pool;
+} compact_table;
+
+static void *compact_build(const mem_entries *e, int buckets) {
+    compact_table *t = xcalloc(1, sizeof(compact_table));
+    t->size = buckets;
+    t->refs = xcalloc(buckets, sizeof(uint32_t));
+    long i;
+    for (i = 0; i < e->n; i++) {
+        const uint32_t klen = strlen(e->keys[i]);
+        const uint32_t vlen = strlen(e->values[i]);
+        int chunk;
+        size_t offset;
+        char *record = pool_alloc(
+            &t->pool,
+            2 * sizeof(uint32_t) + klen + vlen,
+            sizeof(uint32_t),
+            &chunk,
+            &offset
+        );
+        const uint64_t ref = (uint64_t) chunk * MEM_CHUNK + offset + 1;
+        if (ref > UINT32_MAX) {
+            fprintf(stderr, "Too many entries for 32 bit references.\n");
+            exit(1);
+        }
+        memcpy(record, &klen, sizeof(uint32_t));
+        memcpy(record + sizeof(uint32_t), &vlen, sizeof(uint32_t));
+        memcpy(record + 2 * sizeof(uint32_t), e->keys[i], klen);
+        memcpy(record + 2 * sizeof(uint32_t) + klen, e->values[i], vlen);
+        size_t b = fnv1a_64(e->keys[i], klen) % buckets;
+        while (t->refs[b] != 0) {
+            b = (b + 1) % buckets;
+        }
+        t->refs[b] = (uint32_t) ref;
+    }
+    return t;
+}
+
+static void compact_destroy(void *t) {
+    compact_table *c = t;
+    pool_free(&c->pool);
+    free(c->refs);
+    free(c);
+}
+
+static int compact_buckets(const void *t) {
+    return ((const compact_table *) t)->size;
+}
+
+// the pointer layout comes first, the models take its number of buckets
+static const mem_layout layouts[] = {
+    {"pointer", pointer_build, pointer_destroy, pointer_buckets},
+    {"inline", inline_build, inline_destroy, inline_buckets},
+    {"pooled", pooled_build, pooled_destroy, pooled_buckets},
+    {"compact", compact_build, compact_destroy, compact_buckets},
+};
+
+#define MEM_NUM_LAYOUTS ((int) (sizeof(layouts) / sizeof(layouts[0])))
+
+// parse "min-max" or a single length into 'range', returns -1 on errors
+static int parse_range(const char *arg, long *range) {
+    char *end;
+    range[0] = strtol(arg, &end, 10);
+    range[1] = range[0];
+    if (*end == '-') {
+        range[1] = strtol(end + 1, &end, 10);
+    }
+    return *end == '\0' && range[0] >= 0 && range[0] <= range[1]
+        && range[1] <= MEM_MAX_LEN ? 0 : -1;
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-n entries] [-k key_length] [-v value_length]\n"
+        "  -n  comma separated numbers of entries, with an optional K or M\n"
+        "      suffix (default: 100K,1M)\n"
+        "  -k  length of the keys, or range of lengths as min-max, at least %d\n"
+        "      (default: 8-32)\n"
+        "  -v  length of the values, or range of lengths as min-max\n"
+        "      (default: 16-128)\n",
+        prog,
+        MEM_MIN_KEY
+    );
+}
+
+int main(int argc, char *argv[]) {
+    long sizes[MEM_MAX_LIST] = {100000, 1000000};
+    int num_sizes = 2;
+    long key_len[2] = {8, 32};
+    long value_len[2] = {16, 128};
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:k:v:h")) != -1) {
+        switch (opt) {
+        case 'n':
+            num_sizes = bench_parse_list(optarg, sizes, MEM_MAX_LIST);
+            break;
+        case 'k':
+            if (parse_range(optarg, key_len) == -1) {
+                key_len[0] = 0;
+            }
+            break;
+        case 'v':
+            if (parse_range(optarg, value_len) == -1) {
+                value_len[0] = -1;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc || num_sizes < 1 || key_len[0] < MEM_MIN_KEY || value_len[0] < 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    printf(
+        "%10s %-8s %10s %11s %11s %11s %9s\n",
+        "entries", "layout", "buckets", "heap/entry", "rss/entry", "overhead", "vs_ptr"
+    );
+    int s;
+    for (s = 0; s < num_sizes; s++) {
+        if (sizes[s] > BENCH_MAX_INDEX + 1) {
+            fprintf(stderr, "At most 62^%d entries.\n", BENCH_INDEX_CHARS);
+            return 1;
+        }
+        mem_entries entries;
+        mem_entries_init(&entries, sizes[s], key_len, value_len);
+        const double payload = (double) entries.payload / entries.n;
+        int buckets = 0;
+        double pointer_heap = 0;
+        int l;
+        for (l = 0; l < MEM_NUM_LAYOUTS; l++) {
+            // give back what the previous layout freed so RSS starts low
+            malloc_trim(0);
+            mem_snapshot before, after;
+            mem_usage(&before);
+            void *t = layouts[l].build(&entries, buckets);
+            mem_usage(&after);
+            if (l == 0) {
+                buckets = layouts[l].buckets(t);
+            }
+            const double heap = (double) (after.heap - before.heap) / entries.n;
+            const double rss = ((double) after.rss - before.rss) / entries.n;
+            if (l == 0) {
+                pointer_heap = heap;
+            }
+            printf(
+                "%10ld %-8s %10d %11.1f %11.1f %11.1f %8.1f%%\n",
+                entries.n,
+                layouts[l].name,
+                layouts[l].buckets(t),
+                heap,
+                rss,
+                heap - payload,
+                (heap - pointer_heap) * 100 / pointer_heap
+            );
+            layouts[l].destroy(t);
+        }
+        printf("%10ld %-8s %10s %11.1f\n", entries.n, "payload", "", payload);
+        mem_entries_free(&entries);
+    }
+    return 0;
+}
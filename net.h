@@ -0,0 +1,10 @@
+#ifndef NET_HEADER
+#define NET_HEADER
+
+/* Connect a stream socket to 'addr', the path of a Unix socket when it
+ * contains a '/' and "host:port" otherwise. Returns a blocking socket, or -1
+ * on error.
+ */
+int net_connect(const char *addr);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef PROBES_HEADER
+#define PROBES_HEADER
+
+/* USDT static tracepoints of the 'hashtab' provider, for bpftrace, perf or
+ * SystemTap to attach to a running process:
+ *
+ *   resize_start(table, old_size, new_size, count)
+ *   resize_end(table, old_size, new_size, moved, duration_ns)
+ *   long_chain(table, key, buckets)    a key took at least HT_LONG_CHAIN
+ *                                      buckets to find, insert or delete
+ *   malloc(ptr, size)                  xmalloc() and xcalloc()
+ *   realloc(old_ptr, ptr, size)        xrealloc()
+ *
+ * They are only built in with -DHT_USDT, which needs the sys/sdt.h header of
+ * SystemTap. Each one is then a nop instruction until a tracer attaches, and
+ * otherwise nothing is compiled at all, arguments included. For instance:
+ *
+ *   bpftrace -e 'usdt:./hashtab:hashtab:resize_end { @ns = hist(arg4); }'
+ */
+#ifdef HT_USDT
+#include <sys/sdt.h>
+#define HT_PROBE(name, ...) STAP_PROBEV(hashtab, name, __VA_ARGS__)
+#else
+#define HT_PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,332 @@
+/* Replay a trace of table operations, recorded with ht->trace or the -T
+ * option of the server, see trace.h.
+ *
+ * The operations are executed in order against a fresh in-memory table or a
+ * bitcask store, as fast as possible unless the original pacing is asked
+ * for. Inserted values are made of 'v' bytes of the recorded length. A
+ * search whose outcome differs from the recorded one is counted as a
+ * mismatch, which happens when the trace started on a table that already
+ * held keys. Replaying the same trace always gives the same results.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bitcask.h"
+#include "hash_table.h"
+#include "histogram.h"
+#include "trace.h"
+#include "xmalloc.h"
+
+enum { ENGINE_TABLE, ENGINE_BITCASK };
+
+static const char *op_names[] = {"", "insert", "search", "delete", "flush"};
+
+typedef struct {
+    int engine;
+    ht_hash_table *ht;
+    // initial size index of the table, also used after a flush
+    int size_index;
+    bc_store *bc;
+    int batch_size;
+    // searches waiting to be run as a batch, with their recorded outcomes
+    char **keys;
+    size_t *key_caps;
+    int *recorded;
+    char **results;
+    int num_keys;
+    char *value;
+    size_t value_cap;
+    unsigned long long ops[TRACE_FLUSH + 1];
+    unsigned long long recorded_hits;
+    unsigned long long hits;
+    unsigned long long mismatches;
+    unsigned long long errors;
+} replay;
+
+static void replay_check(replay *r, int recorded, int found) {
+    r->recorded_hits += recorded;
+    r->hits += found;
+    r->mismatches += recorded != found;
+}
+
+// run the pending searches
+static void replay_flush(replay *r) {
+    if (r->num_keys == 0) {
+        return;
+    }
+    ht_search_batch(r->ht, (const char **) r->keys, r->num_keys, r->results);
+    int i;
+    for (i = 0; i < r->num_keys; i++) {
+        replay_check(r, r->recorded[i], r->results[i] != NULL);
+    }
+    r->num_keys = 0;
+}
+
+static void replay_search(replay *r, const trace_op *op) {
+    if (r->batch_size > 1) {
+        const int i = r->num_keys++;
+        if (op->key_len + 1 > r->key_caps[i]) {
+            r->key_caps[i] = op->key_len + 1;
+            r->keys[i] = xrealloc(r->keys[i], r->key_caps[i]);
+        }
+        memcpy(r->keys[i], op->key, op->key_len + 1);
+        r->recorded[i] = op->hit;
+        if (r->num_keys == r->batch_size) {
+            replay_flush(r);
+        }
+        return;
+    }
+    if (r->engine == ENGINE_TABLE) {
+        replay_check(r, op->hit, ht_search(r->ht, op->key) != NULL);
+        return;
+    }
+    char *value = bc_get(r->bc, op->key);
+    replay_check(r, op->hit, value != NULL);
+    free(value);
+}
+
+/* Remove every key, as the server does by replacing its table. The latencies
+ * and resizes of the table carry over to the new one.
+ */
+static void replay_clear(replay *r) {
+    if (r->engine == ENGINE_TABLE) {
+        ht_hash_table *old = r->ht;
+        r->ht = ht_new_sized(r->size_index);
+        r->ht->latency = old->latency;
+        r->ht->resizes = old->resizes;
+        r->ht->resize_ns = old->resize_ns;
+        old->latency = NULL;
+        ht_del_hash_table(old);
+        return;
+    }
+    // the keys are copied first since deleting them changes the index
+    const int n = r->bc->index->count;
+    char **keys = xmalloc((n > 0 ? n : 1) * sizeof(char *));
+    int index = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        keys[i] = xstrdup(ht_next_item(r->bc->index, &index)->key);
+    }
+    for (i = 0; i < n; i++) {
+        if (bc_delete(r->bc, keys[i]) < 0) {
+            r->errors++;
+        }
+        free(keys[i]);
+    }
+    free(keys);
+}
+
+static void replay_op(replay *r, const trace_op *op) {
+    r->ops[op->op]++;
+    if (op->op == TRACE_SEARCH) {
+        replay_search(r, op);
+        return;
+    }
+    // the searches before an insert, delete or flush must not see it
+    replay_flush(r);
+    if (op->op == TRACE_FLUSH) {
+        replay_clear(r);
+        return;
+    }
+    if (op->op == TRACE_DELETE) {
+        if (r->engine == ENGINE_TABLE) {
+            ht_delete(r->ht, op->key);
+        } else if (bc_delete(r->bc, op->key) < 0) {
+            r->errors++;
+        }
+        return;
+    }
+    if (op->value_len + 1 > r->value_cap) {
+        r->value = xrealloc(r->value, op->value_len + 1);
+        memset(r->value + r->value_cap, 'v', op->value_len + 1 - r->value_cap);
+        r->value_cap = op->value_len + 1;
+    }
+    r->value[op->value_len] = '\0';
+    if (r->engine == ENGINE_TABLE) {
+        ht_insert(r->ht, op->key, r->value);
+    } else if (bc_put(r->bc, op->key, r->value) < 0) {
+        r->errors++;
+    }
+    r->value[op->value_len] = 'v';
+}
+
+// sleep until 'offset' nanoseconds after 'start'
+static void replay_wait(uint64_t start, uint64_t offset) {
+    const uint64_t now = hist_now_ns();
+    if (now - start >= offset) {
+        return;
+    }
+    const uint64_t ns = start + offset - now;
+    struct timespec ts = {(time_t) (ns / 1000000000), (long) (ns % 1000000000)};
+    nanosleep(&ts, NULL);
+}
+
+static void print_latency(const char *name, const histogram *h) {
+    if (h->count == 0) {
+        return;
+    }
+    printf(
+        "%s latency ns: p50 %llu, p99 %llu, p99.9 %llu, max %llu\n",
+        name,
+        (unsigned long long) hist_percentile(h, 0.5),
+        (unsigned long long) hist_percentile(h, 0.99),
+        (unsigned long long) hist_percentile(h, 0.999),
+        (unsigned long long) h->max
+    );
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-e engine] [-d directory] [-i size_index] [-b batch_size]\n"
+        "          [-l] [-p] trace\n"
+        "  -e  'table' or 'bitcask' (default: table)\n"
+        "  -d  directory of the bitcask store, which should be empty\n"
+        "  -i  initial size index of the table (default: 0)\n"
+        "  -b  run up to this many consecutive searches as a batch (table only)\n"
+        "  -l  report the latencies of the operations (table only)\n"
+        "  -p  keep the pacing of the trace instead of replaying at full speed\n",
+        prog
+    );
+}
+
+int main(int argc, char *argv[]) {
+    replay r;
+    memset(&r, 0, sizeof(r));
+    r.engine = ENGINE_TABLE;
+    r.batch_size = 1;
+    const char *dir = NULL;
+    int track_latency = 0;
+    int paced = 0;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "e:d:i:b:lph")) != -1) {
+        switch (opt) {
+        case 'e':
+            if (strcmp(optarg, "table") == 0) {
+                r.engine = ENGINE_TABLE;
+            } else if (strcmp(optarg, "bitcask") == 0) {
+                r.engine = ENGINE_BITCASK;
+            } else {
+                fprintf(stderr, "Unknown engine '%s'.\n", optarg);
+                return 1;
+            }
+            break;
+        case 'd':
+            dir = optarg;
+            break;
+        case 'i':
+            r.size_index = atoi(optarg);
+            break;
+        case 'b':
+            r.batch_size = atoi(optarg);
+            break;
+        case 'l':
+            track_latency = 1;
+            break;
+        case 'p':
+            paced = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (argc - optind != 1 || r.size_index < 0 || r.size_index > 24
+            || r.batch_size < 1 || (r.engine == ENGINE_BITCASK
+                && (dir == NULL || r.batch_size > 1 || track_latency))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    trace_reader *reader = trace_open(argv[optind]);
+    if (reader == NULL) {
+        fprintf(stderr, "Could not read the trace %s.\n", argv[optind]);
+        return 1;
+    }
+    if (r.engine == ENGINE_TABLE) {
+        r.ht = ht_new_sized(r.size_index);
+        ht_track_latency(r.ht, track_latency);
+    } else {
+        r.bc = bc_open(dir);
+        if (r.bc == NULL) {
+            fprintf(stderr, "Could not open the store in %s.\n", dir);
+            return 1;
+        }
+    }
+    r.keys = xcalloc(r.batch_size, sizeof(char *));
+    r.key_caps = xcalloc(r.batch_size, sizeof(size_t));
+    r.recorded = xcalloc(r.batch_size, sizeof(int));
+    r.results = xcalloc(r.batch_size, sizeof(char *));
+
+    int status = 0;
+    uint64_t duration = 0;
+    const uint64_t start = hist_now_ns();
+    trace_op op;
+    int more;
+    while ((more = trace_read(reader, &op)) > 0) {
+        if (paced) {
+            replay_wait(start, op.time_ns);
+        }
+        replay_op(&r, &op);
+        duration = op.time_ns;
+    }
+    replay_flush(&r);
+    const double elapsed = (hist_now_ns() - start) / 1e9;
+    if (more < 0) {
+        fprintf(stderr, "The trace is truncated or corrupt.\n");
+        status = 1;
+    }
+
+    const unsigned long long total = r.ops[TRACE_INSERT] + r.ops[TRACE_SEARCH]
+        + r.ops[TRACE_DELETE] + r.ops[TRACE_FLUSH];
+    printf(
+        "%llu operations in %.3f s (%.0f ops/s), recorded over %.3f s\n",
+        total,
+        elapsed,
+        elapsed > 0 ? total / elapsed : 0.0,
+        duration / 1e9
+    );
+    int i;
+    for (i = TRACE_INSERT; i <= TRACE_FLUSH; i++) {
+        printf("%s: %llu\n", op_names[i], r.ops[i]);
+    }
+    printf(
+        "search hits: %llu recorded, %llu replayed, %llu mismatches\n",
+        r.recorded_hits,
+        r.hits,
+        r.mismatches
+    );
+    if (r.errors > 0) {
+        printf("errors: %llu\n", r.errors);
+        status = 1;
+    }
+    const ht_hash_table *ht = r.engine == ENGINE_TABLE ? r.ht : r.bc->index;
+    printf("keys: %d, buckets: %d, resizes: %lu\n", ht->count, ht->size, ht->resizes);
+    if (track_latency) {
+        print_latency("insert", &ht->latency->insert);
+        print_latency("search", &ht->latency->search);
+        print_latency("delete", &ht->latency->delete);
+        print_latency("resize", &ht->latency->resize);
+    }
+
+    for (i = 0; i < r.batch_size; i++) {
+        free(r.keys[i]);
+    }
+    free(r.keys);
+    free(r.key_caps);
+    free(r.recorded);
+    free(r.results);
+    free(r.value);
+    if (r.engine == ENGINE_TABLE) {
+        ht_del_hash_table(r.ht);
+    } else {
+        bc_close(r.bc);
+    }
+    trace_reader_close(reader);
+    return status;
+}
@@ -0,0 +1,317 @@
+/* Primary to replica replication of the key-value server.
+ *
+ * A replica connects to its primary and sends SYNC. The primary answers with
+ * a snapshot of its tables, then streams every change as a RESP array:
+ *
+ *   FULLRESYNC <offset>        start of the snapshot
+ *   PUT <key> <value>          value of a key
+ *   META <key> <metadata>      memcached metadata of a key
+ *   UNMETA <key>               metadata of a key removed
+ *   DEL <key>                  key and metadata removed
+ *   FLUSH                      every key removed
+ *   SYNCED                     end of the snapshot
+ *
+ * The offset counts the bytes of operations streamed by the primary since it
+ * started. Replicas apply operations as they arrive and acknowledge the
+ * offset they reached with REPLCONF ACK <offset>, so the primary knows how
+ * far behind each one is, as reported by ROLE. A replica whose unsent
+ * changes pass SERVER_MAX_OUTPUT is dropped. Replicas refuse writes from
+ * their clients.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "buffer.h"
+#include "resp.h"
+#include "net.h"
+#include "server_internal.h"
+
+static void repl_encode(buffer *b, int argc, const char **argv) {
+    resp_array(b, argc);
+    int i;
+    for (i = 0; i < argc; i++) {
+        resp_bulk(b, argv[i], strlen(argv[i]));
+    }
+}
+
+/* Drop a replica which does not keep up with the changes. Its output is
+ * discarded and its socket shut down, so the event loop closes it at once.
+ */
+static void repl_drop(server *srv, server_conn *c) {
+    fprintf(stderr, "Dropped a replica too far behind.\n");
+    repl_unlink(srv, c);
+    c->out.pos = c->out.len = 0;
+    c->closing = 1;
+    shutdown(c->fd, SHUT_RDWR);
+}
+
+// send a change of the tables to every replica
+void repl_propagate(server *srv, int argc, const char **argv) {
+    if (srv->num_replicas == 0) {
+        return;
+    }
+    buffer *b = &srv->encode;
+    b->pos = b->len = 0;
+    repl_encode(b, argc, argv);
+    int i;
+    // dropping a replica moves the last one in its place
+    for (i = srv->num_replicas - 1; i >= 0; i--) {
+        server_conn *c = srv->replicas[i];
+        if (server_out_pending(c) + b->len > c->repl_max_output) {
+            repl_drop(srv, c);
+        } else {
+            buf_append(&c->out, b->data, b->len);
+        }
+    }
+    srv->repl_offset += b->len;
+    srv->repl_dirty = 1;
+}
+
+// forget a replication link that is being closed
+void repl_unlink(server *srv, server_conn *c) {
+    if (c == srv->master) {
+        fprintf(stderr, "Lost the link to the primary.\n");
+        srv->master = NULL;
+        srv->master_state = REPL_LOST;
+        return;
+    }
+    int i;
+    for (i = 0; i < srv->num_replicas; i++) {
+        if (srv->replicas[i] == c) {
+            srv->replicas[i] = srv->replicas[--srv->num_replicas];
+            return;
+        }
+    }
+}
+
+// primary side
+
+/* Turn the connection into a replica: send it a snapshot of the tables, then
+ * every change made from now on.
+ */
+void repl_cmd_sync(server *srv, server_conn *c, resp_command *cmd) {
+    (void) cmd;
+    if (srv->shards != NULL) {
+        resp_error(&c->out, "ERR replication requires a single thread");
+        return;
+    }
+    if (c->replica) {
+        resp_error(&c->out, "ERR already a replica");
+        return;
+    }
+    if (srv->num_replicas == srv->replicas_cap) {
+        srv->replicas_cap = srv->replicas_cap == 0 ? 4 : srv->replicas_cap * 2;
+        srv->replicas = xrealloc(
+            srv->replicas,
+            srv->replicas_cap * sizeof(server_conn *)
+        );
+    }
+    srv->replicas[srv->num_replicas++] = c;
+    c->replica = 1;
+    c->srv = srv;
+    c->repl_ack = srv->repl_offset;
+
+    char offset[32];
+    snprintf(offset, sizeof(offset), "%llu", srv->repl_offset);
+    const char *start[] = {"FULLRESYNC", offset};
+    repl_encode(&c->out, 2, start);
+    int index = 0;
+    ht_item *item;
+    while ((item = ht_next_item(srv->ht, &index)) != NULL) {
+        const char *op[] = {"PUT", item->key, item->value};
+        repl_encode(&c->out, 3, op);
+    }
+    index = 0;
+    while ((item = ht_next_item(srv->meta, &index)) != NULL) {
+        const char *op[] = {"META", item->key, item->value};
+        repl_encode(&c->out, 3, op);
+    }
+    const char *end[] = {"SYNCED"};
+    repl_encode(&c->out, 1, end);
+    c->repl_max_output = server_out_pending(c) + SERVER_MAX_OUTPUT;
+    srv->repl_dirty = 1;
+}
+
+void repl_cmd_replconf(server *srv, server_conn *c, resp_command *cmd) {
+    (void) srv;
+    if (strcasecmp(cmd->argv[1], "ACK") == 0) {
+        // acknowledgements have no reply, they are interleaved with the stream
+        if (c->replica && cmd->argc == 3) {
+            c->repl_ack = strtoull(cmd->argv[2], NULL, 10);
+        }
+        return;
+    }
+    resp_simple(&c->out, "OK");
+}
+
+static void repl_peer_name(int fd, char *host, size_t host_len, char *port) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+    host[0] = '\0';
+    strcpy(port, "0");
+    if (getpeername(fd, (struct sockaddr *) &addr, &len) < 0) {
+        return;
+    }
+    if (addr.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *) &addr;
+        inet_ntop(AF_INET, &in->sin_addr, host, host_len);
+        sprintf(port, "%u", ntohs(in->sin_port));
+    } else if (addr.ss_family == AF_INET6) {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *) &addr;
+        inet_ntop(AF_INET6, &in6->sin6_addr, host, host_len);
+        sprintf(port, "%u", ntohs(in6->sin6_port));
+    }
+}
+
+/* Reply with the role of the server, in the format of Redis. A primary lists
+ * the offset acknowledged by each replica, a replica the offset it applied.
+ */
+void repl_cmd_role(server *srv, server_conn *c, resp_command *cmd) {
+    (void) cmd;
+    char buf[64];
+    if (srv->cfg->replicaof == NULL) {
+        resp_array(&c->out, 3);
+        resp_bulk(&c->out, "master", 6);
+        resp_integer(&c->out, (long long) srv->repl_offset);
+        resp_array(&c->out, srv->num_replicas);
+        int i;
+        for (i = 0; i < srv->num_replicas; i++) {
+            char host[INET6_ADDRSTRLEN];
+            char port[8];
+            repl_peer_name(srv->replicas[i]->fd, host, sizeof(host), port);
+            resp_array(&c->out, 3);
+            resp_bulk(&c->out, host, strlen(host));
+            resp_bulk(&c->out, port, strlen(port));
+            snprintf(buf, sizeof(buf), "%llu", srv->replicas[i]->repl_ack);
+            resp_bulk(&c->out, buf, strlen(buf));
+        }
+        return;
+    }
+
+    const char *addr = srv->cfg->replicaof;
+    const char *colon = strrchr(addr, ':');
+    const char *state = srv->master_state == REPL_SYNCED ? "connected"
+        : srv->master_state == REPL_SYNCING ? "sync" : "connect";
+    resp_array(&c->out, 5);
+    resp_bulk(&c->out, "slave", 5);
+    if (strchr(addr, '/') == NULL && colon != NULL) {
+        resp_bulk(&c->out, addr, colon - addr);
+        resp_integer(&c->out, atoi(colon + 1));
+    } else {
+        resp_bulk(&c->out, addr, strlen(addr));
+        resp_integer(&c->out, 0);
+    }
+    resp_bulk(&c->out, state, strlen(state));
+    resp_integer(&c->out, (long long) srv->master_offset);
+}
+
+// replica side
+
+/* Connect to the primary of cfg->replicaof and request a snapshot. The link
+ * is served by the event loop like a client connection.
+ */
+int repl_connect(server *srv) {
+    const char *addr = srv->cfg->replicaof;
+    const int fd = net_connect(addr);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    server_conn *c = server_new_conn(fd, SERVER_PROTO_MASTER);
+    c->srv = srv;
+    srv->master = c;
+    srv->master_state = REPL_SYNCING;
+    const char *sync[] = {"SYNC"};
+    repl_encode(&c->out, 1, sync);
+    return 0;
+}
+
+// apply an operation received from the primary, returns -1 if it is invalid
+static int repl_apply(server *srv, resp_command *op) {
+    const char *name = op->argv[0];
+    int i;
+    for (i = 1; i < op->argc; i++) {
+        if (memchr(op->argv[i], '\0', op->argv_len[i]) != NULL) {
+            return -1;
+        }
+    }
+    if (strcmp(name, "PUT") == 0 && op->argc == 3) {
+        server_put(srv, op->argv[1], op->argv[2]);
+    } else if (strcmp(name, "DEL") == 0 && op->argc == 2) {
+        server_remove(srv, op->argv[1]);
+    } else if (strcmp(name, "META") == 0 && op->argc == 3) {
+        server_meta m;
+        if (sscanf(op->argv[2], "%u %ld %llu", &m.flags, &m.exptime, &m.cas) != 3) {
+            return -1;
+        }
+        server_set_meta(srv, op->argv[1], &m);
+        if (m.cas > srv->next_cas) {
+            srv->next_cas = m.cas;
+        }
+    } else if (strcmp(name, "UNMETA") == 0 && op->argc == 2) {
+        server_remove_meta(srv, op->argv[1]);
+    } else if (strcmp(name, "FLUSH") == 0 && op->argc == 1) {
+        server_flush_all(srv);
+    } else if (strcmp(name, "FULLRESYNC") == 0 && op->argc == 2) {
+        server_flush_all(srv);
+        srv->master_offset = strtoull(op->argv[1], NULL, 10);
+        srv->master_state = REPL_SYNCING;
+    } else if (strcmp(name, "SYNCED") == 0 && op->argc == 1) {
+        srv->master_state = REPL_SYNCED;
+        fprintf(
+            stderr,
+            "Synchronized with the primary at offset %llu, %d keys.\n",
+            srv->master_offset,
+            srv->ht->count
+        );
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Apply the operations received from the primary, then acknowledge the
+ * offset reached.
+ */
+void repl_process_input(server *srv, server_conn *c) {
+    const unsigned long long offset = srv->master_offset;
+    const int state = srv->master_state;
+    while (!c->closing && buf_pending(&c->in) > 0) {
+        const char *err = NULL;
+        const long n = resp_parse(
+            c->in.data + c->in.pos,
+            buf_pending(&c->in),
+            &srv->cmd,
+            &err
+        );
+        if (n == 0) {
+            break;
+        }
+        if (n < 0 || srv->cmd.argc == 0 || repl_apply(srv, &srv->cmd) < 0) {
+            fprintf(stderr, "Invalid operation from the primary.\n");
+            c->closing = 1;
+            break;
+        }
+        // operations of the snapshot are not part of the stream
+        if (srv->master_state == REPL_SYNCED && strcmp(srv->cmd.argv[0], "SYNCED") != 0) {
+            srv->master_offset += n;
+        }
+        buf_consume(&c->in, n);
+    }
+    if (srv->master_offset != offset || srv->master_state != state) {
+        char ack[32];
+        snprintf(ack, sizeof(ack), "%llu", srv->master_offset);
+        const char *op[] = {"REPLCONF", "ACK", ack};
+        repl_encode(&c->out, 3, op);
+    }
+}
@@ -0,0 +1,243 @@
+// parse requests and replies of the Redis serialization protocol, encode replies
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xmalloc.h"
+#include "buffer.h"
+#include "resp.h"
+
+void resp_command_init(resp_command *cmd) {
+    cmd->argc = 0;
+    cmd->cap = 0;
+    cmd->argv = NULL;
+    cmd->argv_len = NULL;
+}
+
+void resp_command_free(resp_command *cmd) {
+    free(cmd->argv);
+    free(cmd->argv_len);
+    resp_command_init(cmd);
+}
+
+static void resp_add_arg(resp_command *cmd, char *arg, size_t len) {
+    if (cmd->argc == cmd->cap) {
+        cmd->cap = cmd->cap == 0 ? 8 : cmd->cap * 2;
+        cmd->argv = xrealloc(cmd->argv, cmd->cap * sizeof(char*));
+        cmd->argv_len = xrealloc(cmd->argv_len, cmd->cap * sizeof(size_t));
+    }
+    cmd->argv[cmd->argc] = arg;
+    cmd->argv_len[cmd->argc] = len;
+    cmd->argc++;
+}
+
+/* Parse the integer of a "<prefix><digits>\r\n" line starting at 'p'.
+ * Returns the position after the line, or NULL if the line is incomplete.
+ * '*ok' is cleared if the line is not a valid integer.
+ */
+static char *resp_parse_int(char *p, char *end, long *n, int *ok) {
+    const long scan = end - p < RESP_MAX_INT_LINE ? end - p : RESP_MAX_INT_LINE;
+    char *eol = memchr(p, '\r', scan);
+    if (eol == NULL && scan == RESP_MAX_INT_LINE) {
+        // no integer is that long, the line is invalid without its end
+        *ok = 0;
+        return end;
+    }
+    if (eol == NULL || eol + 1 >= end) {
+        return NULL;
+    }
+    char *digits_end;
+    *n = strtol(p + 1, &digits_end, 10);
+    *ok = digits_end == eol && digits_end != p + 1 && eol[1] == '\n';
+    return eol + 2;
+}
+
+/* Parse an inline command: space separated arguments ending with "\n". Lines
+ * longer than RESP_MAX_INLINE are rejected rather than buffered.
+ */
+static long resp_parse_inline(
+        char *buf,
+        size_t len,
+        resp_command *cmd,
+        const char **err
+) {
+    char *eol = memchr(buf, '\n', len < RESP_MAX_INLINE ? len : RESP_MAX_INLINE);
+    if (eol == NULL) {
+        if (len < RESP_MAX_INLINE) {
+            return 0;
+        }
+        *err = "ERR Protocol error: too big inline request";
+        return -1;
+    }
+    char *line_end = eol > buf && eol[-1] == '\r' ? eol - 1 : eol;
+    char *p = buf;
+    while (p < line_end) {
+        while (p < line_end && (*p == ' ' || *p == '\t')) p++;
+        char *arg = p;
+        while (p < line_end && *p != ' ' && *p != '\t') p++;
+        if (p > arg) {
+            resp_add_arg(cmd, arg, p - arg);
+            // the separator, '\r' or '\n' is overwritten by the terminator
+            *p++ = '\0';
+        }
+    }
+    *eol = '\0';
+    return eol + 1 - buf;
+}
+
+/* Parse one command at the start of 'buf'.
+ *
+ * Returns:
+ *   > 0 - number of bytes consumed, 'cmd' holds the arguments
+ *   0   - the command is incomplete
+ *   -1  - protocol error, '*err' describes it
+ */
+long resp_parse(char *buf, size_t len, resp_command *cmd, const char **err) {
+    cmd->argc = 0;
+    if (len == 0) {
+        return 0;
+    }
+    if (buf[0] != '*') {
+        return resp_parse_inline(buf, len, cmd, err);
+    }
+
+    char *end = buf + len;
+    long count;
+    int ok;
+    char *p = resp_parse_int(buf, end, &count, &ok);
+    if (p == NULL) {
+        return 0;
+    }
+    if (!ok || count > RESP_MAX_ARGS) {
+        *err = "ERR Protocol error: invalid multibulk length";
+        return -1;
+    }
+
+    long i;
+    for (i = 0; i < count; i++) {
+        if (p >= end) {
+            return 0;
+        }
+        if (*p != '$') {
+            *err = "ERR Protocol error: expected '$'";
+            return -1;
+        }
+        long bulk_len;
+        char *data = resp_parse_int(p, end, &bulk_len, &ok);
+        if (data == NULL) {
+            return 0;
+        }
+        if (!ok || bulk_len < 0 || bulk_len > RESP_MAX_BULK) {
+            *err = "ERR Protocol error: invalid bulk length";
+            return -1;
+        }
+        if (end - data < bulk_len + 2) {
+            return 0;
+        }
+        if (data[bulk_len] != '\r' || data[bulk_len + 1] != '\n') {
+            *err = "ERR Protocol error: bulk string not terminated";
+            return -1;
+        }
+        resp_add_arg(cmd, data, bulk_len);
+        p = data + bulk_len + 2;
+    }
+    /* Arguments are only terminated once the command is complete, an
+     * incomplete command is parsed again when more input arrives.
+     */
+    for (i = 0; i < count; i++) {
+        cmd->argv[i][cmd->argv_len[i]] = '\0';
+    }
+    return p - buf;
+}
+
+/* Parse one reply, or the header of an array reply, at the start of 'buf'.
+ * Returns the number of bytes consumed, 0 if the reply is incomplete and -1
+ * on protocol errors.
+ */
+long resp_parse_reply(char *buf, size_t len, resp_reply *reply) {
+    char *end = buf + len;
+    char *eol = memchr(buf, '\r', len);
+    if (eol == NULL || eol + 1 >= end) {
+        return 0;
+    }
+    if (eol[1] != '\n') {
+        return -1;
+    }
+    reply->str = buf + 1;
+    reply->len = eol - buf - 1;
+    reply->integer = 0;
+    switch (buf[0]) {
+    case '+':
+        reply->type = RESP_REPLY_STATUS;
+        return eol + 2 - buf;
+    case '-':
+        reply->type = RESP_REPLY_ERROR;
+        return eol + 2 - buf;
+    case ':':
+    case '$':
+    case '*':
+        break;
+    default:
+        return -1;
+    }
+
+    long n;
+    int ok;
+    char *p = resp_parse_int(buf, end, &n, &ok);
+    if (!ok) {
+        return -1;
+    }
+    reply->integer = n;
+    if (buf[0] == ':') {
+        reply->type = RESP_REPLY_INTEGER;
+        return p - buf;
+    }
+    if (n < 0) {
+        // "$-1" and "*-1" both stand for a missing value
+        reply->type = RESP_REPLY_NIL;
+        return p - buf;
+    }
+    if (buf[0] == '*') {
+        reply->type = RESP_REPLY_ARRAY;
+        return p - buf;
+    }
+    if (n > RESP_MAX_BULK) {
+        return -1;
+    }
+    if (end - p < n + 2) {
+        return 0;
+    }
+    if (p[n] != '\r' || p[n + 1] != '\n') {
+        return -1;
+    }
+    reply->type = RESP_REPLY_BULK;
+    reply->str = p;
+    reply->len = n;
+    return p + n + 2 - buf;
+}
+
+void resp_simple(buffer *b, const char *s) {
+    buf_printf(b, "+%s\r\n", s);
+}
+
+void resp_error(buffer *b, const char *msg) {
+    buf_printf(b, "-%s\r\n", msg);
+}
+
+void resp_integer(buffer *b, long long n) {
+    buf_printf(b, ":%lld\r\n", n);
+}
+
+void resp_bulk(buffer *b, const char *data, size_t len) {
+    buf_printf(b, "$%zu\r\n", len);
+    buf_append(b, data, len);
+    buf_append(b, "\r\n", 2);
+}
+
+void resp_null(buffer *b) {
+    buf_append(b, "$-1\r\n", 5);
+}
+
+void resp_array(buffer *b, long n) {
+    buf_printf(b, "*%ld\r\n", n);
+}
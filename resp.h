@@ -0,0 +1,62 @@
+#ifndef RESP_HEADER
+#define RESP_HEADER
+
+#include <stddef.h>
+#include "buffer.h"
+
+/* Subset of the Redis serialization protocol (RESP2).
+ *
+ * Requests are arrays of bulk strings ("*2\r\n$3\r\nGET\r\n$1\r\nk\r\n") or
+ * inline commands ("GET k\r\n"). Arguments are parsed in place: each one is
+ * NUL-terminated inside the input buffer, so they stay valid until the buffer
+ * is modified.
+ */
+
+#define RESP_MAX_BULK (512L << 20)
+#define RESP_MAX_ARGS (1 << 20)
+// longest inline command, with its line ending
+#define RESP_MAX_INLINE (64L << 10)
+// longest "*<count>" or "$<length>" line holding a valid integer
+#define RESP_MAX_INT_LINE 32
+
+typedef struct {
+    int argc;
+    int cap;
+    char **argv;
+    size_t *argv_len;
+} resp_command;
+
+// kinds of replies
+enum {
+    RESP_REPLY_STATUS,
+    RESP_REPLY_ERROR,
+    RESP_REPLY_INTEGER,
+    RESP_REPLY_BULK,
+    RESP_REPLY_NIL,
+    RESP_REPLY_ARRAY
+};
+
+/* A reply parsed by a client. Strings point into the input buffer and are not
+ * terminated. For arrays only the header is parsed: 'integer' holds the number
+ * of elements, which follow as replies of their own.
+ */
+typedef struct {
+    int type;
+    long long integer;
+    const char *str;
+    size_t len;
+} resp_reply;
+
+void resp_command_init(resp_command *cmd);
+void resp_command_free(resp_command *cmd);
+long resp_parse(char *buf, size_t len, resp_command *cmd, const char **err);
+long resp_parse_reply(char *buf, size_t len, resp_reply *reply);
+
+void resp_simple(buffer *b, const char *s);
+void resp_error(buffer *b, const char *msg);
+void resp_integer(buffer *b, long long n);
+void resp_bulk(buffer *b, const char *data, size_t len);
+void resp_null(buffer *b);
+void resp_array(buffer *b, long n);
+
+#endif
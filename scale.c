@@ -0,0 +1,369 @@
+/* Scalability benchmark of the table under concurrent access.
+ *
+ * The table is not thread-safe, each mode shares it between threads in its
+ * own way:
+ *   global   one table behind one mutex
+ *   rwlock   one table behind a reader/writer lock, lookups sharing it
+ *   striped  a fixed number of tables, each behind its own mutex, with the
+ *            keys spread over them by hash
+ *   sharded  one table per thread, each thread working on its own part of
+ *            the keys without locking, as the thread-per-core server does
+ *
+ * For every mode and number of threads, from 1 to the maximum by doubling,
+ * the tables are filled with the keys, then the threads run for a fixed time
+ * looking up or overwriting keys in the configured proportion, on keys drawn
+ * from a Zipfian distribution. The result is one row per number of threads
+ * with a column of operations per second for each mode, in a format gnuplot
+ * reads as it is, or as CSV.
+ */
+
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "fnv.h"
+#include "hash_table.h"
+#include "xmalloc.h"
+#include "zipf.h"
+
+#define SCALE_MAX_THREADS 1024
+// operations between two checks of the end of a run
+#define SCALE_CHUNK 64
+#define SCALE_CACHE_LINE 64
+
+// searches write the cost counters when they are built in
+#ifdef HT_COUNTERS
+#define SCALE_SHARED_SEARCH 0
+#else
+#define SCALE_SHARED_SEARCH 1
+#endif
+
+enum { MODE_GLOBAL, MODE_RWLOCK, MODE_STRIPED, MODE_SHARDED, NUM_MODES };
+
+static const char *mode_names[NUM_MODES] = {"global", "rwlock", "striped", "sharded"};
+
+// a lock on a cache line of its own, so taking it does not slow its neighbours
+typedef struct {
+    pthread_mutex_t mutex;
+} __attribute__((aligned(SCALE_CACHE_LINE))) scale_lock;
+
+typedef struct {
+    int mode;
+    int threads;
+    const char **keys;
+    long num_keys;
+    const zipf *zipf;
+    int get_ratio;
+    const char *value;
+    ht_hash_table **tables;
+    scale_lock *locks;
+    pthread_rwlock_t rwlock __attribute__((aligned(SCALE_CACHE_LINE)));
+    int num_tables;
+    pthread_barrier_t barrier;
+    int stop;
+} scale_run;
+
+/* Threads share an array of these, so they only write to it once done, their
+ * state lives on their own stacks meanwhile.
+ */
+typedef struct {
+    scale_run *run;
+    int id;
+    uint64_t seed;
+    unsigned long long ops;
+} scale_thread;
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64*, a uniform number in [0, 1)
+static double scale_random(uint64_t *rng) {
+    *rng ^= *rng >> 12;
+    *rng ^= *rng << 25;
+    *rng ^= *rng >> 27;
+    return ((*rng * 2685821657736338717ULL) >> 11) * 0x1.0p-53;
+}
+
+static int scale_stripe(const char *key, int num_tables) {
+    return (int) (fnv1a_32(key, strlen(key)) % (uint32_t) num_tables);
+}
+
+/* Key of thread 't' for 'rank'. In sharded mode thread i owns the keys whose
+ * index is i modulo the number of threads, and ranks are drawn among them.
+ */
+static long scale_key(const scale_run *run, int t, long rank) {
+    return run->mode == MODE_SHARDED ? t + rank * run->threads : rank;
+}
+
+static void *scale_worker(void *arg) {
+    scale_thread *t = arg;
+    scale_run *run = t->run;
+    uint64_t rng = t->seed;
+    unsigned long long ops = 0;
+    pthread_barrier_wait(&run->barrier);
+    while (!__atomic_load_n(&run->stop, __ATOMIC_RELAXED)) {
+        int i;
+        for (i = 0; i < SCALE_CHUNK; i++) {
+            const int get = scale_random(&rng) * 100 < run->get_ratio;
+            const char *key = run->keys[scale_key(run, t->id, zipf_rank(run->zipf, scale_random(&rng)))];
+            if (run->mode == MODE_SHARDED) {
+                ht_hash_table *ht = run->tables[t->id];
+                if (get) {
+                    ht_search(ht, key);
+                } else {
+                    ht_insert(ht, key, run->value);
+                }
+                continue;
+            }
+            if (run->mode == MODE_RWLOCK) {
+                if (get && SCALE_SHARED_SEARCH) {
+                    pthread_rwlock_rdlock(&run->rwlock);
+                    ht_search(run->tables[0], key);
+                } else {
+                    pthread_rwlock_wrlock(&run->rwlock);
+                    if (get) {
+                        ht_search(run->tables[0], key);
+                    } else {
+                        ht_insert(run->tables[0], key, run->value);
+                    }
+                }
+                pthread_rwlock_unlock(&run->rwlock);
+                continue;
+            }
+            const int s = run->mode == MODE_STRIPED ? scale_stripe(key, run->num_tables) : 0;
+            pthread_mutex_lock(&run->locks[s].mutex);
+            if (get) {
+                ht_search(run->tables[s], key);
+            } else {
+                ht_insert(run->tables[s], key, run->value);
+            }
+            pthread_mutex_unlock(&run->locks[s].mutex);
+        }
+        ops += SCALE_CHUNK;
+    }
+    t->ops = ops;
+    return NULL;
+}
+
+// run one mode with 'threads' threads for 'duration' seconds, returns ops/s
+static double scale_measure(
+        scale_run *run,
+        int mode,
+        int threads,
+        int stripes,
+        double duration,
+        double theta
+) {
+    run->mode = mode;
+    run->threads = threads;
+    run->num_tables = mode == MODE_STRIPED ? stripes
+        : mode == MODE_SHARDED ? threads : 1;
+    run->tables = xcalloc(run->num_tables, sizeof(ht_hash_table *));
+    run->locks = aligned_alloc(
+        SCALE_CACHE_LINE,
+        (size_t) run->num_tables * sizeof(scale_lock)
+    );
+    if (run->locks == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    int i;
+    for (i = 0; i < run->num_tables; i++) {
+        run->tables[i] = ht_new();
+        pthread_mutex_init(&run->locks[i].mutex, NULL);
+    }
+    pthread_rwlock_init(&run->rwlock, NULL);
+    // each thread only draws ranks below the keys it owns in sharded mode
+    zipf popularity;
+    const long ranks = mode == MODE_SHARDED ? run->num_keys / threads : run->num_keys;
+    zipf_init(&popularity, ranks, theta);
+    run->zipf = &popularity;
+    long k;
+    for (k = 0; k < run->num_keys; k++) {
+        const int table = mode == MODE_STRIPED ? scale_stripe(run->keys[k], stripes)
+            : mode == MODE_SHARDED ? (int) (k % threads) : 0;
+        ht_insert(run->tables[table], run->keys[k], run->value);
+    }
+
+    scale_thread *workers = xcalloc(threads, sizeof(scale_thread));
+    pthread_t *ids = xcalloc(threads, sizeof(pthread_t));
+    run->stop = 0;
+    pthread_barrier_init(&run->barrier, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        workers[i].run = run;
+        workers[i].id = i;
+        workers[i].seed = 0x9e3779b97f4a7c15ULL * (i + 1);
+        if (pthread_create(&ids[i], NULL, scale_worker, &workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    pthread_barrier_wait(&run->barrier);
+    const double start = now();
+    const struct timespec ts = {(time_t) duration, (long) ((duration - (time_t) duration) * 1e9)};
+    nanosleep(&ts, NULL);
+    __atomic_store_n(&run->stop, 1, __ATOMIC_RELAXED);
+    unsigned long long ops = 0;
+    for (i = 0; i < threads; i++) {
+        pthread_join(ids[i], NULL);
+        ops += workers[i].ops;
+    }
+    const double elapsed = now() - start;
+    pthread_barrier_destroy(&run->barrier);
+
+    for (i = 0; i < run->num_tables; i++) {
+        ht_del_hash_table(run->tables[i]);
+        pthread_mutex_destroy(&run->locks[i].mutex);
+    }
+    pthread_rwlock_destroy(&run->rwlock);
+    free(run->tables);
+    free(run->locks);
+    free(workers);
+    free(ids);
+    return ops / elapsed;
+}
+
+static void usage(const char *prog) {
+    fprintf(
+        stderr,
+        "Usage: %s [-t threads] [-m modes] [-d seconds] [-k keys] [-r get_percent]\n"
+        "          [-z exponent] [-S stripes] [-c]\n"
+        "  -t  largest number of threads (default: number of CPUs)\n"
+        "  -m  comma separated modes among global, rwlock, striped and sharded\n"
+        "      (default: all of them)\n"
+        "  -d  seconds measured for each mode and number of threads (default: 1)\n"
+        "  -k  number of keys (default: 100000)\n"
+        "  -r  percentage of lookups, the others overwrite keys (default: 90)\n"
+        "  -z  exponent of the Zipfian key popularity, below 1, 0 for uniform\n"
+        "      (default: 0.99)\n"
+        "  -S  tables of the striped mode (default: 64)\n"
+        "  -c  print CSV\n",
+        prog
+    );
+}
+
+int main(int argc, char *argv[]) {
+    int max_threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    int selected[NUM_MODES] = {1, 1, 1, 1};
+    double duration = 1;
+    long num_keys = 100000;
+    int get_ratio = 90;
+    double theta = 0.99;
+    int stripes = 64;
+    int csv = 0;
+
+    int opt;
+    int i;
+    while ((opt = getopt(argc, argv, "t:m:d:k:r:z:S:ch")) != -1) {
+        switch (opt) {
+        case 't':
+            max_threads = atoi(optarg);
+            break;
+        case 'm': {
+            memset(selected, 0, sizeof(selected));
+            char *list = xstrdup(optarg);
+            char *saveptr;
+            char *name;
+            for (name = strtok_r(list, ",", &saveptr); name != NULL;
+                    name = strtok_r(NULL, ",", &saveptr)) {
+                for (i = 0; i < NUM_MODES && strcmp(name, mode_names[i]) != 0; i++);
+                if (i == NUM_MODES) {
+                    fprintf(stderr, "Unknown mode '%s'.\n", name);
+                    return 1;
+                }
+                selected[i] = 1;
+            }
+            free(list);
+            break;
+        }
+        case 'd':
+            duration = atof(optarg);
+            break;
+        case 'k':
+            num_keys = atol(optarg);
+            break;
+        case 'r':
+            get_ratio = atoi(optarg);
+            break;
+        case 'z':
+            theta = atof(optarg);
+            break;
+        case 'S':
+            stripes = atoi(optarg);
+            break;
+        case 'c':
+            csv = 1;
+            break;
+        default:
+            usage(argv[0]);
+            return opt == 'h' ? 0 : 1;
+        }
+    }
+    if (optind < argc || max_threads < 1 || max_threads > SCALE_MAX_THREADS
+            || duration <= 0 || num_keys < max_threads || get_ratio < 0
+            || get_ratio > 100 || theta < 0 || theta >= 1 || stripes < 1) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    scale_run run;
+    memset(&run, 0, sizeof(run));
+    run.num_keys = num_keys;
+    run.get_ratio = get_ratio;
+    run.value = "value";
+    run.keys = xmalloc(num_keys * sizeof(char *));
+    long k;
+    for (k = 0; k < num_keys; k++) {
+        char key[32];
+        snprintf(key, sizeof(key), "key:%ld", k);
+        run.keys[k] = xstrdup(key);
+    }
+
+    const char *sep = csv ? "," : " ";
+    if (!csv) {
+        printf(
+            "# %ld keys, %d%% lookups, zipf %.2f, %.1f s per point, ops/s\n",
+            num_keys,
+            get_ratio,
+            theta,
+            duration
+        );
+    }
+    printf(csv ? "threads" : "# threads");
+    int m;
+    for (m = 0; m < NUM_MODES; m++) {
+        if (selected[m]) {
+            printf(csv ? "%s%s" : "%s%12s", sep, mode_names[m]);
+        }
+    }
+    printf("\n");
+    int threads = 1;
+    for (;;) {
+        printf(csv ? "%d" : "%9d", threads);
+        for (m = 0; m < NUM_MODES; m++) {
+            if (selected[m]) {
+                const double ops = scale_measure(&run, m, threads, stripes, duration, theta);
+                printf(csv ? "%s%.0f" : "%s%12.0f", sep, ops);
+                fflush(stdout);
+            }
+        }
+        printf("\n");
+        if (threads == max_threads) {
+            break;
+        }
+        threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+    }
+
+    for (k = 0; k < num_keys; k++) {
+        free((char *) run.keys[k]);
+    }
+    free(run.keys);
+    return 0;
+}
@@ -0,0 +1,1154 @@
+// key-value server exposing a hash table over TCP and Unix sockets
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "buffer.h"
+#include "resp.h"
+#include "histogram.h"
+#include "handoff.h"
+#include "server.h"
+#include "server_internal.h"
+
+// how commands are routed between shards in thread-per-core mode
+enum {
+    // executed by the shard serving the connection
+    SERVER_ROUTE_LOCAL,
+    // executed by the shard owning the first argument
+    SERVER_ROUTE_KEY,
+    // every argument is a key, the integer replies of each shard are summed
+    SERVER_ROUTE_KEYS,
+    // executed by every shard, the integer replies are summed
+    SERVER_ROUTE_ALL
+};
+
+typedef struct {
+    const char *name;
+    // number of arguments including the command name, negative for a minimum
+    int arity;
+    void (*proc)(server *srv, server_conn *c, resp_command *cmd);
+    int route;
+    // set for commands modifying the data, which replicas refuse
+    int write;
+} server_command;
+
+/* Set by the signal handler and by the shard threads, read by every event
+ * loop, so it is only accessed atomically.
+ */
+sig_atomic_t server_stop = 0;
+
+static void server_on_signal(int sig) {
+    (void) sig;
+    __atomic_store_n(&server_stop, 1, __ATOMIC_RELEASE);
+}
+
+static int server_set_nonblocking(int fd) {
+    const int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// set default values of the server configuration
+void server_config_init(server_config *cfg) {
+    cfg->bind_addr = NULL;
+    cfg->port = 6379;
+    cfg->unix_path = NULL;
+    cfg->memcache_port = 0;
+    cfg->binary_port = 0;
+    cfg->backlog = 511;
+    cfg->backend = SERVER_BACKEND_EPOLL;
+    cfg->threads = 1;
+    cfg->replicaof = NULL;
+    cfg->trace_path = NULL;
+    cfg->handoff_path = NULL;
+}
+
+static int server_listen_tcp(const char *addr, int port, int backlog) {
+    struct addrinfo hints, *res, *ai;
+    char service[16];
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    snprintf(service, sizeof(service), "%d", port);
+    if (getaddrinfo(addr, service, &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        const int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, backlog) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+static int server_listen_unix(const char *path, int backlog) {
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    const int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    unlink(path);
+    if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0
+            || listen(fd, backlog) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static void server_add_listener(server *srv, int fd, int protocol) {
+    server_listener *l = &srv->listeners[srv->num_listeners++];
+    l->type = SERVER_LISTENER;
+    l->fd = fd;
+    l->protocol = protocol;
+    server_set_nonblocking(fd);
+}
+
+server_conn *server_new_conn(int fd, int protocol) {
+    const int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    server_conn *c = xcalloc(1, sizeof(server_conn));
+    c->type = SERVER_CONN;
+    c->fd = fd;
+    c->protocol = protocol;
+    buf_init(&c->in);
+    buf_init(&c->out);
+    buf_init(&c->send_buf);
+    buf_init(&c->split);
+    return c;
+}
+
+static void server_unguard(server_conn *c);
+
+// release a connection, its socket is closed by the backend
+void server_free_conn(server_conn *c) {
+    if (c->guarded) {
+        server_unguard(c);
+    }
+    if (c->srv != NULL) {
+        repl_unlink(c->srv, c);
+    }
+    free(c->refs);
+    buf_free(&c->in);
+    buf_free(&c->out);
+    buf_free(&c->send_buf);
+    buf_free(&c->split);
+    free(c);
+}
+
+// storage
+
+static void server_encode_meta(char *buf, const server_meta *m) {
+    sprintf(buf, "%u %ld %llu", m->flags, m->exptime, m->cas);
+}
+
+/* Read the metadata of a key, returns -1 if it has none. Keys written outside
+ * of the memcached protocol get their metadata on first access, so their CAS
+ * unique stays stable until they are modified.
+ */
+int server_get_meta(server *srv, const char *key, server_meta *m) {
+    const char *s = ht_search(srv->meta, key);
+    if (s != NULL
+            && sscanf(s, "%u %ld %llu", &m->flags, &m->exptime, &m->cas) == 3) {
+        return 0;
+    }
+    if (ht_search(srv->ht, key) == NULL) {
+        return -1;
+    }
+    m->flags = 0;
+    m->exptime = 0;
+    m->cas = ++srv->next_cas;
+    server_set_meta(srv, key, m);
+    return 0;
+}
+
+void server_set_meta(server *srv, const char *key, const server_meta *m) {
+    char buf[64];
+    server_encode_meta(buf, m);
+    ht_insert(srv->meta, key, buf);
+    const char *op[] = {"META", key, buf};
+    repl_propagate(srv, 3, op);
+}
+
+void server_remove_meta(server *srv, const char *key) {
+    if (srv->meta->count > 0 && ht_search(srv->meta, key) != NULL) {
+        ht_delete(srv->meta, key);
+        const char *op[] = {"UNMETA", key};
+        repl_propagate(srv, 2, op);
+    }
+}
+
+// return 1 if the metadata of a key holds an expiration time which has passed
+static int server_expired(server *srv, const char *key) {
+    // the metadata table is only consulted once memcached clients used it
+    if (srv->meta->count == 0) {
+        return 0;
+    }
+    const char *s = ht_search(srv->meta, key);
+    long exptime;
+    return s != NULL && sscanf(s, "%*u %ld", &exptime) == 1
+        && exptime != 0 && exptime <= time(NULL);
+}
+
+// return the value of a key, deleting it first if it has expired
+char *server_lookup(server *srv, const char *key) {
+    char *value = ht_search(srv->ht, key);
+    if (value != NULL && server_expired(srv, key)) {
+        server_remove(srv, key);
+        return NULL;
+    }
+    return value;
+}
+
+/* Changes of the tables go through the functions below, which send them to
+ * the replicas.
+ */
+
+// set the value of a key, keeping its metadata
+void server_put(server *srv, const char *key, const char *value) {
+    ht_insert(srv->ht, key, value);
+    const char *op[] = {"PUT", key, value};
+    repl_propagate(srv, 3, op);
+}
+
+// store a value with no flags nor expiration
+void server_store(server *srv, const char *key, const char *value) {
+    server_put(srv, key, value);
+    server_remove_meta(srv, key);
+}
+
+// delete a key, returns 1 if it existed
+int server_remove(server *srv, const char *key) {
+    const int count = srv->ht->count;
+    ht_delete(srv->ht, key);
+    if (srv->ht->count == count) {
+        return 0;
+    }
+    if (srv->meta->count > 0 && ht_search(srv->meta, key) != NULL) {
+        ht_delete(srv->meta, key);
+    }
+    const char *op[] = {"DEL", key};
+    repl_propagate(srv, 2, op);
+    return 1;
+}
+
+void server_flush_all(server *srv) {
+    ht_hash_table *old = srv->ht;
+    if (old->trace != NULL) {
+        trace_record(old->trace, TRACE_FLUSH, "", 0, 0);
+    }
+    srv->ht = ht_new();
+    srv->ht->free_value = old->free_value;
+    srv->ht->free_value_arg = old->free_value_arg;
+    srv->ht->trace = old->trace;
+    ht_del_hash_table(old);
+    ht_del_hash_table(srv->meta);
+    srv->meta = ht_new();
+    const char *op[] = {"FLUSH"};
+    repl_propagate(srv, 1, op);
+}
+
+// zero-copy output
+
+// table hook: free a value leaving the table, unless replies may refer to it
+static void server_retire(char *value, void *arg) {
+    server *srv = arg;
+    if (srv->guarded == NULL) {
+        free(value);
+        return;
+    }
+    server_retired *r = xmalloc(sizeof(server_retired));
+    r->next = NULL;
+    r->value = value;
+    // references made from now on cannot reach the value
+    r->epoch = srv->epoch++;
+    if (srv->retired_tail != NULL) {
+        srv->retired_tail->next = r;
+    } else {
+        srv->retired = r;
+    }
+    srv->retired_tail = r;
+}
+
+static void server_unguard(server_conn *c) {
+    if (c->guard_prev != NULL) {
+        c->guard_prev->guard_next = c->guard_next;
+    } else {
+        c->srv->guarded = c->guard_next;
+    }
+    if (c->guard_next != NULL) {
+        c->guard_next->guard_prev = c->guard_prev;
+    }
+    c->guard_prev = NULL;
+    c->guard_next = NULL;
+    c->guarded = 0;
+}
+
+/* Append a value of the table to the output of a connection. When zero-copy
+ * output is enabled, large values are referenced instead of copied and the
+ * connection guards the current epoch until they are written.
+ */
+void server_out_value(server *srv, server_conn *c, const char *value, size_t len) {
+    if (!srv->zero_copy || len < SERVER_REF_MIN) {
+        buf_append(&c->out, value, len);
+        return;
+    }
+    if (c->num_refs == c->refs_cap) {
+        if (c->refs_head > 0) {
+            memmove(c->refs, c->refs + c->refs_head,
+                    (c->num_refs - c->refs_head) * sizeof(server_ref));
+            c->num_refs -= c->refs_head;
+            c->refs_head = 0;
+        } else {
+            c->refs_cap = c->refs_cap == 0 ? 16 : c->refs_cap * 2;
+            c->refs = xrealloc(c->refs, c->refs_cap * sizeof(server_ref));
+        }
+    }
+    server_ref *r = &c->refs[c->num_refs++];
+    r->data = value;
+    r->len = len;
+    r->before = buf_pending(&c->out) - c->refs_out;
+    r->epoch = srv->epoch;
+    c->refs_out += r->before;
+    c->refs_len += len;
+    if (!c->guarded) {
+        c->srv = srv;
+        c->guarded = 1;
+        c->guard_prev = NULL;
+        c->guard_next = srv->guarded;
+        if (srv->guarded != NULL) {
+            srv->guarded->guard_prev = c;
+        }
+        srv->guarded = c;
+    }
+}
+
+/* Describe the pending output of a connection, bytes of 'out' and referenced
+ * values in order, with at most 'max' entries. Returns the number of entries.
+ */
+int server_out_iov(server_conn *c, struct iovec *iov, int max) {
+    char *p = c->out.data + c->out.pos;
+    size_t left = buf_pending(&c->out);
+    int n = 0;
+    int i;
+    for (i = c->refs_head; i < c->num_refs && n + 2 <= max; i++) {
+        const server_ref *r = &c->refs[i];
+        if (r->before > 0) {
+            iov[n].iov_base = p;
+            iov[n++].iov_len = r->before;
+            p += r->before;
+            left -= r->before;
+        }
+        iov[n].iov_base = (void *) r->data;
+        iov[n++].iov_len = r->len;
+    }
+    if (i == c->num_refs && left > 0 && n < max) {
+        iov[n].iov_base = p;
+        iov[n++].iov_len = left;
+    }
+    return n;
+}
+
+// mark 'n' bytes of pending output as written
+void server_out_consume(server_conn *c, size_t n) {
+    while (n > 0 && c->refs_head < c->num_refs) {
+        server_ref *r = &c->refs[c->refs_head];
+        size_t k = n < r->before ? n : r->before;
+        buf_consume(&c->out, k);
+        r->before -= k;
+        c->refs_out -= k;
+        n -= k;
+        if (r->before > 0) {
+            return;
+        }
+        k = n < r->len ? n : r->len;
+        r->data += k;
+        r->len -= k;
+        c->refs_len -= k;
+        n -= k;
+        if (r->len > 0) {
+            return;
+        }
+        c->refs_head++;
+    }
+    if (c->guarded && c->refs_head == c->num_refs) {
+        c->refs_head = 0;
+        c->num_refs = 0;
+        server_unguard(c);
+    }
+    buf_consume(&c->out, n);
+}
+
+/* Free the retired values no reference can reach anymore, that is those
+ * retired before the oldest reference of every guarded connection.
+ */
+void server_reclaim(server *srv) {
+    if (srv->retired == NULL) {
+        return;
+    }
+    unsigned long long oldest = srv->epoch;
+    const server_conn *c;
+    for (c = srv->guarded; c != NULL; c = c->guard_next) {
+        if (c->refs[c->refs_head].epoch < oldest) {
+            oldest = c->refs[c->refs_head].epoch;
+        }
+    }
+    while (srv->retired != NULL && srv->retired->epoch < oldest) {
+        server_retired *r = srv->retired;
+        srv->retired = r->next;
+        free(r->value);
+        free(r);
+    }
+    if (srv->retired == NULL) {
+        srv->retired_tail = NULL;
+    }
+}
+
+// commands
+
+/* Keys and values are stored as C strings, so arguments holding a NUL byte
+ * cannot be represented.
+ */
+static int server_check_binary(server_conn *c, resp_command *cmd) {
+    int i;
+    for (i = 1; i < cmd->argc; i++) {
+        if (memchr(cmd->argv[i], '\0', cmd->argv_len[i]) != NULL) {
+            resp_error(&c->out, "ERR keys and values must not contain NUL bytes");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void cmd_ping(server *srv, server_conn *c, resp_command *cmd) {
+    (void) srv;
+    if (cmd->argc > 1) {
+        resp_bulk(&c->out, cmd->argv[1], cmd->argv_len[1]);
+    } else {
+        resp_simple(&c->out, "PONG");
+    }
+}
+
+static void cmd_echo(server *srv, server_conn *c, resp_command *cmd) {
+    (void) srv;
+    resp_bulk(&c->out, cmd->argv[1], cmd->argv_len[1]);
+}
+
+static void cmd_get(server *srv, server_conn *c, resp_command *cmd) {
+    const char *value = server_lookup(srv, cmd->argv[1]);
+    if (value == NULL) {
+        resp_null(&c->out);
+    } else {
+        resp_bulk(&c->out, value, strlen(value));
+    }
+}
+
+static void cmd_set(server *srv, server_conn *c, resp_command *cmd) {
+    if (server_check_binary(c, cmd) < 0) {
+        return;
+    }
+    server_store(srv, cmd->argv[1], cmd->argv[2]);
+    resp_simple(&c->out, "OK");
+}
+
+static void cmd_del(server *srv, server_conn *c, resp_command *cmd) {
+    long long deleted = 0;
+    int i;
+    for (i = 1; i < cmd->argc; i++) {
+        if (server_lookup(srv, cmd->argv[i]) != NULL) {
+            deleted += server_remove(srv, cmd->argv[i]);
+        }
+    }
+    resp_integer(&c->out, deleted);
+}
+
+static void cmd_exists(server *srv, server_conn *c, resp_command *cmd) {
+    long long found = 0;
+    int i;
+    for (i = 1; i < cmd->argc; i++) {
+        if (server_lookup(srv, cmd->argv[i]) != NULL) {
+            found++;
+        }
+    }
+    resp_integer(&c->out, found);
+}
+
+static void cmd_dbsize(server *srv, server_conn *c, resp_command *cmd) {
+    (void) cmd;
+    resp_integer(&c->out, srv->ht->count);
+}
+
+// clients such as redis-benchmark query these on startup
+static void cmd_empty(server *srv, server_conn *c, resp_command *cmd) {
+    (void) srv;
+    (void) cmd;
+    resp_array(&c->out, 0);
+}
+
+static void cmd_quit(server *srv, server_conn *c, resp_command *cmd) {
+    (void) srv;
+    (void) cmd;
+    resp_simple(&c->out, "OK");
+    c->closing = 1;
+}
+
+static void cmd_info(server *srv, server_conn *c, resp_command *cmd);
+
+static const server_command server_commands[] = {
+    {"PING", -1, cmd_ping, SERVER_ROUTE_LOCAL, 0},
+    {"ECHO", 2, cmd_echo, SERVER_ROUTE_LOCAL, 0},
+    {"GET", 2, cmd_get, SERVER_ROUTE_KEY, 0},
+    {"SET", 3, cmd_set, SERVER_ROUTE_KEY, 1},
+    {"DEL", -2, cmd_del, SERVER_ROUTE_KEYS, 1},
+    {"EXISTS", -2, cmd_exists, SERVER_ROUTE_KEYS, 0},
+    {"DBSIZE", 1, cmd_dbsize, SERVER_ROUTE_ALL, 0},
+    {"COMMAND", -1, cmd_empty, SERVER_ROUTE_LOCAL, 0},
+    {"CONFIG", -2, cmd_empty, SERVER_ROUTE_LOCAL, 0},
+    {"QUIT", 1, cmd_quit, SERVER_ROUTE_LOCAL, 0},
+    {"SYNC", 1, repl_cmd_sync, SERVER_ROUTE_LOCAL, 0},
+    {"REPLCONF", -2, repl_cmd_replconf, SERVER_ROUTE_LOCAL, 0},
+    {"ROLE", 1, repl_cmd_role, SERVER_ROUTE_LOCAL, 0},
+    {"INFO", -1, cmd_info, SERVER_ROUTE_LOCAL, 0},
+};
+
+#define SERVER_NUM_COMMANDS (sizeof(server_commands) / sizeof(server_commands[0]))
+
+static size_t server_command_index(const char *name) {
+    size_t i;
+    for (i = 0; i < SERVER_NUM_COMMANDS - 1; i++) {
+        if (strcmp(server_commands[i].name, name) == 0) {
+            break;
+        }
+    }
+    return i;
+}
+
+// statistics
+
+// count 'n' executions of a command which took 'ns' nanoseconds in total
+static void server_record(server *srv, size_t command, uint64_t ns, int n) {
+    if (srv->latency == NULL) {
+        srv->latency = xcalloc(SERVER_NUM_COMMANDS, sizeof(histogram));
+    }
+    hist_record(&srv->latency[command], ns / n, n);
+}
+
+static size_t server_table_bytes(const ht_hash_table *ht) {
+    return ht->size * sizeof(ht_item *) + ht->count * sizeof(ht_item) + ht->data_bytes;
+}
+
+// buckets of the table examined to describe the layout of its keys
+#define SERVER_STATS_SAMPLE 4096
+
+static int server_info_section(resp_command *cmd, const char *name) {
+    return cmd->argc < 2 || strcasecmp(cmd->argv[1], "all") == 0
+        || strcasecmp(cmd->argv[1], name) == 0;
+}
+
+/* INFO [section]: counters of the server and of its tables, maintained as
+ * they change, except for the layout of the keys which is measured over
+ * SERVER_STATS_SAMPLE buckets. In thread-per-core mode they describe the
+ * shard serving the connection. Memory sizes leave allocator overhead out.
+ * Built with -DHT_COUNTERS, the table section adds the buckets visited by
+ * every search of the table, the server's own included.
+ */
+static void cmd_info(server *srv, server_conn *c, resp_command *cmd) {
+    buffer *b = &srv->encode;
+    b->pos = b->len = 0;
+    const ht_hash_table *ht = srv->ht;
+    size_t i;
+    if (server_info_section(cmd, "server")) {
+        unsigned long long commands = 0;
+        for (i = 0; srv->latency != NULL && i < SERVER_NUM_COMMANDS; i++) {
+            commands += srv->latency[i].count;
+        }
+        unsigned long retired = 0;
+        const server_retired *r;
+        for (r = srv->retired; r != NULL; r = r->next) {
+            retired++;
+        }
+        buf_printf(
+            b,
+            "# Server\r\n"
+            "event_loop:%s\r\n"
+            "threads:%d\r\n"
+            "shard:%d\r\n"
+            "role:%s\r\n"
+            "uptime_in_seconds:%ld\r\n"
+            "commands_processed:%llu\r\n"
+            "zero_copy:%d\r\n"
+            "retired_values:%lu\r\n"
+            "\r\n",
+            srv->cfg->backend == SERVER_BACKEND_URING ? "io_uring" : "epoll",
+            srv->cfg->threads,
+            srv->shard_id,
+            srv->cfg->replicaof != NULL ? "replica" : "primary",
+            (long) (time(NULL) - srv->started),
+            commands,
+            srv->zero_copy,
+            retired
+        );
+    }
+    if (server_info_section(cmd, "table")) {
+        buf_printf(
+            b,
+            "# Table\r\n"
+            "keys:%d\r\n"
+            "buckets:%d\r\n"
+            "load_factor:%.3f\r\n"
+            "tombstones:%d\r\n"
+            "resizes:%lu\r\n"
+            "resize_time_us:%llu\r\n"
+            "meta_keys:%d\r\n",
+            ht->count,
+            ht->size,
+            (double) ht->count / ht->size,
+            ht->deleted,
+            ht->resizes,
+            ht->resize_ns / 1000,
+            srv->meta->count
+        );
+#ifdef HT_COUNTERS
+        buf_append_str(b, "search_probes:");
+        for (i = 0; i < HT_PROBE_HIST; i++) {
+            buf_printf(
+                b,
+                "%s%zu%s=%llu",
+                i > 0 ? "," : "",
+                i + 1,
+                i + 1 == HT_PROBE_HIST ? "+" : "",
+                ht->counters.search_probes[i]
+            );
+        }
+        buf_append_str(b, "\r\n");
+#endif
+        ht_table_stats st;
+        ht_stats(ht, SERVER_STATS_SAMPLE, &st);
+        buf_printf(
+            b,
+            "sampled_buckets:%d\r\n"
+            "sampled_keys:%d\r\n"
+            "sampled_tombstones:%d\r\n"
+            "key_probes_mean:%.3f\r\n"
+            "key_max_displacement:%d\r\n"
+            "clusters:%d\r\n"
+            "cluster_mean:%.3f\r\n"
+            "cluster_max:%d\r\n"
+            "key_probes:",
+            st.buckets,
+            st.items,
+            st.tombstones,
+            st.mean_probes,
+            st.max_displacement,
+            st.clusters,
+            st.mean_cluster,
+            st.max_cluster
+        );
+        for (i = 0; i < HT_PROBE_HIST; i++) {
+            buf_printf(
+                b,
+                "%s%zu%s=%lu",
+                i > 0 ? "," : "",
+                i + 1,
+                i + 1 == HT_PROBE_HIST ? "+" : "",
+                st.probes[i]
+            );
+        }
+        buf_append_str(b, "\r\n\r\n");
+    }
+    if (server_info_section(cmd, "memory")) {
+        buf_printf(
+            b,
+            "# Memory\r\n"
+            "table_buckets_bytes:%zu\r\n"
+            "table_items_bytes:%zu\r\n"
+            "table_data_bytes:%zu\r\n"
+            "meta_bytes:%zu\r\n"
+            "total_bytes:%zu\r\n"
+            "\r\n",
+            ht->size * sizeof(ht_item *),
+            ht->count * sizeof(ht_item),
+            ht->data_bytes,
+            server_table_bytes(srv->meta),
+            server_table_bytes(ht) + server_table_bytes(srv->meta)
+        );
+    }
+    if (server_info_section(cmd, "latency")) {
+        buf_append_str(b, "# Latency\r\n");
+        for (i = 0; srv->latency != NULL && i < SERVER_NUM_COMMANDS; i++) {
+            const histogram *l = &srv->latency[i];
+            if (l->count == 0) {
+                continue;
+            }
+            char name[16];
+            size_t j;
+            for (j = 0; server_commands[i].name[j] != '\0' && j + 1 < sizeof(name); j++) {
+                name[j] = (char) (server_commands[i].name[j] | 0x20);
+            }
+            name[j] = '\0';
+            buf_printf(
+                b,
+                "latency_%s:calls=%llu,avg_us=%.3f,p50_us=%.3f,p99_us=%.3f,p999_us=%.3f,"
+                "max_us=%.3f\r\n",
+                name,
+                l->count,
+                l->total / 1000.0 / l->count,
+                hist_percentile(l, 0.5) / 1000.0,
+                hist_percentile(l, 0.99) / 1000.0,
+                hist_percentile(l, 0.999) / 1000.0,
+                l->max / 1000.0
+            );
+        }
+    }
+    resp_bulk(&c->out, b->data, b->len);
+}
+
+// encode arguments of a command as a RESP request
+static void server_encode(buffer *b, resp_command *cmd, int first, int n) {
+    resp_array(b, n + 1);
+    resp_bulk(b, cmd->argv[0], cmd->argv_len[0]);
+    int i;
+    for (i = first; i < first + n; i++) {
+        resp_bulk(b, cmd->argv[i], cmd->argv_len[i]);
+    }
+}
+
+/* Thread-per-core mode: send a command to the shards owning its keys.
+ * Commands on keys of several shards are split into one command per key.
+ * Returns 1 if the command was forwarded or split, 0 if it must be executed
+ * here.
+ */
+static int server_route(
+        server *srv,
+        server_conn *c,
+        const server_command *sc,
+        resp_command *cmd
+) {
+    buffer *b = &srv->encode;
+    b->pos = b->len = 0;
+    if (sc->route == SERVER_ROUTE_ALL) {
+        server_encode(b, cmd, 1, cmd->argc - 1);
+        server_broadcast(srv, c, SERVER_MERGE_SUM, b->data, b->len);
+        return 0;
+    }
+    const int shard = server_shard_of(srv, cmd->argv[1]);
+    if (sc->route == SERVER_ROUTE_KEYS) {
+        int i = 2;
+        while (i < cmd->argc && server_shard_of(srv, cmd->argv[i]) == shard) {
+            i++;
+        }
+        if (i < cmd->argc) {
+            for (i = 1; i < cmd->argc; i++) {
+                server_encode(&c->split, cmd, i, 1);
+            }
+            server_group_begin(c, SERVER_MERGE_SUM, cmd->argc - 1);
+            return 1;
+        }
+    }
+    if (shard == srv->shard_id) {
+        return 0;
+    }
+    server_encode(b, cmd, 1, cmd->argc - 1);
+    server_forward(srv, c, shard, b->data, b->len);
+    return 1;
+}
+
+static void server_execute(server *srv, server_conn *c, resp_command *cmd) {
+    size_t i;
+    for (i = 0; i < SERVER_NUM_COMMANDS; i++) {
+        const server_command *sc = &server_commands[i];
+        if (strcasecmp(sc->name, cmd->argv[0]) != 0) {
+            continue;
+        }
+        if ((sc->arity > 0 && cmd->argc != sc->arity)
+                || (sc->arity < 0 && cmd->argc < -sc->arity)) {
+            buf_printf(
+                &c->out,
+                "-ERR wrong number of arguments for '%s' command\r\n",
+                sc->name
+            );
+            return;
+        }
+        if (sc->write && srv->cfg->replicaof != NULL) {
+            resp_error(&c->out, "READONLY You can't write against a read only replica.");
+            return;
+        }
+        if (srv->shards != NULL && c != srv->scratch
+                && sc->route != SERVER_ROUTE_LOCAL
+                && server_route(srv, c, sc, cmd)) {
+            c->routed = 1;
+            return;
+        }
+        const uint64_t start = hist_now_ns();
+        sc->proc(srv, c, cmd);
+        server_record(srv, i, hist_now_ns() - start, 1);
+        return;
+    }
+    resp_error(&c->out, "ERR unknown command");
+}
+
+/* Pipelined GET commands are not executed one at a time: the keys of up to
+ * SERVER_GET_BATCH consecutive ones are collected and looked up together
+ * with ht_search_batch(), so the cache misses of their buckets overlap.
+ */
+#define SERVER_GET_BATCH 64
+
+static int server_is_get(const resp_command *cmd) {
+    return cmd->argc == 2 && strcasecmp(cmd->argv[0], "GET") == 0;
+}
+
+static void server_get_batch(server *srv, server_conn *c, const char **keys, int n) {
+    const uint64_t start = hist_now_ns();
+    char *values[SERVER_GET_BATCH];
+    ht_search_batch(srv->ht, keys, n, values);
+    /* Only the hits can have expired. Once an expired key is deleted, the
+     * value found for a later GET of the same key is gone, so the rest of the
+     * batch is looked up again one key at a time.
+     */
+    int removed = 0;
+    int i;
+    for (i = 0; i < n; i++) {
+        if (removed) {
+            values[i] = server_lookup(srv, keys[i]);
+        } else if (values[i] != NULL && server_expired(srv, keys[i])) {
+            server_remove(srv, keys[i]);
+            values[i] = NULL;
+            removed = 1;
+        }
+        if (values[i] == NULL) {
+            resp_null(&c->out);
+        } else {
+            resp_bulk(&c->out, values[i], strlen(values[i]));
+        }
+    }
+    // the commands of a batch share its execution time
+    server_record(srv, server_command_index("GET"), hist_now_ns() - start, n);
+}
+
+/* Execute every complete command in the input buffer. In thread-per-core
+ * mode the commands split in several are executed first, and input is paused
+ * while too many replies are in flight. Otherwise runs of GET commands are
+ * batched.
+ */
+void server_process_input(server *srv, server_conn *c) {
+    if (c->protocol == SERVER_PROTO_MEMCACHE) {
+        mc_process_input(srv, c);
+        return;
+    }
+    if (c->protocol == SERVER_PROTO_BINARY) {
+        bin_process_input(srv, c);
+        return;
+    }
+    if (c->protocol == SERVER_PROTO_MASTER) {
+        repl_process_input(srv, c);
+        return;
+    }
+    const int sharded = srv->shards != NULL && c != srv->scratch;
+    const int batching = srv->shards == NULL;
+    // keys of the batched GET commands, they point into the input buffer
+    const char *keys[SERVER_GET_BATCH];
+    int batched = 0;
+    while (!c->closing && server_pending_replies(c) < SERVER_MAX_INFLIGHT
+            && (buf_pending(&c->split) > 0 || buf_pending(&c->in) > 0)) {
+        buffer *in = buf_pending(&c->split) > 0 ? &c->split : &c->in;
+        const size_t mark = buf_pending(&c->out);
+        const char *err = NULL;
+        const long n = resp_parse(
+            in->data + in->pos,
+            buf_pending(in),
+            &srv->cmd,
+            &err
+        );
+        if (n == 0) {
+            break;
+        }
+        if (n > 0 && batching && server_is_get(&srv->cmd)) {
+            keys[batched++] = srv->cmd.argv[1];
+            buf_consume(in, n);
+            if (batched == SERVER_GET_BATCH) {
+                server_get_batch(srv, c, keys, batched);
+                batched = 0;
+            }
+            continue;
+        }
+        // replies of the batched commands come first
+        if (batched > 0) {
+            server_get_batch(srv, c, keys, batched);
+            batched = 0;
+        }
+        c->routed = 0;
+        if (n < 0) {
+            resp_error(&c->out, err);
+            c->closing = 1;
+        } else {
+            if (srv->cmd.argc > 0) {
+                server_execute(srv, c, &srv->cmd);
+            }
+            buf_consume(in, n);
+        }
+        if (sharded && !c->routed) {
+            server_local_reply(c, mark);
+        }
+    }
+    if (batched > 0) {
+        server_get_batch(srv, c, keys, batched);
+    }
+}
+
+// milliseconds the next process has to ask for the metadata after the values
+#define SERVER_HANDOFF_TIMEOUT_MS 5000
+
+/* Take the tables over from the process listening on the handoff socket,
+ * which hands them over once it stops serving: this blocks until then. The
+ * tables are left NULL when no process listens.
+ */
+static void server_handoff_receive(
+        const char *path,
+        ht_hash_table **ht,
+        ht_hash_table **meta,
+        unsigned long long *next_cas
+) {
+    *meta = NULL;
+    *ht = ht_handoff_receive(path);
+    if (*ht == NULL) {
+        return;
+    }
+    *meta = ht_handoff_receive(path);
+    if (*meta == NULL) {
+        // the keys get default metadata on their first memcached access
+        fprintf(stderr, "Could not take the metadata over on %s.\n", path);
+        *meta = ht_new();
+    }
+    // new CAS uniques must differ from the ones handed over
+    int index = 0;
+    ht_item *item;
+    while ((item = ht_next_item(*meta, &index)) != NULL) {
+        unsigned long long cas;
+        if (sscanf(item->value, "%*u %*d %llu", &cas) == 1 && cas > *next_cas) {
+            *next_cas = cas;
+        }
+    }
+    fprintf(stderr, "Took %d keys over on %s.\n", (*ht)->count, path);
+}
+
+/* Hand the tables to the next process if it is waiting on the handoff
+ * socket, which it must have connected to before this one was stopped. The
+ * socket is left for it to replace, or removed when no process took the
+ * tables.
+ */
+static void server_handoff_send(server *srv, int fd, const char *path) {
+    struct pollfd pfd = {fd, POLLIN, 0};
+    if (poll(&pfd, 1, 0) != 1) {
+        close(fd);
+        unlink(path);
+        return;
+    }
+    if (ht_handoff_send(srv->ht, fd) < 0
+            || poll(&pfd, 1, SERVER_HANDOFF_TIMEOUT_MS) != 1
+            || ht_handoff_send(srv->meta, fd) < 0) {
+        fprintf(stderr, "Could not hand the tables off on %s.\n", path);
+    } else {
+        fprintf(stderr, "Handed %d keys off on %s.\n", srv->ht->count, path);
+    }
+    close(fd);
+}
+
+// close the listeners, so another process can bind their addresses
+static void server_close_listeners(server *srv, int unix_fd) {
+    int i;
+    for (i = 0; i < srv->num_listeners; i++) {
+        close(srv->listeners[i].fd);
+    }
+    srv->num_listeners = 0;
+    if (unix_fd >= 0) {
+        unlink(srv->cfg->unix_path);
+    }
+}
+
+/* Serve the hash table until SIGINT or SIGTERM is received. Connections are
+ * handled with non-blocking sockets, driven by the event loop backend
+ * selected in the configuration, by a single thread or by one thread per
+ * shard of the keys.
+ */
+int server_run(const server_config *cfg) {
+    server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.cfg = cfg;
+
+    int err = 0;
+    int unix_fd = -1;
+    if (cfg->threads > 1 && cfg->backend != SERVER_BACKEND_EPOLL) {
+        fprintf(stderr, "Multiple threads require the epoll event loop.\n");
+        return -1;
+    }
+    if (cfg->threads > 1 && cfg->replicaof != NULL) {
+        fprintf(stderr, "Replicas run in a single thread.\n");
+        return -1;
+    }
+    if (cfg->threads > 1 && cfg->handoff_path != NULL) {
+        fprintf(stderr, "Handoffs require a single thread.\n");
+        return -1;
+    }
+
+    /* The tables are taken over before listening, since the previous process
+     * only releases the addresses once it hands them over.
+     */
+    ht_hash_table *handed_ht = NULL;
+    ht_hash_table *handed_meta = NULL;
+    int handoff_fd = -1;
+    if (cfg->handoff_path != NULL) {
+        server_handoff_receive(
+            cfg->handoff_path, &handed_ht, &handed_meta, &srv.next_cas
+        );
+        handoff_fd = ht_handoff_listen(cfg->handoff_path);
+        if (handoff_fd < 0) {
+            fprintf(stderr, "Could not listen on %s.\n", cfg->handoff_path);
+            err = -1;
+        }
+    }
+    if (err == 0 && cfg->port > 0) {
+        const int fd = server_listen_tcp(cfg->bind_addr, cfg->port, cfg->backlog);
+        if (fd < 0) {
+            fprintf(stderr, "Could not listen on port %d.\n", cfg->port);
+            err = -1;
+        } else {
+            server_add_listener(&srv, fd, SERVER_PROTO_RESP);
+        }
+    }
+    if (err == 0 && cfg->unix_path != NULL) {
+        unix_fd = server_listen_unix(cfg->unix_path, cfg->backlog);
+        if (unix_fd < 0) {
+            fprintf(stderr, "Could not listen on %s.\n", cfg->unix_path);
+            err = -1;
+        } else {
+            server_add_listener(&srv, unix_fd, SERVER_PROTO_RESP);
+        }
+    }
+
+    if (err == 0 && cfg->memcache_port > 0) {
+        const int fd = server_listen_tcp(
+            cfg->bind_addr,
+            cfg->memcache_port,
+            cfg->backlog
+        );
+        if (fd < 0) {
+            fprintf(stderr, "Could not listen on port %d.\n", cfg->memcache_port);
+            err = -1;
+        } else {
+            server_add_listener(&srv, fd, SERVER_PROTO_MEMCACHE);
+        }
+    }
+    if (err == 0 && cfg->binary_port > 0) {
+        const int fd = server_listen_tcp(
+            cfg->bind_addr,
+            cfg->binary_port,
+            cfg->backlog
+        );
+        if (fd < 0) {
+            fprintf(stderr, "Could not listen on port %d.\n", cfg->binary_port);
+            err = -1;
+        } else {
+            server_add_listener(&srv, fd, SERVER_PROTO_BINARY);
+        }
+    }
+
+    ht_trace *trace = NULL;
+    if (err == 0 && cfg->trace_path != NULL) {
+        trace = trace_create(cfg->trace_path);
+        if (trace == NULL) {
+            perror(cfg->trace_path);
+            err = -1;
+        }
+    }
+
+    if (err == 0) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = server_on_signal;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+        signal(SIGPIPE, SIG_IGN);
+
+        srv.started = time(NULL);
+        srv.ht = handed_ht != NULL ? handed_ht : ht_new();
+        srv.ht->free_value = server_retire;
+        srv.ht->free_value_arg = &srv;
+        srv.ht->trace = trace;
+        srv.meta = handed_meta != NULL ? handed_meta : ht_new();
+        resp_command_init(&srv.cmd);
+        if (cfg->replicaof != NULL && repl_connect(&srv) < 0) {
+            fprintf(stderr, "Could not connect to primary %s.\n", cfg->replicaof);
+            err = -1;
+        } else if (cfg->threads > 1) {
+            err = server_run_shards(&srv);
+        } else if (cfg->backend == SERVER_BACKEND_URING) {
+            err = server_run_uring(&srv);
+        } else {
+            err = server_run_epoll(&srv);
+        }
+        server_close_listeners(&srv, unix_fd);
+        unix_fd = -1;
+        if (handoff_fd >= 0) {
+            server_handoff_send(&srv, handoff_fd, cfg->handoff_path);
+            handoff_fd = -1;
+        }
+        resp_command_free(&srv.cmd);
+        ht_del_hash_table(srv.meta);
+        // connections are abandoned, nothing refers to the values anymore
+        srv.ht->free_value = NULL;
+        ht_del_hash_table(srv.ht);
+        srv.guarded = NULL;
+        server_reclaim(&srv);
+        free(srv.replicas);
+        buf_free(&srv.encode);
+        buf_free(&srv.args);
+        free(srv.latency);
+    } else if (handed_ht != NULL) {
+        ht_del_hash_table(handed_ht);
+        ht_del_hash_table(handed_meta);
+    }
+    if (handoff_fd >= 0) {
+        close(handoff_fd);
+        unlink(cfg->handoff_path);
+    }
+    if (trace != NULL && trace_close(trace) < 0) {
+        fprintf(stderr, "Could not write the trace to %s.\n", cfg->trace_path);
+    }
+
+    server_close_listeners(&srv, unix_fd);
+    return err;
+}
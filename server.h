@@ -0,0 +1,40 @@
+#ifndef SERVER_HEADER
+#define SERVER_HEADER
+
+// event loop implementations
+typedef enum {
+    SERVER_BACKEND_EPOLL,
+    SERVER_BACKEND_URING
+} server_backend;
+
+typedef struct {
+    // TCP address and port, the port is 0 to disable TCP
+    const char *bind_addr;
+    int port;
+    // path of a Unix socket, or NULL to disable it
+    const char *unix_path;
+    // TCP port for memcached protocol clients, 0 to disable it
+    int memcache_port;
+    // TCP port for binary protocol clients, 0 to disable it
+    int binary_port;
+    int backlog;
+    server_backend backend;
+    // number of threads, each one serving a shard of the keys
+    int threads;
+    /* primary to replicate, "host:port" or the path of a Unix socket, NULL
+     * for a primary
+     */
+    const char *replicaof;
+    // file to record the operations on the keys to, see trace.h, or NULL
+    const char *trace_path;
+    /* Unix socket to take the tables over from the process serving them
+     * before, then to hand them to the next one on exit, see handoff.h, or
+     * NULL
+     */
+    const char *handoff_path;
+} server_config;
+
+void server_config_init(server_config *cfg);
+int server_run(const server_config *cfg);
+
+#endif
@@ -0,0 +1,229 @@
+// epoll event loop of the key-value server
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "buffer.h"
+#include "server_internal.h"
+
+#define SERVER_MAX_EVENTS 256
+
+static void epoll_close_conn(int epoll_fd, server_conn *c) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    if (c->waiting > 0) {
+        // freed when the replies of its forwarded commands come back
+        c->dead = 1;
+        return;
+    }
+    server_free_conn(c);
+}
+
+static void epoll_accept(int epoll_fd, server_listener *l) {
+    for (;;) {
+        const int fd = accept4(l->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            // EAGAIN means the backlog is drained, other errors are transient
+            return;
+        }
+        server_conn *c = server_new_conn(fd, l->protocol);
+        c->events = EPOLLIN;
+        struct epoll_event ev = {0};
+        ev.events = c->events;
+        ev.data.ptr = c;
+        if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            close(fd);
+            server_free_conn(c);
+        }
+    }
+}
+
+/* Wait for writability while output is pending, and stop reading from
+ * clients that do not consume their replies or wait for too many of them.
+ */
+static void epoll_update_events(int epoll_fd, server_conn *c) {
+    const size_t pending = server_out_pending(c);
+    const uint32_t events =
+        (pending <= SERVER_MAX_OUTPUT
+         && server_pending_replies(c) < SERVER_MAX_INFLIGHT ? EPOLLIN : 0)
+        | (pending > 0 ? EPOLLOUT : 0);
+    if (events == c->events) {
+        return;
+    }
+    struct epoll_event ev = {0};
+    ev.events = events;
+    ev.data.ptr = c;
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+    c->events = events;
+}
+
+/* Write as much pending output as the socket accepts, returns -1 on error.
+ * Output referencing values of the table is gathered with writev().
+ */
+static int epoll_flush(server_conn *c) {
+    while (server_out_pending(c) > 0) {
+        ssize_t n;
+        if (c->refs_head < c->num_refs) {
+            struct iovec iov[SERVER_IOV_MAX];
+            n = writev(c->fd, iov, server_out_iov(c, iov, SERVER_IOV_MAX));
+        } else {
+            n = write(c->fd, c->out.data + c->out.pos, buf_pending(&c->out));
+        }
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        server_out_consume(c, n);
+    }
+    return 0;
+}
+
+// send the replies of a connection, closing it when it is done
+static void epoll_finish(int epoll_fd, server_conn *c) {
+    if (epoll_flush(c) < 0
+            || (c->closing && server_out_pending(c) == 0 && c->waiting == 0)) {
+        epoll_close_conn(epoll_fd, c);
+        return;
+    }
+    epoll_update_events(epoll_fd, c);
+}
+
+static void epoll_handle_conn(
+        server *srv,
+        int epoll_fd,
+        server_conn *c,
+        uint32_t events
+) {
+    if (events & EPOLLIN) {
+        for (;;) {
+            if (server_out_pending(c) > SERVER_MAX_OUTPUT
+                    || server_pending_replies(c) >= SERVER_MAX_INFLIGHT) {
+                break;
+            }
+            buf_reserve(&c->in, SERVER_READ_SIZE);
+            const ssize_t n = read(
+                c->fd,
+                c->in.data + c->in.len,
+                c->in.cap - c->in.len
+            );
+            if (n > 0) {
+                c->in.len += n;
+                server_process_input(srv, c);
+                continue;
+            }
+            if (n < 0 && errno == EINTR) {
+                continue;
+            }
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            }
+            // end of stream or read error
+            epoll_close_conn(epoll_fd, c);
+            return;
+        }
+    } else if (events & (EPOLLERR | EPOLLHUP)
+            && !(events & EPOLLOUT)) {
+        epoll_close_conn(epoll_fd, c);
+        return;
+    }
+    epoll_finish(epoll_fd, c);
+}
+
+// continue with a connection whose forwarded commands are answered
+static void epoll_resume(server *srv, server_conn *c, void *arg) {
+    server_process_input(srv, c);
+    epoll_finish(*(int *) arg, c);
+}
+
+/* Run the server with a level-triggered epoll loop. In thread-per-core mode
+ * each thread runs one, the listeners are shared and each connection is woken
+ * up in a single thread. A single thread writes large values by reference.
+ */
+int server_run_epoll(server *srv) {
+    srv->zero_copy = srv->shards == NULL;
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        perror("epoll_create1");
+        return -1;
+    }
+    int i;
+    for (i = 0; i < srv->num_listeners; i++) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN | (srv->shards != NULL ? EPOLLEXCLUSIVE : 0);
+        ev.data.ptr = &srv->listeners[i];
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, srv->listeners[i].fd, &ev);
+    }
+    if (srv->shards != NULL) {
+        struct epoll_event ev = {0};
+        ev.events = EPOLLIN;
+        ev.data.ptr = &srv->notifier;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, srv->notifier.fd, &ev);
+    }
+    if (srv->master != NULL) {
+        // the link to the primary starts with a request to send
+        server_conn *c = srv->master;
+        c->events = EPOLLIN | EPOLLOUT;
+        struct epoll_event ev = {0};
+        ev.events = c->events;
+        ev.data.ptr = c;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, c->fd, &ev);
+    }
+
+    struct epoll_event events[SERVER_MAX_EVENTS];
+    // set while messages for other shards wait for room in their queues
+    int backlogged = 0;
+    while (!__atomic_load_n(&server_stop, __ATOMIC_ACQUIRE)) {
+        const int n = epoll_wait(
+            epoll_fd,
+            events,
+            SERVER_MAX_EVENTS,
+            backlogged ? 1 : -1
+        );
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            break;
+        }
+        int notified = 0;
+        for (i = 0; i < n; i++) {
+            const int type = *(int *) events[i].data.ptr;
+            if (type == SERVER_LISTENER) {
+                epoll_accept(epoll_fd, events[i].data.ptr);
+            } else if (type == SERVER_NOTIFIER) {
+                notified = 1;
+            } else {
+                epoll_handle_conn(srv, epoll_fd, events[i].data.ptr, events[i].events);
+            }
+        }
+        /* Messages are received once the events are handled, since resuming
+         * a connection may free it while it still has a pending event.
+         */
+        if (notified) {
+            server_shards_receive(srv, epoll_resume, &epoll_fd);
+        }
+        if (srv->shards != NULL) {
+            backlogged = server_shards_flush(srv);
+        }
+        // send the changes made during this iteration to the replicas
+        if (srv->repl_dirty) {
+            srv->repl_dirty = 0;
+            for (i = srv->num_replicas - 1; i >= 0; i--) {
+                epoll_finish(epoll_fd, srv->replicas[i]);
+            }
+        }
+        server_reclaim(srv);
+    }
+
+    /* Connections are not tracked outside of epoll, they are released when the
+     * process exits.
+     */
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,296 @@
+#ifndef SERVER_INTERNAL_HEADER
+#define SERVER_INTERNAL_HEADER
+
+// state shared by the server and its event loop backends
+
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/uio.h>
+#include "hash_table.h"
+#include "buffer.h"
+#include "resp.h"
+#include "histogram.h"
+#include "server.h"
+
+#define SERVER_READ_SIZE 16384
+// connections whose pending output exceeds this are not read from
+#define SERVER_MAX_OUTPUT (64L << 20)
+
+// kinds of objects registered with an event loop
+enum { SERVER_LISTENER, SERVER_CONN, SERVER_NOTIFIER };
+
+/* protocols spoken by clients of a listener, and by the link of a replica to
+ * its primary
+ */
+enum {
+    SERVER_PROTO_RESP,
+    SERVER_PROTO_MEMCACHE,
+    SERVER_PROTO_BINARY,
+    SERVER_PROTO_MASTER
+};
+
+typedef struct {
+    int type;
+    int fd;
+    int protocol;
+} server_listener;
+
+/* A value of the table written by reference, after 'before' more bytes of
+ * the output buffer. 'epoch' is the epoch of the server when the reference
+ * was made.
+ */
+typedef struct {
+    const char *data;
+    size_t len;
+    size_t before;
+    unsigned long long epoch;
+} server_ref;
+
+typedef struct server_msg server_msg;
+typedef struct server_shards server_shards;
+struct server;
+
+typedef struct server_conn {
+    int type;
+    int fd;
+    int protocol;
+    buffer in;
+    buffer out;
+    // set when the connection must be closed once its output is flushed
+    int closing;
+    // epoll backend: events the connection is registered for
+    uint32_t events;
+    /* io_uring backend: bytes handed to the kernel by a send stay in
+     * 'send_buf' until it completes, new replies go to 'out' meanwhile.
+     */
+    buffer send_buf;
+    int recv_armed;
+    int sending;
+    // operations submitted and not completed yet
+    int inflight;
+    // set once the connection is closed, it is freed with its last operation
+    int dead;
+    /* Set while the connection waits for room in the submission queue to
+     * arm its receive or send, linked in the stalled list of the ring.
+     */
+    int stalled;
+    struct server_conn *stall_next;
+    /* Thread-per-core mode: commands on keys of other shards are forwarded
+     * to their owner while the connection goes on with the next ones. Every
+     * command produces a reply numbered in command order, replies completed
+     * ahead of their turn are held until the previous ones are written.
+     */
+    int waiting;
+    unsigned long sent_seq;
+    unsigned long next_seq;
+    server_msg *held;
+    // set when the current command was forwarded or split
+    int routed;
+    // link in the list of connections to resume once messages are received
+    int ready;
+    struct server_conn *ready_next;
+    /* Commands touching the keys of several shards are split into one
+     * command per key, queued in 'split' and executed before the rest of the
+     * input. The replies of a group of commands are merged into one.
+     */
+    buffer split;
+    int group_merge;
+    int group_n;
+    int group_left;
+    int merge;
+    int merge_left;
+    long long merge_sum;
+    /* Replication links: a replica connected to this server, or the link of
+     * this server to its primary. 'srv' is the server they belong to.
+     */
+    struct server *srv;
+    int replica;
+    // offset of the operation stream acknowledged by a replica
+    unsigned long long repl_ack;
+    /* output a replica may have pending before it is dropped: its snapshot
+     * and SERVER_MAX_OUTPUT bytes of changes
+     */
+    size_t repl_max_output;
+    /* Zero-copy output: values referenced by the replies, pending from
+     * refs[refs_head] to refs[num_refs - 1]. 'refs_out' counts the bytes of
+     * 'out' written before the last reference and 'refs_len' the bytes of the
+     * values left. Connections with references are linked in the guarded
+     * list of their server.
+     */
+    server_ref *refs;
+    int refs_head;
+    int num_refs;
+    int refs_cap;
+    size_t refs_out;
+    size_t refs_len;
+    int guarded;
+    struct server_conn *guard_prev;
+    struct server_conn *guard_next;
+} server_conn;
+
+// replies a connection may have in flight before its input is paused
+#define SERVER_MAX_INFLIGHT 256
+#define server_pending_replies(c) ((c)->sent_seq - (c)->next_seq)
+
+// bytes of output waiting to be written, copied in 'out' or referenced
+#define server_out_pending(c) (buf_pending(&(c)->out) + (c)->refs_len)
+// values shorter than this are copied into the output rather than referenced
+#define SERVER_REF_MIN 1024
+// entries of the iovec arrays used to write output with references
+#define SERVER_IOV_MAX 64
+
+// ways of merging the replies of a split or broadcast command
+enum {
+    SERVER_MERGE_NONE,
+    // RESP integers, replaced by their sum
+    SERVER_MERGE_SUM,
+    // memcached retrieval replies, concatenated under a single END
+    SERVER_MERGE_VALUES,
+    // identical replies, only the first one is kept
+    SERVER_MERGE_FIRST
+};
+
+// eventfd waking up the thread of a shard when messages are queued for it
+typedef struct {
+    int type;
+    int fd;
+} server_notifier;
+
+/* Items written through the memcached protocol carry client flags, an
+ * expiration time and a CAS unique. They are kept in a second table mapping
+ * the key to "<flags> <exptime> <cas>", keys without an entry never expire.
+ */
+typedef struct {
+    unsigned flags;
+    // absolute expiration time in seconds since the epoch, 0 for none
+    long exptime;
+    unsigned long long cas;
+} server_meta;
+
+// value that left the table while it may still be referenced by replies
+typedef struct server_retired {
+    struct server_retired *next;
+    char *value;
+    unsigned long long epoch;
+} server_retired;
+
+// state of the link of a replica to its primary
+enum { REPL_NONE, REPL_SYNCING, REPL_SYNCED, REPL_LOST };
+
+typedef struct server {
+    const server_config *cfg;
+    server_listener listeners[4];
+    int num_listeners;
+    ht_hash_table *ht;
+    ht_hash_table *meta;
+    unsigned long long next_cas;
+    resp_command cmd;
+    /* Thread-per-core mode, 'shards' is NULL when a single thread serves
+     * every key. Each thread owns the keys of its shard in 'ht' and 'meta'.
+     */
+    server_shards *shards;
+    int shard_id;
+    int shard_count;
+    server_notifier notifier;
+    // executes the requests forwarded by other shards
+    server_conn *scratch;
+    buffer encode;
+    // messages that did not fit in the queue of a shard, by destination
+    server_msg **backlog;
+    server_msg **backlog_tail;
+    // shards that were sent messages since they were last woken up
+    unsigned char *wake;
+    // connections with new replies, resumed after receiving messages
+    server_conn *ready;
+    /* Replication. A primary sends a snapshot of its tables to each replica,
+     * then every change as an operation, 'repl_offset' counts the bytes of
+     * operations sent so far. Replicas with output to send are flushed by the
+     * event loop once 'repl_dirty' is set.
+     */
+    server_conn **replicas;
+    int num_replicas;
+    int replicas_cap;
+    unsigned long long repl_offset;
+    int repl_dirty;
+    // replica side: link to the primary and offset of the stream applied
+    server_conn *master;
+    int master_state;
+    unsigned long long master_offset;
+    /* Zero-copy output, enabled by the epoll loop of a single thread. Values
+     * leaving the table while replies reference values are retired at the
+     * current epoch, which then advances. A retired value is freed once every
+     * guarded connection has written its references up to that epoch.
+     */
+    int zero_copy;
+    unsigned long long epoch;
+    server_retired *retired;
+    server_retired *retired_tail;
+    server_conn *guarded;
+    // NUL-terminated copies of the key and value of a binary request
+    buffer args;
+    // statistics reported by INFO, 'latency' has an entry per RESP command
+    time_t started;
+    histogram *latency;
+} server;
+
+extern sig_atomic_t server_stop;
+
+server_conn *server_new_conn(int fd, int protocol);
+void server_free_conn(server_conn *c);
+void server_process_input(server *srv, server_conn *c);
+
+char *server_lookup(server *srv, const char *key);
+void server_put(server *srv, const char *key, const char *value);
+void server_store(server *srv, const char *key, const char *value);
+int server_remove(server *srv, const char *key);
+int server_get_meta(server *srv, const char *key, server_meta *m);
+void server_set_meta(server *srv, const char *key, const server_meta *m);
+void server_remove_meta(server *srv, const char *key);
+void server_flush_all(server *srv);
+
+void server_out_value(server *srv, server_conn *c, const char *value, size_t len);
+int server_out_iov(server_conn *c, struct iovec *iov, int max);
+void server_out_consume(server_conn *c, size_t n);
+void server_reclaim(server *srv);
+
+void repl_propagate(server *srv, int argc, const char **argv);
+void repl_cmd_sync(server *srv, server_conn *c, resp_command *cmd);
+void repl_cmd_replconf(server *srv, server_conn *c, resp_command *cmd);
+void repl_cmd_role(server *srv, server_conn *c, resp_command *cmd);
+int repl_connect(server *srv);
+void repl_process_input(server *srv, server_conn *c);
+void repl_unlink(server *srv, server_conn *c);
+
+void mc_process_input(server *srv, server_conn *c);
+void bin_process_input(server *srv, server_conn *c);
+
+int server_shard_of(const server *srv, const char *key);
+void server_forward(
+        server *srv,
+        server_conn *c,
+        int shard,
+        const char *data,
+        size_t len
+);
+void server_broadcast(
+        server *srv,
+        server_conn *c,
+        int merge,
+        const char *data,
+        size_t len
+);
+void server_group_begin(server_conn *c, int merge, int n);
+void server_local_reply(server_conn *c, size_t mark);
+void server_shards_receive(
+        server *srv,
+        void (*resume)(server *srv, server_conn *c, void *arg),
+        void *arg
+);
+int server_shards_flush(server *srv);
+int server_run_shards(server *srv);
+
+int server_run_epoll(server *srv);
+int server_run_uring(server *srv);
+
+#endif
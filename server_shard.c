@@ -0,0 +1,551 @@
+/* Thread-per-core mode of the key-value server.
+ *
+ * Every thread runs its own event loop and owns the keys of one shard, picked
+ * by hashing the key. Connections are served by the thread that accepted
+ * them: commands on keys of another shard are forwarded to its owner as a
+ * message, executed there, and the reply comes back the same way. Each pair of
+ * threads shares a single-producer single-consumer queue in each direction,
+ * so no lock is taken on the data path, and an eventfd wakes up the receiver.
+ *
+ * A connection keeps executing its commands while earlier ones are
+ * forwarded, replies are numbered and written in command order. Commands on
+ * the same key always reach the same shard through the same queue, so they
+ * are executed in order too.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "xmalloc.h"
+#include "fnv.h"
+#include "hash_table.h"
+#include "buffer.h"
+#include "resp.h"
+#include "server_internal.h"
+
+// entries of a queue, a power of 2
+#define SHARD_QUEUE_SIZE 1024
+#define SHARD_CACHE_LINE 64
+
+struct server_msg {
+    // link in the backlog of the sender
+    server_msg *next;
+    server_conn *conn;
+    int from;
+    int reply;
+    int protocol;
+    // position of the reply on its connection, and its merge group
+    unsigned long seq;
+    int merge;
+    int merge_n;
+    size_t len;
+    char data[];
+};
+
+// the producer only writes 'tail' and the consumer only writes 'head'
+typedef struct {
+    unsigned head __attribute__((aligned(SHARD_CACHE_LINE)));
+    unsigned tail __attribute__((aligned(SHARD_CACHE_LINE)));
+    server_msg *slots[SHARD_QUEUE_SIZE] __attribute__((aligned(SHARD_CACHE_LINE)));
+} shard_queue;
+
+struct server_shards {
+    int count;
+    server **servers;
+    // queue from shard 'i' to shard 'j' at index i * count + j
+    shard_queue *queues;
+};
+
+static shard_queue *shard_queue_of(server_shards *s, int from, int to) {
+    return &s->queues[from * s->count + to];
+}
+
+static int shard_queue_push(shard_queue *q, server_msg *msg) {
+    const unsigned tail = q->tail;
+    if (tail - __atomic_load_n(&q->head, __ATOMIC_ACQUIRE) == SHARD_QUEUE_SIZE) {
+        return -1;
+    }
+    q->slots[tail & (SHARD_QUEUE_SIZE - 1)] = msg;
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static server_msg *shard_queue_pop(shard_queue *q) {
+    const unsigned head = q->head;
+    if (head == __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE)) {
+        return NULL;
+    }
+    server_msg *msg = q->slots[head & (SHARD_QUEUE_SIZE - 1)];
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_RELEASE);
+    return msg;
+}
+
+// return the shard owning a key
+int server_shard_of(const server *srv, const char *key) {
+    // FNV-1a, independent of the hash used inside the tables
+    const uint32_t hash = fnv1a_32(key, strlen(key));
+    return (int) (hash % (unsigned) srv->shard_count);
+}
+
+/* Queue a message for a shard. It goes to the backlog when the queue is full,
+ * or when older messages are already waiting there.
+ */
+static void shard_send(server *srv, int to, server_msg *msg) {
+    msg->from = srv->shard_id;
+    if (srv->backlog[to] != NULL
+            || shard_queue_push(shard_queue_of(srv->shards, srv->shard_id, to), msg) < 0) {
+        msg->next = NULL;
+        if (srv->backlog[to] == NULL) {
+            srv->backlog[to] = msg;
+        } else {
+            srv->backlog_tail[to]->next = msg;
+        }
+        srv->backlog_tail[to] = msg;
+        return;
+    }
+    srv->wake[to] = 1;
+}
+
+static server_msg *shard_msg_new(server_conn *c, int protocol, const char *data, size_t len) {
+    server_msg *msg = xmalloc(sizeof(server_msg) + len);
+    msg->next = NULL;
+    msg->conn = c;
+    msg->reply = 0;
+    msg->protocol = protocol;
+    msg->len = len;
+    if (len > 0) {
+        memcpy(msg->data, data, len);
+    }
+    return msg;
+}
+
+/* The next 'n' replies of a connection are merged into one, the commands
+ * producing them come next.
+ */
+void server_group_begin(server_conn *c, int merge, int n) {
+    c->group_merge = merge;
+    c->group_n = n;
+    c->group_left = n;
+}
+
+// number a new reply of a connection and return its merge group
+static unsigned long shard_next_reply(server_conn *c, int *merge, int *merge_n) {
+    *merge = c->group_merge;
+    // the size of a group goes with its first reply
+    *merge_n = c->group_n;
+    c->group_n = 0;
+    if (c->group_left > 0 && --c->group_left == 0) {
+        c->group_merge = SERVER_MERGE_NONE;
+    }
+    return c->sent_seq++;
+}
+
+// send a command of a connection to the shard owning its key
+void server_forward(
+        server *srv,
+        server_conn *c,
+        int shard,
+        const char *data,
+        size_t len
+) {
+    server_msg *msg = shard_msg_new(c, c->protocol, data, len);
+    msg->seq = shard_next_reply(c, &msg->merge, &msg->merge_n);
+    shard_send(srv, shard, msg);
+    c->waiting++;
+}
+
+/* Send a command to every other shard, the caller executes it locally and its
+ * reply is merged with the others.
+ */
+void server_broadcast(
+        server *srv,
+        server_conn *c,
+        int merge,
+        const char *data,
+        size_t len
+) {
+    server_group_begin(c, merge, srv->shard_count);
+    int i;
+    for (i = 0; i < srv->shard_count; i++) {
+        if (i != srv->shard_id) {
+            server_forward(srv, c, i, data, len);
+        }
+    }
+}
+
+/* Merge the reply appended to the output of a connection after 'mark'
+ * pending bytes, and write the merged reply once the last one is in.
+ */
+static void shard_merge_reply(server_conn *c, size_t mark) {
+    buffer *out = &c->out;
+    const char *reply = out->data + out->pos + mark;
+    const size_t len = buf_pending(out) - mark;
+    switch (c->merge) {
+    case SERVER_MERGE_SUM:
+        if (len > 0 && reply[0] == ':') {
+            c->merge_sum += strtoll(reply + 1, NULL, 10);
+        }
+        out->len -= len;
+        break;
+    case SERVER_MERGE_VALUES:
+        if (len >= 5 && memcmp(reply + len - 5, "END\r\n", 5) == 0) {
+            out->len -= 5;
+        }
+        break;
+    case SERVER_MERGE_FIRST:
+        // merge_sum counts the replies kept so far
+        if (c->merge_sum++ > 0) {
+            out->len -= len;
+        }
+        break;
+    }
+    if (--c->merge_left > 0) {
+        return;
+    }
+    if (c->merge == SERVER_MERGE_SUM) {
+        resp_integer(out, c->merge_sum);
+    } else if (c->merge == SERVER_MERGE_VALUES) {
+        buf_append_str(out, "END\r\n");
+    }
+}
+
+// finish writing the reply appended after 'mark' pending bytes of the output
+static void shard_write_reply(server_conn *c, size_t mark, int merge, int merge_n) {
+    if (merge_n > 0) {
+        c->merge = merge;
+        c->merge_left = merge_n;
+        c->merge_sum = 0;
+    }
+    if (merge != SERVER_MERGE_NONE) {
+        shard_merge_reply(c, mark);
+    }
+    c->next_seq++;
+}
+
+// keep a reply completed ahead of its turn, by order of sequence
+static void shard_hold(server_conn *c, server_msg *msg) {
+    server_msg **p = &c->held;
+    while (*p != NULL && (*p)->seq < msg->seq) {
+        p = &(*p)->next;
+    }
+    msg->next = *p;
+    *p = msg;
+}
+
+/* The output appended after 'mark' pending bytes is the reply of a command
+ * executed by the shard of the connection. It is written now if the replies
+ * of previous commands are, and held otherwise.
+ */
+void server_local_reply(server_conn *c, size_t mark) {
+    int merge, merge_n;
+    const unsigned long seq = shard_next_reply(c, &merge, &merge_n);
+    if (seq == c->next_seq) {
+        shard_write_reply(c, mark, merge, merge_n);
+        return;
+    }
+    buffer *out = &c->out;
+    const size_t len = buf_pending(out) - mark;
+    server_msg *msg = shard_msg_new(c, c->protocol, out->data + out->pos + mark, len);
+    msg->seq = seq;
+    msg->merge = merge;
+    msg->merge_n = merge_n;
+    out->len -= len;
+    shard_hold(c, msg);
+}
+
+static void shard_write_msg(server_conn *c, server_msg *msg) {
+    const size_t mark = buf_pending(&c->out);
+    buf_append(&c->out, msg->data, msg->len);
+    shard_write_reply(c, mark, msg->merge, msg->merge_n);
+    free(msg);
+}
+
+// execute a command forwarded by another shard and send its reply back
+static void shard_execute(server *srv, server_msg *msg) {
+    server_conn *scratch = srv->scratch;
+    scratch->protocol = msg->protocol;
+    scratch->closing = 0;
+    buf_append(&scratch->in, msg->data, msg->len);
+    server_process_input(srv, scratch);
+    // forwarded commands are always complete
+    buf_consume(&scratch->in, buf_pending(&scratch->in));
+
+    server_msg *reply = shard_msg_new(
+        msg->conn,
+        msg->protocol,
+        scratch->out.data + scratch->out.pos,
+        buf_pending(&scratch->out)
+    );
+    reply->reply = 1;
+    reply->seq = msg->seq;
+    reply->merge = msg->merge;
+    reply->merge_n = msg->merge_n;
+    buf_consume(&scratch->out, buf_pending(&scratch->out));
+    shard_send(srv, msg->from, reply);
+    free(msg);
+}
+
+// hand the reply of a forwarded command to its connection
+static void shard_deliver(server *srv, server_msg *msg) {
+    server_conn *c = msg->conn;
+    c->waiting--;
+    if (c->dead) {
+        // the connection was closed while waiting, it is freed with its last reply
+        free(msg);
+        if (c->waiting == 0) {
+            while (c->held != NULL) {
+                server_msg *held = c->held;
+                c->held = held->next;
+                free(held);
+            }
+            server_free_conn(c);
+        }
+        return;
+    }
+    if (msg->seq != c->next_seq) {
+        shard_hold(c, msg);
+        return;
+    }
+    shard_write_msg(c, msg);
+    while (c->held != NULL && c->held->seq == c->next_seq) {
+        server_msg *held = c->held;
+        c->held = held->next;
+        shard_write_msg(c, held);
+    }
+    if (!c->ready) {
+        c->ready = 1;
+        c->ready_next = srv->ready;
+        srv->ready = c;
+    }
+}
+
+/* Process the messages queued for this shard. Connections that received
+ * replies are then passed to 'resume', which processes the rest of their
+ * input and sends their replies.
+ */
+void server_shards_receive(
+        server *srv,
+        void (*resume)(server *srv, server_conn *c, void *arg),
+        void *arg
+) {
+    uint64_t n;
+    // read the counter before draining so a later message wakes us up again
+    while (read(srv->notifier.fd, &n, sizeof(n)) < 0 && errno == EINTR) {
+    }
+    int i;
+    for (i = 0; i < srv->shard_count; i++) {
+        if (i == srv->shard_id) {
+            continue;
+        }
+        shard_queue *q = shard_queue_of(srv->shards, i, srv->shard_id);
+        server_msg *msg;
+        while ((msg = shard_queue_pop(q)) != NULL) {
+            if (msg->reply) {
+                shard_deliver(srv, msg);
+            } else {
+                shard_execute(srv, msg);
+            }
+        }
+    }
+    while (srv->ready != NULL) {
+        server_conn *c = srv->ready;
+        srv->ready = c->ready_next;
+        c->ready = 0;
+        resume(srv, c, arg);
+    }
+}
+
+/* Move backlogged messages to their queues and wake up the shards that were
+ * sent messages. Returns 1 if some messages are still backlogged, the caller
+ * then retries shortly.
+ */
+int server_shards_flush(server *srv) {
+    int backlogged = 0;
+    int i;
+    for (i = 0; i < srv->shard_count; i++) {
+        shard_queue *q = shard_queue_of(srv->shards, srv->shard_id, i);
+        while (srv->backlog[i] != NULL) {
+            server_msg *msg = srv->backlog[i];
+            if (shard_queue_push(q, msg) < 0) {
+                backlogged = 1;
+                break;
+            }
+            srv->backlog[i] = msg->next;
+            srv->wake[i] = 1;
+        }
+        if (srv->wake[i]) {
+            const uint64_t one = 1;
+            while (write(srv->shards->servers[i]->notifier.fd, &one, sizeof(one)) < 0
+                    && errno == EINTR) {
+            }
+            srv->wake[i] = 0;
+        }
+    }
+    return backlogged;
+}
+
+// run the calling thread on the 'index'-th CPU the process may use
+static void shard_pin(int index) {
+    cpu_set_t allowed, set;
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        return;
+    }
+    const int ncpus = CPU_COUNT(&allowed);
+    int cpu, seen = 0;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &allowed) && seen++ == index % ncpus) {
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+            return;
+        }
+    }
+}
+
+static void *shard_thread(void *arg) {
+    server *srv = arg;
+    shard_pin(srv->shard_id);
+    if (server_run_epoll(srv) < 0) {
+        __atomic_store_n(&server_stop, 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void shard_init(server *srv, server_shards *shards, int id) {
+    srv->shards = shards;
+    srv->shard_id = id;
+    srv->shard_count = shards->count;
+    srv->notifier.type = SERVER_NOTIFIER;
+    srv->notifier.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    srv->scratch = server_new_conn(-1, SERVER_PROTO_RESP);
+    buf_init(&srv->encode);
+    srv->backlog = xcalloc(shards->count, sizeof(server_msg *));
+    srv->backlog_tail = xcalloc(shards->count, sizeof(server_msg *));
+    srv->wake = xcalloc(shards->count, 1);
+}
+
+static void shard_free(server *srv) {
+    int i;
+    for (i = 0; i < srv->shard_count; i++) {
+        while (srv->backlog[i] != NULL) {
+            server_msg *msg = srv->backlog[i];
+            srv->backlog[i] = msg->next;
+            free(msg);
+        }
+        // messages still queued for this shard
+        server_msg *msg;
+        while ((msg = shard_queue_pop(shard_queue_of(srv->shards, i, srv->shard_id))) != NULL) {
+            free(msg);
+        }
+    }
+    free(srv->backlog);
+    free(srv->backlog_tail);
+    free(srv->wake);
+    buf_free(&srv->encode);
+    buf_free(&srv->args);
+    server_free_conn(srv->scratch);
+    if (srv->notifier.fd >= 0) {
+        close(srv->notifier.fd);
+    }
+    srv->shards = NULL;
+}
+
+/* Serve the keys from cfg->threads threads, 'srv' becomes the first shard and
+ * runs in the calling thread. All threads accept connections from the
+ * listeners of 'srv'.
+ */
+int server_run_shards(server *srv) {
+    server_shards shards;
+    shards.count = srv->cfg->threads;
+    shards.servers = xcalloc(shards.count, sizeof(server *));
+    shards.queues = aligned_alloc(
+        SHARD_CACHE_LINE,
+        (size_t) shards.count * shards.count * sizeof(shard_queue)
+    );
+    if (shards.queues == NULL) {
+        fprintf(stderr, "Out of memory.\n");
+        exit(1);
+    }
+    memset(shards.queues, 0, (size_t) shards.count * shards.count * sizeof(shard_queue));
+
+    int i;
+    shards.servers[0] = srv;
+    for (i = 1; i < shards.count; i++) {
+        server *s = xcalloc(1, sizeof(server));
+        s->cfg = srv->cfg;
+        memcpy(s->listeners, srv->listeners, sizeof(srv->listeners));
+        s->num_listeners = srv->num_listeners;
+        s->started = srv->started;
+        s->ht = ht_new();
+        s->ht->trace = srv->ht->trace;
+        s->meta = ht_new();
+        resp_command_init(&s->cmd);
+        shards.servers[i] = s;
+    }
+    int err = 0;
+    for (i = 0; i < shards.count; i++) {
+        shard_init(shards.servers[i], &shards, i);
+        if (shards.servers[i]->notifier.fd < 0) {
+            err = -1;
+        }
+    }
+
+    pthread_t *threads = xcalloc(shards.count, sizeof(pthread_t));
+    int started = 1;
+    if (err == 0) {
+        // signals are handled by the first thread, which stops the others
+        sigset_t set, old;
+        sigemptyset(&set);
+        sigaddset(&set, SIGINT);
+        sigaddset(&set, SIGTERM);
+        pthread_sigmask(SIG_BLOCK, &set, &old);
+        for (started = 1; started < shards.count; started++) {
+            if (pthread_create(&threads[started], NULL, shard_thread,
+                               shards.servers[started]) != 0) {
+                break;
+            }
+        }
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        if (started < shards.count) {
+            perror("pthread_create");
+            err = -1;
+        } else {
+            shard_pin(0);
+            err = server_run_epoll(srv);
+        }
+    } else {
+        perror("eventfd");
+    }
+
+    __atomic_store_n(&server_stop, 1, __ATOMIC_RELEASE);
+    for (i = 1; i < started; i++) {
+        const uint64_t one = 1;
+        if (write(shards.servers[i]->notifier.fd, &one, sizeof(one)) < 0) {
+            perror("write");
+        }
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+
+    for (i = 0; i < shards.count; i++) {
+        server *s = shards.servers[i];
+        shard_free(s);
+        if (i > 0) {
+            resp_command_free(&s->cmd);
+            ht_del_hash_table(s->meta);
+            ht_del_hash_table(s->ht);
+            free(s->latency);
+            free(s);
+        }
+    }
+    free(shards.queues);
+    free(shards.servers);
+    return err;
+}
@@ -0,0 +1,503 @@
+// io_uring event loop of the key-value server
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include "xmalloc.h"
+#include "buffer.h"
+#include "server_internal.h"
+
+#define URING_ENTRIES 4096
+// number of provided receive buffers, a power of 2
+#define URING_BUFFERS 1024
+#define URING_BUFFER_SIZE 16384
+#define URING_BUFFER_GROUP 0
+
+/* The operation of a request is kept in the low bits of its user data, the
+ * other bits hold the connection pointer or the listener index.
+ */
+enum { URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_CANCEL };
+#define URING_OP_BITS 3
+#define URING_OP_MASK ((1 << URING_OP_BITS) - 1)
+
+typedef struct {
+    int fd;
+    // submission queue
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned *sq_mask;
+    unsigned *sq_array;
+    unsigned sq_entries;
+    unsigned sq_local_tail;
+    struct io_uring_sqe *sqes;
+    // completion queue
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned *cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_ring;
+    size_t sq_ring_len;
+    void *cq_ring;
+    size_t cq_ring_len;
+    size_t sqes_len;
+    // buffers the kernel picks from for multishot receives
+    struct io_uring_buf_ring *buf_ring;
+    size_t buf_ring_len;
+    char *buffers;
+    unsigned short buf_tail;
+    /* Requests the full submission queue refused are retried once it has
+     * room: connections in a list, each holding an inflight count so it is
+     * not freed meanwhile, and listeners as a bit mask of their indexes.
+     */
+    server_conn *stalled;
+    unsigned stalled_accepts;
+} uring;
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int uring_enter(uring *u, unsigned to_submit, unsigned min_complete) {
+    const unsigned flags = min_complete > 0 ? IORING_ENTER_GETEVENTS : 0;
+    return (int) syscall(
+        __NR_io_uring_enter, u->fd, to_submit, min_complete, flags, NULL, 0
+    );
+}
+
+static int uring_register(uring *u, unsigned opcode, void *arg, unsigned n) {
+    return (int) syscall(__NR_io_uring_register, u->fd, opcode, arg, n);
+}
+
+// give buffer 'bid' back to the kernel, visible after uring_publish_buffers()
+static void uring_add_buffer(uring *u, unsigned short bid) {
+    struct io_uring_buf *b =
+        &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+    b->addr = (uint64_t) (uintptr_t) (u->buffers + (size_t) bid * URING_BUFFER_SIZE);
+    b->len = URING_BUFFER_SIZE;
+    b->bid = bid;
+    u->buf_tail++;
+}
+
+static void uring_publish_buffers(uring *u) {
+    __atomic_store_n(&u->buf_ring->tail, u->buf_tail, __ATOMIC_RELEASE);
+}
+
+static void uring_free(uring *u) {
+    if (u->buf_ring != NULL) munmap(u->buf_ring, u->buf_ring_len);
+    free(u->buffers);
+    if (u->sqes != NULL) munmap(u->sqes, u->sqes_len);
+    if (u->cq_ring != NULL && u->cq_ring != u->sq_ring) {
+        munmap(u->cq_ring, u->cq_ring_len);
+    }
+    if (u->sq_ring != NULL) munmap(u->sq_ring, u->sq_ring_len);
+    close(u->fd);
+}
+
+static int uring_init(uring *u) {
+    memset(u, 0, sizeof(*u));
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN;
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0) {
+        return -1;
+    }
+
+    u->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    u->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (u->cq_ring_len > u->sq_ring_len) u->sq_ring_len = u->cq_ring_len;
+        u->cq_ring_len = u->sq_ring_len;
+    }
+    u->sq_ring = mmap(NULL, u->sq_ring_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ring == MAP_FAILED) {
+        u->sq_ring = NULL;
+        uring_free(u);
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ring = u->sq_ring;
+    } else {
+        u->cq_ring = mmap(NULL, u->cq_ring_len, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ring == MAP_FAILED) {
+            u->cq_ring = NULL;
+            uring_free(u);
+            return -1;
+        }
+    }
+    u->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    u->sqes = mmap(NULL, u->sqes_len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED) {
+        u->sqes = NULL;
+        uring_free(u);
+        return -1;
+    }
+
+    char *sq = u->sq_ring;
+    char *cq = u->cq_ring;
+    u->sq_head = (unsigned *) (sq + p.sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p.sq_off.array);
+    u->sq_entries = p.sq_entries;
+    u->sq_local_tail = *u->sq_tail;
+    u->cq_head = (unsigned *) (cq + p.cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    // register the ring of provided buffers used by multishot receives
+    u->buf_ring_len = URING_BUFFERS * sizeof(struct io_uring_buf);
+    u->buf_ring = mmap(NULL, u->buf_ring_len, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED) {
+        u->buf_ring = NULL;
+        uring_free(u);
+        return -1;
+    }
+    struct io_uring_buf_reg reg;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) u->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    if (uring_register(u, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+        uring_free(u);
+        return -1;
+    }
+    u->buffers = xmalloc((size_t) URING_BUFFERS * URING_BUFFER_SIZE);
+    unsigned short bid;
+    for (bid = 0; bid < URING_BUFFERS; bid++) {
+        uring_add_buffer(u, bid);
+    }
+    uring_publish_buffers(u);
+    return 0;
+}
+
+// make queued requests visible to the kernel and optionally wait for one
+static int uring_submit(uring *u, unsigned wait) {
+    __atomic_store_n(u->sq_tail, u->sq_local_tail, __ATOMIC_RELEASE);
+    const unsigned pending =
+        u->sq_local_tail - __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (pending == 0 && wait == 0) {
+        return 0;
+    }
+    return uring_enter(u, pending, wait);
+}
+
+static struct io_uring_sqe *uring_get_sqe(uring *u) {
+    unsigned head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+    if (u->sq_local_tail - head >= u->sq_entries) {
+        // the queue is full, hand it to the kernel to make room
+        uring_submit(u, 0);
+        head = __atomic_load_n(u->sq_head, __ATOMIC_ACQUIRE);
+        if (u->sq_local_tail - head >= u->sq_entries) {
+            return NULL;
+        }
+    }
+    const unsigned index = u->sq_local_tail & *u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    u->sq_array[index] = index;
+    u->sq_local_tail++;
+    return sqe;
+}
+
+// retry the operations of 'c' once the submission queue has room
+static void uring_stall(uring *u, server_conn *c) {
+    if (c->stalled) {
+        return;
+    }
+    c->stalled = 1;
+    c->stall_next = u->stalled;
+    u->stalled = c;
+    c->inflight++;
+}
+
+static void uring_accept(uring *u, int index, int fd) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        u->stalled_accepts |= 1u << index;
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = ((uint64_t) index << URING_OP_BITS) | URING_ACCEPT;
+}
+
+static void uring_recv(uring *u, server_conn *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        uring_stall(u, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = c->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_RECV;
+    c->recv_armed = 1;
+    c->inflight++;
+}
+
+// stop the multishot receive of a connection
+static void uring_cancel_recv(uring *u, server_conn *c) {
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        uring_stall(u, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uint64_t) (uintptr_t) c | URING_RECV;
+    sqe->user_data = URING_CANCEL;
+}
+
+static size_t uring_pending_output(server_conn *c) {
+    return buf_pending(&c->out) + buf_pending(&c->send_buf);
+}
+
+// send pending output unless a send is already in flight
+static void uring_flush(uring *u, server_conn *c) {
+    if (c->sending || c->dead) {
+        return;
+    }
+    if (buf_pending(&c->send_buf) == 0) {
+        buffer tmp = c->send_buf;
+        c->send_buf = c->out;
+        c->out = tmp;
+    }
+    if (buf_pending(&c->send_buf) == 0) {
+        return;
+    }
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    if (sqe == NULL) {
+        uring_stall(u, c);
+        return;
+    }
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = c->fd;
+    sqe->addr = (uint64_t) (uintptr_t) (c->send_buf.data + c->send_buf.pos);
+    sqe->len = buf_pending(&c->send_buf);
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->user_data = (uint64_t) (uintptr_t) c | URING_SEND;
+    c->sending = 1;
+    c->inflight++;
+}
+
+/* Close a connection. Operations still in flight are ended by shutting the
+ * socket down, and the connection is freed when the last one completes.
+ */
+static void uring_close_conn(server_conn *c) {
+    if (!c->dead) {
+        c->dead = 1;
+        shutdown(c->fd, SHUT_RDWR);
+    }
+    if (c->inflight == 0) {
+        close(c->fd);
+        server_free_conn(c);
+    }
+}
+
+// resume or pause reading from a connection depending on its pending output
+static void uring_update_recv(uring *u, server_conn *c) {
+    if (c->dead || c->closing) {
+        return;
+    }
+    const int full = uring_pending_output(c) > SERVER_MAX_OUTPUT;
+    if (!c->recv_armed && !full) {
+        uring_recv(u, c);
+    } else if (c->recv_armed && full) {
+        uring_cancel_recv(u, c);
+    }
+}
+
+/* Retry the requests refused by a full submission queue. The receive and
+ * send of a connection are worked out again from its state, since it may
+ * have changed while it waited. Requests still refused stall again.
+ */
+static void uring_resume_stalled(server *srv, uring *u) {
+    server_conn *c = u->stalled;
+    u->stalled = NULL;
+    while (c != NULL) {
+        server_conn *next = c->stall_next;
+        c->stalled = 0;
+        c->inflight--;
+        if (c->dead) {
+            uring_close_conn(c);
+        } else {
+            uring_flush(u, c);
+            uring_update_recv(u, c);
+        }
+        c = next;
+    }
+    const unsigned accepts = u->stalled_accepts;
+    u->stalled_accepts = 0;
+    int i;
+    for (i = 0; i < srv->num_listeners; i++) {
+        if (accepts & (1u << i)) {
+            uring_accept(u, i, srv->listeners[i].fd);
+        }
+    }
+}
+
+static void uring_handle_recv(
+        server *srv,
+        uring *u,
+        server_conn *c,
+        struct io_uring_cqe *cqe
+) {
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        c->recv_armed = 0;
+        c->inflight--;
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        const unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        if (cqe->res > 0 && !c->dead) {
+            buf_append(&c->in, u->buffers + (size_t) bid * URING_BUFFER_SIZE, cqe->res);
+        }
+        uring_add_buffer(u, bid);
+        uring_publish_buffers(u);
+    }
+    if (c->dead) {
+        uring_close_conn(c);
+        return;
+    }
+
+    if (cqe->res > 0) {
+        server_process_input(srv, c);
+        uring_flush(u, c);
+    } else if (cqe->res == 0
+            || (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+        // end of stream or receive error
+        uring_close_conn(c);
+        return;
+    }
+    /* Running out of provided buffers (ENOBUFS) or a cancellation because of
+     * pending output ends the multishot receive, it is armed again when
+     * possible.
+     */
+    if (c->closing && uring_pending_output(c) == 0) {
+        uring_close_conn(c);
+        return;
+    }
+    uring_update_recv(u, c);
+}
+
+static void uring_handle_send(uring *u, server_conn *c, struct io_uring_cqe *cqe) {
+    c->sending = 0;
+    c->inflight--;
+    if (c->dead || cqe->res < 0) {
+        uring_close_conn(c);
+        return;
+    }
+    buf_consume(&c->send_buf, cqe->res);
+    uring_flush(u, c);
+    if (c->closing && uring_pending_output(c) == 0) {
+        uring_close_conn(c);
+        return;
+    }
+    uring_update_recv(u, c);
+}
+
+static void uring_handle_accept(
+        server *srv,
+        uring *u,
+        int index,
+        struct io_uring_cqe *cqe
+) {
+    if (cqe->res >= 0) {
+        server_conn *c = server_new_conn(cqe->res, srv->listeners[index].protocol);
+        uring_recv(u, c);
+    }
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_accept(u, index, srv->listeners[index].fd);
+    }
+}
+
+/* Run the server with io_uring. Listeners use multishot accepts and
+ * connections use multishot receives into buffers provided to the kernel up
+ * front, so a busy connection needs no system call per request beyond the
+ * send of its replies, and all requests are submitted in a single
+ * io_uring_enter() per loop iteration.
+ */
+int server_run_uring(server *srv) {
+    uring u;
+    if (uring_init(&u) < 0) {
+        perror("io_uring");
+        return -1;
+    }
+    int i;
+    for (i = 0; i < srv->num_listeners; i++) {
+        uring_accept(&u, i, srv->listeners[i].fd);
+    }
+    if (srv->master != NULL) {
+        uring_recv(&u, srv->master);
+        uring_flush(&u, srv->master);
+    }
+
+    while (!__atomic_load_n(&server_stop, __ATOMIC_ACQUIRE)) {
+        /* Getting a submission queue entry submits the queue when it is full,
+         * so the retries find room unless the kernel is busy. Requests still
+         * stalled are retried without waiting for a completion.
+         */
+        uring_resume_stalled(srv, &u);
+        const int stalled = u.stalled != NULL || u.stalled_accepts != 0;
+        // EAGAIN and EBUSY mean completions must be reaped before submitting
+        if (uring_submit(&u, stalled ? 0 : 1) < 0
+                && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            perror("io_uring_enter");
+            break;
+        }
+        unsigned head = *u.cq_head;
+        const unsigned tail = __atomic_load_n(u.cq_tail, __ATOMIC_ACQUIRE);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u.cqes[head & *u.cq_mask];
+            const uint64_t data = cqe->user_data;
+            void *ptr = (void *) (uintptr_t) (data & ~(uint64_t) URING_OP_MASK);
+            switch (data & URING_OP_MASK) {
+            case URING_ACCEPT:
+                uring_handle_accept(srv, &u, (int) (data >> URING_OP_BITS), cqe);
+                break;
+            case URING_RECV:
+                uring_handle_recv(srv, &u, ptr, cqe);
+                break;
+            case URING_SEND:
+                uring_handle_send(&u, ptr, cqe);
+                break;
+            default:
+                break;
+            }
+            head++;
+        }
+        __atomic_store_n(u.cq_head, head, __ATOMIC_RELEASE);
+
+        // send the changes made during this iteration to the replicas
+        if (srv->repl_dirty) {
+            srv->repl_dirty = 0;
+            for (i = 0; i < srv->num_replicas; i++) {
+                uring_flush(&u, srv->replicas[i]);
+                uring_update_recv(&u, srv->replicas[i]);
+            }
+        }
+    }
+
+    /* Connections are not tracked outside of the ring, they are released when
+     * the process exits.
+     */
+    uring_free(&u);
+    return 0;
+}
@@ -0,0 +1,426 @@
+// sorted string table export and k-way merge
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "xmalloc.h"
+#include "hash_table.h"
+#include "sstable.h"
+
+#define SST_FOOTER_SIZE (8 + 8 + 4 + 4)
+// block offset and key length, followed by the key
+#define SST_INDEX_ENTRY_SIZE (8 + 4)
+
+static int sst_write(sst_writer *w, const void *buf, size_t len) {
+    if (len > 0 && fwrite(buf, 1, len, w->fp) != len) {
+        return -1;
+    }
+    w->offset += len;
+    return 0;
+}
+
+static int sst_read(sst_reader *r, void *buf, size_t len) {
+    if (len > 0 && fread(buf, 1, len, r->fp) != len) {
+        return -1;
+    }
+    r->pos += len;
+    return 0;
+}
+
+// open a new table for writing, records must be added in ascending key order
+sst_writer *sst_writer_open(const char *path) {
+    sst_writer *w = xcalloc(1, sizeof(sst_writer));
+    /* We write to a temporary file and rename it when the table is complete
+     * so readers never see a partially written table.
+     */
+    w->path = xmalloc(strlen(path) + 5);
+    sprintf(w->path, "%s.tmp", path);
+    w->fp = fopen(w->path, "wb");
+    if (w->fp == NULL) {
+        free(w->path);
+        free(w);
+        return NULL;
+    }
+    return w;
+}
+
+// add a record, a new block is started when the current one is full
+int sst_writer_add(sst_writer *w, const char *key, const char *value) {
+    const uint32_t key_len = strlen(key);
+    const uint32_t value_len = strlen(value);
+
+    if (w->block_count == 0 || w->offset - w->block_start >= SST_BLOCK_SIZE) {
+        if (w->block_count == w->block_cap) {
+            w->block_cap = w->block_cap == 0 ? 16 : w->block_cap * 2;
+            w->block_offsets = xrealloc(
+                w->block_offsets,
+                w->block_cap * sizeof(uint64_t)
+            );
+            w->block_keys = xrealloc(w->block_keys, w->block_cap * sizeof(char*));
+        }
+        w->block_offsets[w->block_count] = w->offset;
+        w->block_keys[w->block_count] = xstrdup(key);
+        w->block_count++;
+        w->block_start = w->offset;
+    }
+
+    if (sst_write(w, &key_len, sizeof(key_len)) < 0
+            || sst_write(w, &value_len, sizeof(value_len)) < 0
+            || sst_write(w, key, key_len) < 0
+            || sst_write(w, value, value_len) < 0) {
+        return -1;
+    }
+    w->count++;
+    return 0;
+}
+
+static void sst_writer_free(sst_writer *w) {
+    uint32_t i;
+    for (i = 0; i < w->block_count; i++) {
+        free(w->block_keys[i]);
+    }
+    free(w->block_keys);
+    free(w->block_offsets);
+    free(w->path);
+    free(w);
+}
+
+// write the block index and footer, then move the table to its final path
+int sst_writer_close(sst_writer *w) {
+    const uint64_t index_offset = w->offset;
+    const uint32_t magic = SST_MAGIC;
+    int err = 0;
+    uint32_t i;
+    for (i = 0; i < w->block_count && err == 0; i++) {
+        const uint32_t key_len = strlen(w->block_keys[i]);
+        err = sst_write(w, &w->block_offsets[i], sizeof(uint64_t))
+            || sst_write(w, &key_len, sizeof(key_len))
+            || sst_write(w, w->block_keys[i], key_len);
+    }
+    if (err == 0) {
+        err = sst_write(w, &index_offset, sizeof(index_offset))
+            || sst_write(w, &w->count, sizeof(w->count))
+            || sst_write(w, &w->block_count, sizeof(w->block_count))
+            || sst_write(w, &magic, sizeof(magic));
+    }
+    if (fclose(w->fp) != 0) {
+        err = 1;
+    }
+
+    // the final path is the temporary path without its ".tmp" suffix
+    char *path = xstrdup(w->path);
+    path[strlen(path) - 4] = '\0';
+    if (err == 0 && rename(w->path, path) != 0) {
+        err = 1;
+    }
+    if (err != 0) {
+        remove(w->path);
+    }
+    free(path);
+    sst_writer_free(w);
+    return err == 0 ? 0 : -1;
+}
+
+// discard a table that could not be written completely
+void sst_writer_abort(sst_writer *w) {
+    fclose(w->fp);
+    remove(w->path);
+    sst_writer_free(w);
+}
+
+// open a table for reading, the block index is loaded in memory
+sst_reader *sst_reader_open(const char *path) {
+    sst_reader *r = xcalloc(1, sizeof(sst_reader));
+    uint32_t magic;
+    long index_end;
+    r->fp = fopen(path, "rb");
+    if (r->fp == NULL) {
+        free(r);
+        return NULL;
+    }
+    /* The footer and the index come from the file and are checked against
+     * its size before anything is allocated from them: the index lies
+     * between 'index_offset' and the footer, and every entry takes at least
+     * an offset and a key length.
+     */
+    if (fseek(r->fp, -SST_FOOTER_SIZE, SEEK_END) != 0
+            || (index_end = ftell(r->fp)) < 0
+            || sst_read(r, &r->index_offset, sizeof(r->index_offset)) < 0
+            || sst_read(r, &r->count, sizeof(r->count)) < 0
+            || sst_read(r, &r->block_count, sizeof(r->block_count)) < 0
+            || sst_read(r, &magic, sizeof(magic)) < 0
+            || magic != SST_MAGIC
+            || r->index_offset > (uint64_t) index_end
+            || r->block_count > (index_end - r->index_offset) / SST_INDEX_ENTRY_SIZE
+            || fseek(r->fp, r->index_offset, SEEK_SET) != 0) {
+        fclose(r->fp);
+        free(r);
+        return NULL;
+    }
+    r->pos = r->index_offset;
+
+    r->block_offsets = xcalloc(r->block_count + 1, sizeof(uint64_t));
+    r->block_keys = xcalloc(r->block_count + 1, sizeof(char*));
+    uint32_t i;
+    for (i = 0; i < r->block_count; i++) {
+        uint32_t key_len;
+        if (sst_read(r, &r->block_offsets[i], sizeof(uint64_t)) < 0
+                || sst_read(r, &key_len, sizeof(key_len)) < 0
+                || r->block_offsets[i] >= r->index_offset
+                || r->pos + key_len > (uint64_t) index_end) {
+            sst_reader_close(r);
+            return NULL;
+        }
+        r->block_keys[i] = xmalloc(key_len + 1);
+        if (sst_read(r, r->block_keys[i], key_len) < 0) {
+            sst_reader_close(r);
+            return NULL;
+        }
+        r->block_keys[i][key_len] = '\0';
+    }
+
+    r->pos = 0;
+    if (fseek(r->fp, 0, SEEK_SET) != 0) {
+        sst_reader_close(r);
+        return NULL;
+    }
+    return r;
+}
+
+static void sst_reserve(char **buf, size_t *cap, size_t len) {
+    if (*cap < len + 1) {
+        *cap = len + 1;
+        *buf = xrealloc(*buf, *cap);
+    }
+}
+
+/* Read the next record into r->key and r->value.
+ *
+ * Returns:
+ *   1  - a record was read
+ *   0  - end of table
+ *   -1 - read error or corrupted table
+ */
+int sst_reader_next(sst_reader *r) {
+    uint32_t key_len, value_len;
+    if (r->pos >= r->index_offset) {
+        return 0;
+    }
+    if (sst_read(r, &key_len, sizeof(key_len)) < 0
+            || sst_read(r, &value_len, sizeof(value_len)) < 0) {
+        return -1;
+    }
+    // a record never runs into the index
+    if ((uint64_t) key_len + value_len > r->index_offset - r->pos) {
+        return -1;
+    }
+    sst_reserve(&r->key, &r->key_cap, key_len);
+    sst_reserve(&r->value, &r->value_cap, value_len);
+    if (sst_read(r, r->key, key_len) < 0
+            || sst_read(r, r->value, value_len) < 0) {
+        return -1;
+    }
+    r->key[key_len] = '\0';
+    r->value[value_len] = '\0';
+    return 1;
+}
+
+void sst_reader_close(sst_reader *r) {
+    uint32_t i;
+    for (i = 0; i < r->block_count; i++) {
+        free(r->block_keys[i]);
+    }
+    free(r->block_keys);
+    free(r->block_offsets);
+    free(r->key);
+    free(r->value);
+    fclose(r->fp);
+    free(r);
+}
+
+/* Return a copy of the value associated with a key, or NULL if the key does
+ * not exist. The block index is binary searched for the last block whose first
+ * key is not greater than 'key', then only that block is scanned.
+ */
+char *sst_search(const char *path, const char *key) {
+    sst_reader *r = sst_reader_open(path);
+    if (r == NULL || r->block_count == 0) {
+        if (r != NULL) sst_reader_close(r);
+        return NULL;
+    }
+
+    int lo = 0;
+    int hi = (int) r->block_count - 1;
+    while (lo < hi) {
+        const int mid = lo + (hi - lo + 1) / 2;
+        if (strcmp(r->block_keys[mid], key) <= 0) {
+            lo = mid;
+        } else {
+            hi = mid - 1;
+        }
+    }
+
+    char *value = NULL;
+    const uint64_t end = (uint32_t) lo + 1 < r->block_count
+        ? r->block_offsets[lo + 1] : r->index_offset;
+    if (fseek(r->fp, r->block_offsets[lo], SEEK_SET) == 0) {
+        r->pos = r->block_offsets[lo];
+        while (r->pos < end && sst_reader_next(r) == 1) {
+            const int cmp = strcmp(r->key, key);
+            if (cmp == 0) {
+                value = xstrdup(r->value);
+                break;
+            }
+            if (cmp > 0) {
+                break;
+            }
+        }
+    }
+    sst_reader_close(r);
+    return value;
+}
+
+static int ht_item_cmp(const void *a, const void *b) {
+    const ht_item *x = *(ht_item * const *) a;
+    const ht_item *y = *(ht_item * const *) b;
+    return strcmp(x->key, y->key);
+}
+
+// write the items of a hash table to a sorted string table at 'path'
+int ht_export_sorted(ht_hash_table *ht, const char *path) {
+    ht_item **items = xmalloc((ht->count + 1) * sizeof(ht_item*));
+    int n = 0;
+    int index = 0;
+    ht_item *item;
+    while ((item = ht_next_item(ht, &index)) != NULL) {
+        items[n++] = item;
+    }
+    qsort(items, n, sizeof(ht_item*), ht_item_cmp);
+
+    sst_writer *w = sst_writer_open(path);
+    if (w == NULL) {
+        free(items);
+        return -1;
+    }
+    int i;
+    int err = 0;
+    for (i = 0; i < n && err == 0; i++) {
+        err = sst_writer_add(w, items[i]->key, items[i]->value);
+    }
+    free(items);
+    if (err != 0) {
+        sst_writer_abort(w);
+        return -1;
+    }
+    return sst_writer_close(w);
+}
+
+// order merge inputs by key, then by position so the last input comes first
+static int sst_heap_less(sst_reader **readers, int a, int b) {
+    const int cmp = strcmp(readers[a]->key, readers[b]->key);
+    return cmp < 0 || (cmp == 0 && a > b);
+}
+
+static void sst_heap_down(int *heap, int size, int i, sst_reader **readers) {
+    for (;;) {
+        const int left = 2 * i + 1;
+        const int right = left + 1;
+        int min = i;
+        if (left < size && sst_heap_less(readers, heap[left], heap[min])) {
+            min = left;
+        }
+        if (right < size && sst_heap_less(readers, heap[right], heap[min])) {
+            min = right;
+        }
+        if (min == i) {
+            return;
+        }
+        const int tmp = heap[i];
+        heap[i] = heap[min];
+        heap[min] = tmp;
+        i = min;
+    }
+}
+
+static void sst_heap_push(int *heap, int *size, int input, sst_reader **readers) {
+    int i = (*size)++;
+    while (i > 0 && sst_heap_less(readers, input, heap[(i - 1) / 2])) {
+        heap[i] = heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap[i] = input;
+}
+
+static int sst_heap_pop(int *heap, int *size, sst_reader **readers) {
+    const int top = heap[0];
+    heap[0] = heap[--(*size)];
+    sst_heap_down(heap, *size, 0, readers);
+    return top;
+}
+
+/* Merge 'n' sorted string tables into a single table at 'path'.
+ *
+ * When the same key is present in several inputs, the value from the input
+ * appearing last in 'paths' is kept. The inputs positioned on a record are
+ * kept in a heap, so each record costs O(log n) comparisons.
+ */
+int sst_merge(const char **paths, int n, const char *path) {
+    sst_reader **readers = xcalloc(n, sizeof(sst_reader*));
+    // inputs holding a record, smallest key first
+    int *heap = xcalloc(n, sizeof(int));
+    int heap_size = 0;
+    int err = 0;
+    int i;
+    for (i = 0; i < n && err == 0; i++) {
+        readers[i] = sst_reader_open(paths[i]);
+        const int status = readers[i] == NULL ? -1 : sst_reader_next(readers[i]);
+        if (status < 0) {
+            err = -1;
+        } else if (status == 1) {
+            sst_heap_push(heap, &heap_size, i, readers);
+        }
+    }
+
+    sst_writer *w = err == 0 ? sst_writer_open(path) : NULL;
+    if (w == NULL) {
+        err = -1;
+    }
+
+    while (err == 0 && heap_size > 0) {
+        const int top = sst_heap_pop(heap, &heap_size, readers);
+        if (sst_writer_add(w, readers[top]->key, readers[top]->value) < 0) {
+            err = -1;
+            break;
+        }
+        // skip the older versions of that key in the other inputs
+        while (err == 0 && heap_size > 0
+                && strcmp(readers[heap[0]]->key, readers[top]->key) == 0) {
+            const int input = sst_heap_pop(heap, &heap_size, readers);
+            const int status = sst_reader_next(readers[input]);
+            if (status < 0) {
+                err = -1;
+            } else if (status == 1) {
+                sst_heap_push(heap, &heap_size, input, readers);
+            }
+        }
+        const int status = sst_reader_next(readers[top]);
+        if (status < 0) {
+            err = -1;
+        } else if (status == 1) {
+            sst_heap_push(heap, &heap_size, top, readers);
+        }
+    }
+
+    if (w != NULL && err != 0) {
+        sst_writer_abort(w);
+    } else if (w != NULL && sst_writer_close(w) < 0) {
+        err = -1;
+    }
+    for (i = 0; i < n; i++) {
+        if (readers[i] != NULL) sst_reader_close(readers[i]);
+    }
+    free(readers);
+    free(heap);
+    return err;
+}
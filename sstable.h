@@ -0,0 +1,65 @@
+#ifndef SSTABLE_HEADER
+#define SSTABLE_HEADER
+
+#include <stdio.h>
+#include <stdint.h>
+#include "hash_table.h"
+
+/* Sorted string table files.
+ *
+ * Records are stored sorted by key in data blocks of roughly
+ * SST_BLOCK_SIZE bytes. Each record is:
+ *   uint32 key_len | uint32 value_len | key | value
+ * The data blocks are followed by an index holding the offset and first key
+ * of every block:
+ *   uint64 offset | uint32 key_len | key
+ * and a fixed-size footer:
+ *   uint64 index_offset | uint64 entry_count | uint32 block_count | uint32 magic
+ * Integers are written in host byte order.
+ */
+
+#define SST_BLOCK_SIZE 4096
+#define SST_MAGIC 0x53535431
+
+typedef struct {
+    FILE *fp;
+    char *path;
+    uint64_t offset;
+    uint64_t block_start;
+    uint64_t count;
+    // index of the first key of every block
+    uint32_t block_count;
+    uint32_t block_cap;
+    uint64_t *block_offsets;
+    char **block_keys;
+} sst_writer;
+
+typedef struct {
+    FILE *fp;
+    uint64_t pos;
+    uint64_t index_offset;
+    uint64_t count;
+    uint32_t block_count;
+    uint64_t *block_offsets;
+    char **block_keys;
+    // current record, valid after a successful sst_reader_next()
+    char *key;
+    char *value;
+    size_t key_cap;
+    size_t value_cap;
+} sst_reader;
+
+sst_writer *sst_writer_open(const char *path);
+int sst_writer_add(sst_writer *w, const char *key, const char *value);
+int sst_writer_close(sst_writer *w);
+void sst_writer_abort(sst_writer *w);
+
+sst_reader *sst_reader_open(const char *path);
+int sst_reader_next(sst_reader *r);
+void sst_reader_close(sst_reader *r);
+
+char *sst_search(const char *path, const char *key);
+int ht_export_sorted(ht_hash_table *ht, const char *path);
+int sst_merge(const char **paths, int n, const char *path);
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef TEST_HEADER
+#define TEST_HEADER
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// stop the test with the failing condition and its location
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+        exit(1); \
+    } \
+} while (0)
+
+#endif
@@ -0,0 +1,121 @@
+// store values in a log-structured store, reopen it and merge it
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <dirent.h>
+#include <unistd.h>
+#include "bitcask.h"
+#include "test.h"
+
+static void check_value(bc_store *bc, const char *key, const char *expected) {
+    char *value = bc_get(bc, key);
+    if (expected == NULL) {
+        CHECK(value == NULL);
+    } else {
+        CHECK(value != NULL && strcmp(value, expected) == 0);
+    }
+    free(value);
+}
+
+static void check_contents(bc_store *bc) {
+    char key[32], value[32];
+    int i;
+    for (i = 0; i < 200; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "second%d", i);
+        check_value(bc, key, i % 3 == 0 ? NULL : value);
+    }
+    check_value(bc, "empty", "");
+}
+
+static void remove_dir(const char *dir) {
+    DIR *d = opendir(dir);
+    CHECK(d != NULL);
+    struct dirent *e;
+    while ((e = readdir(d)) != NULL) {
+        if (e->d_name[0] == '.') continue;
+        unlinkat(dirfd(d), e->d_name, 0);
+    }
+    closedir(d);
+    rmdir(dir);
+}
+
+/* A read of a segment that disappeared fails without creating it again. The
+ * merged segment is indexed from its hint file, so it is not opened before
+ * the read.
+ */
+static void test_missing_segment(const char *dir) {
+    bc_store *bc = bc_open(dir);
+    CHECK(bc != NULL);
+    CHECK(bc_put(bc, "lost", "value") == 0);
+    const int merge_id = bc->active_id + 1;
+    CHECK(bc_merge(bc) == 0);
+    bc_close(bc);
+
+    bc = bc_open(dir);
+    CHECK(bc != NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "%s/%09d.data", dir, merge_id);
+    CHECK(unlink(path) == 0);
+    check_value(bc, "lost", NULL);
+    CHECK(access(path, F_OK) < 0);
+    bc_close(bc);
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_bitcaskXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+
+    bc_store *bc = bc_open(dir);
+    CHECK(bc != NULL);
+    // small segments so the records span several files
+    bc->segment_size = 1024;
+    char key[32], value[32];
+    int i;
+    for (i = 0; i < 200; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "first%d", i);
+        CHECK(bc_put(bc, key, value) == 0);
+    }
+    for (i = 0; i < 200; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "second%d", i);
+        CHECK(bc_put(bc, key, value) == 0);
+    }
+    for (i = 0; i < 200; i += 3) {
+        sprintf(key, "key%d", i);
+        CHECK(bc_delete(bc, key) == 0);
+    }
+    CHECK(bc_put(bc, "empty", "") == 0);
+    CHECK(bc->active_id > 1);
+    check_contents(bc);
+    bc_close(bc);
+
+    // the index is rebuilt from the segments
+    bc = bc_open(dir);
+    CHECK(bc != NULL);
+    check_contents(bc);
+
+    // merging drops overwritten and deleted records but keeps the live ones
+    const int64_t dead_before = bc->dead_bytes;
+    CHECK(dead_before > 0);
+    CHECK(bc_merge(bc) == 0);
+    CHECK(bc->dead_bytes < dead_before);
+    check_contents(bc);
+    bc_close(bc);
+
+    // the index is rebuilt from the hint file of the merged segment
+    bc = bc_open(dir);
+    CHECK(bc != NULL);
+    check_contents(bc);
+    bc_close(bc);
+
+    remove_dir(dir);
+
+    char missing_dir[] = "/tmp/test_bitcaskXXXXXX";
+    CHECK(mkdtemp(missing_dir) != NULL);
+    test_missing_segment(missing_dir);
+    remove_dir(missing_dir);
+    return 0;
+}
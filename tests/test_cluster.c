@@ -0,0 +1,192 @@
+// spread keys over forked servers and survive the failure of one of them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include "server.h"
+#include "cluster.h"
+#include "test.h"
+
+#define NUM_KEYS 10000
+#define MAX_NODES 8
+
+// serve on a Unix socket in a child process
+static pid_t start_node(const char *path) {
+    const pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        // a failed check in the parent must not leave the node running
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        server_config cfg;
+        server_config_init(&cfg);
+        cfg.port = 0;
+        cfg.unix_path = path;
+        _exit(server_run(&cfg) == 0 ? 0 : 1);
+    }
+    return pid;
+}
+
+static void stop_node(pid_t pid, int sig) {
+    int status;
+    CHECK(kill(pid, sig) == 0);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    if (sig == SIGTERM) {
+        CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+}
+
+// connect once the nodes listen
+static cluster *connect_nodes(const char **addrs, int num_nodes) {
+    int i;
+    for (i = 0; i < 500; i++) {
+        cluster *cl = cluster_connect(addrs, num_nodes);
+        if (cl != NULL) {
+            return cl;
+        }
+        usleep(10000);
+    }
+    CHECK(0);
+    return NULL;
+}
+
+/* Adding a node to a cluster of N moves about 1 / (N + 1) of the keys, all of
+ * them to the new node, and the others keep their node. Only the number of
+ * addresses counts, so they may all be the same node.
+ */
+static void test_jump(const char *addr) {
+    const char *addrs[MAX_NODES];
+    int prev[NUM_KEYS];
+    char key[32];
+    int n, i;
+    for (n = 0; n < MAX_NODES; n++) {
+        addrs[n] = addr;
+    }
+    for (n = 1; n <= MAX_NODES; n++) {
+        cluster *cl = connect_nodes(addrs, n);
+        int moved = 0;
+        for (i = 0; i < NUM_KEYS; i++) {
+            sprintf(key, "key:%d", i);
+            const int node = cluster_node_of(cl, key);
+            CHECK(node >= 0 && node < n);
+            // the same cluster always sends a key to the same node
+            CHECK(cluster_node_of(cl, key) == node);
+            if (n > 1 && node != prev[i]) {
+                CHECK(node == n - 1);
+                moved++;
+            }
+            prev[i] = node;
+        }
+        if (n > 1) {
+            CHECK(moved > NUM_KEYS / n / 2 && moved < NUM_KEYS * 3 / n / 2);
+        }
+        cluster_free(cl);
+    }
+}
+
+static void make_key(char *key, char *value, int i) {
+    sprintf(key, "key:%d", i);
+    sprintf(value, "value:%d", i);
+}
+
+/* Multi-key operations over two nodes, then over what is left once one of
+ * them is killed: the keys of the live node are still served and the
+ * operations touching the dead one fail.
+ */
+static void test_two_nodes(const char *dir) {
+    char paths[2][64];
+    pid_t pids[2];
+    const char *addrs[2];
+    int i;
+    for (i = 0; i < 2; i++) {
+        snprintf(paths[i], sizeof(paths[i]), "%s/node%d.sock", dir, i);
+        pids[i] = start_node(paths[i]);
+        addrs[i] = paths[i];
+    }
+    cluster *cl = connect_nodes(addrs, 2);
+
+    static char key_bufs[NUM_KEYS][32], value_bufs[NUM_KEYS][32];
+    static const char *keys[NUM_KEYS], *values[NUM_KEYS];
+    static char *found[NUM_KEYS];
+    int per_node[2] = {0, 0};
+    for (i = 0; i < NUM_KEYS; i++) {
+        make_key(key_bufs[i], value_bufs[i], i);
+        keys[i] = key_bufs[i];
+        values[i] = value_bufs[i];
+        per_node[cluster_node_of(cl, keys[i])]++;
+    }
+    CHECK(per_node[0] > 0 && per_node[1] > 0);
+
+    CHECK(cluster_mset(cl, keys, values, NUM_KEYS) == 0);
+    CHECK(cluster_mget(cl, keys, NUM_KEYS, found) == 0);
+    for (i = 0; i < NUM_KEYS; i++) {
+        CHECK(found[i] != NULL && strcmp(found[i], values[i]) == 0);
+        free(found[i]);
+    }
+
+    // delete the even keys, twice: the second time none exists
+    static const char *even[NUM_KEYS / 2];
+    for (i = 0; i < NUM_KEYS / 2; i++) {
+        even[i] = keys[2 * i];
+    }
+    CHECK(cluster_mdel(cl, even, NUM_KEYS / 2) == NUM_KEYS / 2);
+    CHECK(cluster_mdel(cl, even, NUM_KEYS / 2) == 0);
+    CHECK(cluster_mget(cl, keys, NUM_KEYS, found) == 0);
+    for (i = 0; i < NUM_KEYS; i++) {
+        CHECK((found[i] != NULL) == (i % 2 == 1));
+        free(found[i]);
+    }
+
+    char *value;
+    CHECK(cluster_set(cl, "single", "x") == 0);
+    CHECK(cluster_get(cl, "single", &value) == 1 && strcmp(value, "x") == 0);
+    free(value);
+    CHECK(cluster_del(cl, "single") == 1);
+    CHECK(cluster_get(cl, "single", &value) == 0 && value == NULL);
+
+    stop_node(pids[1], SIGKILL);
+    CHECK(cluster_mget(cl, keys, NUM_KEYS, found) == -1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (cluster_node_of(cl, keys[i]) == 0) {
+            CHECK((found[i] != NULL) == (i % 2 == 1));
+        } else {
+            CHECK(found[i] == NULL);
+        }
+        free(found[i]);
+    }
+    CHECK(cluster_mset(cl, keys, values, NUM_KEYS) == -1);
+    CHECK(cluster_mdel(cl, keys, NUM_KEYS) == -1);
+    for (i = 0; i < NUM_KEYS; i++) {
+        if (cluster_node_of(cl, keys[i]) == 0) {
+            CHECK(cluster_set(cl, keys[i], "again") == 0);
+            CHECK(cluster_get(cl, keys[i], &value) == 1);
+            CHECK(strcmp(value, "again") == 0);
+            free(value);
+            break;
+        }
+    }
+
+    cluster_free(cl);
+    stop_node(pids[0], SIGTERM);
+    for (i = 0; i < 2; i++) {
+        unlink(paths[i]);
+    }
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_clusterXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "%s/jump.sock", dir);
+    const pid_t pid = start_node(path);
+    test_jump(path);
+    stop_node(pid, SIGTERM);
+    unlink(path);
+
+    test_two_nodes(dir);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,150 @@
+// hand a table over to a child process and reject forged snapshots
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include "hash_table.h"
+#include "handoff.h"
+#include "test.h"
+
+#define NUM_KEYS 10000
+
+static int check_table(ht_hash_table *ht) {
+    char key[32], value[32];
+    int i;
+    if (ht == NULL || ht->count != NUM_KEYS) {
+        return 0;
+    }
+    for (i = 0; i < NUM_KEYS; i++) {
+        sprintf(key, "key%d", i);
+        sprintf(value, "value%d", i);
+        const char *found = ht_search(ht, key);
+        if (found == NULL || strcmp(found, value) != 0) {
+            return 0;
+        }
+    }
+    return ht_search(ht, "late") == NULL;
+}
+
+/* The parent fills its table while polling for the child to connect, then
+ * stops and sends it. The child must see the table as it was when sent.
+ */
+static void test_two_processes(void) {
+    char dir[] = "/tmp/test_handoffXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char path[64];
+    snprintf(path, sizeof(path), "%s/handoff.sock", dir);
+
+    ht_hash_table *ht = ht_new();
+    const int listen_fd = ht_handoff_listen(path);
+    CHECK(listen_fd >= 0);
+
+    const pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        close(listen_fd);
+        ht_hash_table *received = ht_handoff_receive(path);
+        _exit(check_table(received) ? 0 : 1);
+    }
+
+    char key[32], value[32];
+    int i = 0;
+    struct pollfd pfd = {listen_fd, POLLIN, 0};
+    while (poll(&pfd, 1, 0) == 0 || i < NUM_KEYS) {
+        if (i < NUM_KEYS) {
+            sprintf(key, "key%d", i);
+            sprintf(value, "value%d", i);
+            ht_insert(ht, key, value);
+            i++;
+        } else {
+            CHECK(poll(&pfd, 1, -1) == 1);
+        }
+    }
+    CHECK(ht_handoff_send(ht, listen_fd) == 0);
+    close(listen_fd);
+    unlink(path);
+    rmdir(dir);
+    // changes after the handoff stay in this process
+    ht_insert(ht, "late", "x");
+
+    int status;
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ht_del_hash_table(ht);
+}
+
+// a memory file holding 'len' bytes of 'data', sealed when 'seal' is set
+static int make_memfd(const void *data, size_t len, int seal) {
+    const int fd = memfd_create("test_handoff", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    CHECK(fd >= 0);
+    CHECK(write(fd, data, len) == (ssize_t) len);
+    if (seal) {
+        CHECK(fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE) == 0);
+    }
+    return fd;
+}
+
+static ht_hash_table *load(const void *data, size_t len, int seal) {
+    const int fd = make_memfd(data, len, seal);
+    ht_hash_table *ht = ht_handoff_load(fd);
+    close(fd);
+    return ht;
+}
+
+static void test_forged(void) {
+    // one record: "k" -> "vv"
+    unsigned char buf[16 + 8 + 3];
+    uint32_t header[4] = {HANDOFF_MAGIC, 0, 1, 0};
+    const uint32_t lens[2] = {1, 2};
+    memcpy(buf, header, 16);
+    memcpy(buf + 16, lens, 8);
+    memcpy(buf + 24, "kvv", 3);
+
+    ht_hash_table *ht = load(buf, sizeof(buf), 1);
+    CHECK(ht != NULL && ht->count == 1);
+    CHECK(strcmp(ht_search(ht, "k"), "vv") == 0);
+    ht_del_hash_table(ht);
+
+    // the sender could still change an unsealed file under the mapping
+    CHECK(load(buf, sizeof(buf), 0) == NULL);
+
+    // a size index past what a table can hold
+    header[1] = 40;
+    memcpy(buf, header, 16);
+    CHECK(load(buf, sizeof(buf), 1) == NULL);
+
+    // a size index much larger than the keys need is not trusted
+    header[1] = HANDOFF_MAX_SIZE_INDEX;
+    memcpy(buf, header, 16);
+    ht = load(buf, sizeof(buf), 1);
+    CHECK(ht != NULL && ht->size_index == 0);
+    ht_del_hash_table(ht);
+
+    // more records than the file can hold
+    header[1] = 0;
+    header[2] = 1000000;
+    memcpy(buf, header, 16);
+    CHECK(load(buf, sizeof(buf), 1) == NULL);
+
+    // a record running past the end of the file
+    header[2] = 1;
+    memcpy(buf, header, 16);
+    CHECK(load(buf, sizeof(buf) - 1, 1) == NULL);
+
+    header[0] = 0;
+    memcpy(buf, header, 16);
+    CHECK(load(buf, sizeof(buf), 1) == NULL);
+}
+
+int main(void) {
+    test_two_processes();
+    test_forged();
+    return 0;
+}
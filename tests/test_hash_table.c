@@ -0,0 +1,186 @@
+// insert, search and delete keys while the table grows and shrinks
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hash_table.h"
+#include "test.h"
+
+#define NUM_KEYS 200000
+
+// keys share a long prefix, so only their characters past 8 tell them apart
+static void make_key(char *key, int i) {
+    sprintf(key, "user:session:%08d", i);
+}
+
+static void test_grow_and_shrink(void) {
+    ht_hash_table *ht = ht_new();
+    const int initial_size = ht->size;
+    char key[32], value[32];
+    int i;
+    for (i = 0; i < NUM_KEYS; i++) {
+        make_key(key, i);
+        sprintf(value, "v%d", i);
+        ht_insert(ht, key, value);
+    }
+    CHECK(ht->count == NUM_KEYS);
+    // the table went through many prime sizes, each of which must terminate
+    CHECK(ht->size > NUM_KEYS);
+    CHECK(ht->resizes >= 10);
+
+    // every key is in its own bucket and found in a few probes
+    ht_table_stats st;
+    ht_stats(ht, 0, &st);
+    CHECK(st.items == NUM_KEYS);
+    CHECK(st.mean_probes < 2.0);
+
+    for (i = 0; i < NUM_KEYS; i++) {
+        make_key(key, i);
+        sprintf(value, "v%d", i);
+        const char *found = ht_search(ht, key);
+        CHECK(found != NULL && strcmp(found, value) == 0);
+    }
+    make_key(key, NUM_KEYS);
+    CHECK(ht_search(ht, key) == NULL);
+
+    // overwriting keeps the count
+    ht_insert(ht, "user:session:00000007", "new");
+    CHECK(ht->count == NUM_KEYS);
+    CHECK(strcmp(ht_search(ht, "user:session:00000007"), "new") == 0);
+
+    for (i = 0; i < NUM_KEYS; i += 2) {
+        make_key(key, i);
+        ht_delete(ht, key);
+    }
+    CHECK(ht->count == NUM_KEYS / 2);
+    for (i = 0; i < NUM_KEYS; i++) {
+        make_key(key, i);
+        CHECK((ht_search(ht, key) != NULL) == (i % 2 == 1));
+    }
+
+    for (i = 1; i < NUM_KEYS; i += 2) {
+        make_key(key, i);
+        ht_delete(ht, key);
+    }
+    CHECK(ht->count == 0);
+    CHECK(ht->size == initial_size);
+    ht_del_hash_table(ht);
+}
+
+// a table created large takes keys without resizing
+static void test_sized(void) {
+    ht_hash_table *ht = ht_new_sized(12);
+    const int size = ht->size;
+    char key[32];
+    int i;
+    for (i = 0; i < size / 2; i++) {
+        make_key(key, i);
+        ht_insert(ht, key, "x");
+    }
+    CHECK(ht->size == size);
+    CHECK(ht->resizes == 0);
+    for (i = 0; i < size / 2; i++) {
+        make_key(key, i);
+        CHECK(ht_search(ht, key) != NULL);
+    }
+    ht_del_hash_table(ht);
+}
+
+/* Deleting old keys while inserting new ones keeps the count low but turns
+ * empty buckets into deleted items; the table must drop them before misses
+ * have no empty bucket left to stop at.
+ */
+static void test_churn(void) {
+    ht_hash_table *ht = ht_new_sized(8);
+    const int size = ht->size;
+    const int live = size / 4;
+    char key[32];
+    int i;
+    for (i = 0; i < live; i++) {
+        make_key(key, i);
+        ht_insert(ht, key, "x");
+    }
+    for (i = live; i < 20 * size; i++) {
+        make_key(key, i - live);
+        ht_delete(ht, key);
+        make_key(key, i);
+        ht_insert(ht, key, "x");
+        CHECK((long) (ht->count + ht->deleted) * 100 / ht->size <= 71);
+    }
+    CHECK(ht->count == live);
+    // the live keys never needed a larger table, only rebuilds
+    CHECK(ht->size == size);
+    CHECK(ht->resizes > 0);
+
+    ht_table_stats st;
+    ht_stats(ht, 0, &st);
+    CHECK(st.buckets - st.items - st.tombstones > size / 4);
+    for (i = 20 * size - live; i < 20 * size; i++) {
+        make_key(key, i);
+        CHECK(ht_search(ht, key) != NULL);
+    }
+    make_key(key, 20 * size);
+    CHECK(ht_search(ht, key) == NULL);
+    ht_del_hash_table(ht);
+}
+
+/* Batched inserts and searches behave as the same calls one at a time: a key
+ * repeated within a batch keeps its last value, a batch may grow the table
+ * halfway, and searches find what ht_search() finds, hits and misses alike.
+ */
+static void test_batch(void) {
+    ht_hash_table *ht = ht_new();
+    const int initial_size = ht->size;
+    static char key_bufs[NUM_KEYS][32], value_bufs[NUM_KEYS][32];
+    static const char *keys[NUM_KEYS], *values[NUM_KEYS];
+    static char *found[NUM_KEYS];
+    int i;
+
+    // the same key three times in one batch
+    const char *same_keys[] = {"dup", "other", "dup", "dup"};
+    const char *same_values[] = {"first", "x", "second", "last"};
+    ht_insert_batch(ht, same_keys, same_values, 4);
+    CHECK(ht->count == 2);
+    CHECK(strcmp(ht_search(ht, "dup"), "last") == 0);
+    CHECK(strcmp(ht_search(ht, "other"), "x") == 0);
+
+    // one call far larger than the table, which grows between groups of keys
+    const int n = 5003;
+    for (i = 0; i < n; i++) {
+        make_key(key_bufs[i], i);
+        sprintf(value_bufs[i], "b%d", i);
+        keys[i] = key_bufs[i];
+        values[i] = value_bufs[i];
+    }
+    ht_insert_batch(ht, keys, values, n);
+    CHECK(ht->count == n + 2);
+    CHECK(ht->size > initial_size);
+    CHECK(ht->resizes > 0);
+    for (i = 0; i < n; i++) {
+        const char *value = ht_search(ht, keys[i]);
+        CHECK(value != NULL && strcmp(value, values[i]) == 0);
+    }
+
+    // odd keys are deleted, and keys past 'n' were never inserted
+    for (i = 1; i < n; i += 2) {
+        ht_delete(ht, keys[i]);
+    }
+    for (i = n; i < 2 * n; i++) {
+        make_key(key_bufs[i], i);
+        keys[i] = key_bufs[i];
+    }
+    ht_search_batch(ht, keys, 2 * n, found);
+    for (i = 0; i < 2 * n; i++) {
+        CHECK(found[i] == ht_search(ht, keys[i]));
+        CHECK((found[i] != NULL) == (i < n && i % 2 == 0));
+    }
+    ht_del_hash_table(ht);
+}
+
+int main(void) {
+    test_grow_and_shrink();
+    test_sized();
+    test_churn();
+    test_batch();
+    return 0;
+}
@@ -0,0 +1,208 @@
+// stream changes from a forked primary to a forked replica
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "server.h"
+#include "cluster.h"
+#include "net.h"
+#include "test.h"
+
+#define NUM_KEYS 1000
+#define BIG_VALUE (1L << 20)
+
+static pid_t start_node(server_config *cfg) {
+    const pid_t pid = fork();
+    CHECK(pid >= 0);
+    if (pid == 0) {
+        // a failed check in the parent must not leave the node running
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        _exit(server_run(cfg) == 0 ? 0 : 1);
+    }
+    return pid;
+}
+
+static void stop_node(pid_t pid) {
+    int status;
+    CHECK(kill(pid, SIGTERM) == 0);
+    CHECK(waitpid(pid, &status, 0) == pid);
+    CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+// a TCP port nothing listens on
+static int free_port(void) {
+    const int fd = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(fd >= 0);
+    CHECK(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    CHECK(getsockname(fd, (struct sockaddr *) &addr, &len) == 0);
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+static cluster *connect_node(const char *addr) {
+    int i;
+    for (i = 0; i < 500; i++) {
+        cluster *cl = cluster_connect(&addr, 1);
+        if (cl != NULL) {
+            return cl;
+        }
+        usleep(10000);
+    }
+    CHECK(0);
+    return NULL;
+}
+
+// wait until the replica has 'expected' for a key, NULL for no value
+static void wait_for(cluster *replica, const char *key, const char *expected) {
+    int i;
+    for (i = 0; i < 500; i++) {
+        char *value;
+        CHECK(cluster_get(replica, key, &value) >= 0);
+        const int same = expected == NULL
+            ? value == NULL
+            : value != NULL && strcmp(value, expected) == 0;
+        free(value);
+        if (same) {
+            return;
+        }
+        usleep(10000);
+    }
+    CHECK(0);
+}
+
+// flush the primary through its memcached port, RESP has no such command
+static void flush_all(int memcache_port) {
+    char addr[32];
+    char reply[8];
+    snprintf(addr, sizeof(addr), "127.0.0.1:%d", memcache_port);
+    const int fd = net_connect(addr);
+    CHECK(fd >= 0);
+    CHECK(write(fd, "flush_all\r\n", 11) == 11);
+    CHECK(read(fd, reply, 4) == 4 && memcmp(reply, "OK\r\n", 4) == 0);
+    close(fd);
+}
+
+static void test_stream(cluster *primary, cluster *replica, int memcache_port) {
+    char key[32], value[32];
+    int i;
+    for (i = 0; i < NUM_KEYS; i++) {
+        sprintf(key, "key:%d", i);
+        sprintf(value, "value:%d", i);
+        CHECK(cluster_set(primary, key, value) == 0);
+    }
+    for (i = 0; i < NUM_KEYS; i += 2) {
+        sprintf(key, "key:%d", i);
+        CHECK(cluster_del(primary, key) == 1);
+    }
+    // changes arrive in order, so once the last one arrived all did
+    sprintf(key, "key:%d", NUM_KEYS - 2);
+    wait_for(replica, key, NULL);
+    for (i = 0; i < NUM_KEYS; i++) {
+        char *found;
+        sprintf(key, "key:%d", i);
+        sprintf(value, "value:%d", i);
+        CHECK(cluster_get(replica, key, &found) == (i % 2 == 1));
+        CHECK(i % 2 == 0 || strcmp(found, value) == 0);
+        free(found);
+    }
+
+    // replicas refuse writes
+    CHECK(cluster_set(replica, "key:0", "x") < 0);
+
+    flush_all(memcache_port);
+    sprintf(key, "key:%d", NUM_KEYS - 1);
+    wait_for(replica, key, NULL);
+    CHECK(cluster_set(primary, "after", "flush") == 0);
+    wait_for(replica, "after", "flush");
+    for (i = 0; i < NUM_KEYS; i++) {
+        char *found;
+        sprintf(key, "key:%d", i);
+        CHECK(cluster_get(replica, key, &found) == 0);
+    }
+}
+
+/* A replica which stops reading is dropped once the changes it did not read
+ * pass the output limit of the primary, while the others keep up.
+ */
+static void test_slow_replica(const char *primary_path, cluster *primary, cluster *replica) {
+    const int fd = net_connect(primary_path);
+    CHECK(fd >= 0);
+    static const char sync[] = "*1\r\n$4\r\nSYNC\r\n";
+    CHECK(write(fd, sync, sizeof(sync) - 1) == sizeof(sync) - 1);
+
+    char *big = malloc(BIG_VALUE + 1);
+    CHECK(big != NULL);
+    int i;
+    for (i = 0; i < 100; i++) {
+        memset(big, 'a' + i % 26, BIG_VALUE);
+        big[BIG_VALUE] = '\0';
+        CHECK(cluster_set(primary, "big", big) == 0);
+    }
+    wait_for(replica, "big", big);
+    free(big);
+
+    // what was sent before the drop is read, then the stream ends
+    struct timeval timeout = {10, 0};
+    CHECK(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == 0);
+    static char buf[1 << 16];
+    ssize_t n;
+    long total = 0;
+    while ((n = read(fd, buf, sizeof(buf))) > 0) {
+        total += n;
+    }
+    CHECK(n == 0);
+    CHECK(total < 100 * BIG_VALUE);
+    close(fd);
+
+    CHECK(cluster_set(primary, "last", "x") == 0);
+    wait_for(replica, "last", "x");
+}
+
+int main(void) {
+    char dir[] = "/tmp/test_replicationXXXXXX";
+    CHECK(mkdtemp(dir) != NULL);
+    char primary_path[64], replica_path[64];
+    snprintf(primary_path, sizeof(primary_path), "%s/primary.sock", dir);
+    snprintf(replica_path, sizeof(replica_path), "%s/replica.sock", dir);
+
+    server_config primary_cfg;
+    server_config_init(&primary_cfg);
+    primary_cfg.port = 0;
+    primary_cfg.unix_path = primary_path;
+    primary_cfg.memcache_port = free_port();
+    const pid_t primary_pid = start_node(&primary_cfg);
+    cluster *primary = connect_node(primary_path);
+
+    server_config replica_cfg;
+    server_config_init(&replica_cfg);
+    replica_cfg.port = 0;
+    replica_cfg.unix_path = replica_path;
+    replica_cfg.replicaof = primary_path;
+    const pid_t replica_pid = start_node(&replica_cfg);
+    cluster *replica = connect_node(replica_path);
+
+    test_stream(primary, replica, primary_cfg.memcache_port);
+    test_slow_replica(primary_path, primary, replica);
+
+    cluster_free(replica);
+    cluster_free(primary);
+    stop_node(replica_pid);
+    stop_node(primary_pid);
+    unlink(primary_path);
+    unlink(replica_path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,214 @@
+// export tables to sorted string tables, search them and merge them
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "hash_table.h"
+#include "sstable.h"
+#include "test.h"
+
+#define NUM_KEYS 5000
+
+static void check_value(const char *path, const char *key, const char *expected) {
+    char *value = sst_search(path, key);
+    if (expected == NULL) {
+        CHECK(value == NULL);
+    } else {
+        CHECK(value != NULL && strcmp(value, expected) == 0);
+    }
+    free(value);
+}
+
+static void temp_path(char *path) {
+    strcpy(path, "/tmp/test_sstableXXXXXX");
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+}
+
+// export a table holding every 'step'th key from 'first' with values "<tag><i>"
+static void export_keys(const char *path, int first, int step, const char *tag) {
+    ht_hash_table *ht = ht_new();
+    char key[32], value[32];
+    int i;
+    for (i = first; i < NUM_KEYS; i += step) {
+        sprintf(key, "k%06d", i);
+        sprintf(value, "%s%d", tag, i);
+        ht_insert(ht, key, value);
+    }
+    CHECK(ht_export_sorted(ht, path) == 0);
+    ht_del_hash_table(ht);
+}
+
+static void test_export_and_search(const char *path) {
+    export_keys(path, 0, 1, "a");
+
+    // records come back sorted, spread over many blocks
+    sst_reader *r = sst_reader_open(path);
+    CHECK(r != NULL);
+    CHECK(r->count == NUM_KEYS);
+    CHECK(r->block_count > 1);
+    char expected[32];
+    int n = 0;
+    while (sst_reader_next(r) == 1) {
+        sprintf(expected, "k%06d", n);
+        CHECK(strcmp(r->key, expected) == 0);
+        n++;
+    }
+    CHECK(n == NUM_KEYS);
+    sst_reader_close(r);
+
+    check_value(path, "k000000", "a0");
+    check_value(path, "k002500", "a2500");
+    check_value(path, "k004999", "a4999");
+    check_value(path, "k", NULL);
+    check_value(path, "k0025005", NULL);
+    check_value(path, "z", NULL);
+}
+
+static void test_empty(const char *path) {
+    ht_hash_table *ht = ht_new();
+    CHECK(ht_export_sorted(ht, path) == 0);
+    ht_del_hash_table(ht);
+    check_value(path, "k000000", NULL);
+}
+
+/* Three inputs overlapping on some keys: the even keys, the multiples of
+ * three and the multiples of five. The value of the last input holding a key
+ * must win.
+ */
+static void test_merge(void) {
+    char inputs[3][32], out[32];
+    int i;
+    for (i = 0; i < 3; i++) {
+        temp_path(inputs[i]);
+    }
+    temp_path(out);
+    export_keys(inputs[0], 0, 2, "a");
+    export_keys(inputs[1], 0, 3, "b");
+    export_keys(inputs[2], 0, 5, "c");
+
+    const char *paths[3] = {inputs[0], inputs[1], inputs[2]};
+    CHECK(sst_merge(paths, 3, out) == 0);
+
+    sst_reader *r = sst_reader_open(out);
+    CHECK(r != NULL);
+    char key[32], value[32];
+    int next = 0;
+    int n = 0;
+    while (sst_reader_next(r) == 1) {
+        // the records are the union of the inputs, in order and without duplicates
+        while (next % 2 != 0 && next % 3 != 0 && next % 5 != 0) {
+            next++;
+        }
+        sprintf(key, "k%06d", next);
+        const char *tag = next % 5 == 0 ? "c" : next % 3 == 0 ? "b" : "a";
+        sprintf(value, "%s%d", tag, next);
+        CHECK(strcmp(r->key, key) == 0);
+        CHECK(strcmp(r->value, value) == 0);
+        next++;
+        n++;
+    }
+    CHECK(r->count == (uint64_t) n);
+    sst_reader_close(r);
+    while (next < NUM_KEYS && next % 2 != 0 && next % 3 != 0 && next % 5 != 0) {
+        next++;
+    }
+    CHECK(next == NUM_KEYS);
+
+    check_value(out, "k000030", "c30");
+    check_value(out, "k000006", "b6");
+    check_value(out, "k000004", "a4");
+    check_value(out, "k000007", NULL);
+
+    // a missing input fails the merge
+    const char *missing[2] = {inputs[0], "/nonexistent/input"};
+    CHECK(sst_merge(missing, 2, out) < 0);
+
+    for (i = 0; i < 3; i++) {
+        unlink(inputs[i]);
+    }
+    unlink(out);
+}
+
+// a one record table, "k" -> "vv", laid out by hand
+struct forged {
+    uint32_t record[2];
+    char record_data[3];
+    uint64_t block_offset;
+    uint32_t index_key_len;
+    char index_key[1];
+    uint64_t index_offset;
+    uint64_t count;
+    uint32_t block_count;
+    uint32_t magic;
+};
+
+static void write_forged(const char *path, const struct forged *f) {
+    FILE *fp = fopen(path, "wb");
+    CHECK(fp != NULL);
+    CHECK(fwrite(f->record, sizeof(f->record), 1, fp) == 1);
+    CHECK(fwrite(f->record_data, sizeof(f->record_data), 1, fp) == 1);
+    CHECK(fwrite(&f->block_offset, 8, 1, fp) == 1);
+    CHECK(fwrite(&f->index_key_len, 4, 1, fp) == 1);
+    CHECK(fwrite(f->index_key, sizeof(f->index_key), 1, fp) == 1);
+    CHECK(fwrite(&f->index_offset, 8, 1, fp) == 1);
+    CHECK(fwrite(&f->count, 8, 1, fp) == 1);
+    CHECK(fwrite(&f->block_count, 4, 1, fp) == 1);
+    CHECK(fwrite(&f->magic, 4, 1, fp) == 1);
+    CHECK(fclose(fp) == 0);
+}
+
+// the footer and the index must not make the reader allocate or read past the file
+static void test_forged(const char *path) {
+    const struct forged valid = {{1, 2}, "kvv", 0, 1, "k", 11, 1, 1, SST_MAGIC};
+    struct forged f = valid;
+    write_forged(path, &f);
+    check_value(path, "k", "vv");
+
+    // an index past the end of the file
+    f.index_offset = 1ULL << 40;
+    write_forged(path, &f);
+    CHECK(sst_reader_open(path) == NULL);
+
+    // more blocks than the index can hold
+    f = valid;
+    f.block_count = 0xffffffff;
+    write_forged(path, &f);
+    CHECK(sst_reader_open(path) == NULL);
+
+    // an index key running past the end of the file
+    f = valid;
+    f.index_key_len = 0xffffffff;
+    write_forged(path, &f);
+    CHECK(sst_reader_open(path) == NULL);
+
+    // a block starting in the index
+    f = valid;
+    f.block_offset = 11;
+    write_forged(path, &f);
+    CHECK(sst_reader_open(path) == NULL);
+
+    // a record running into the index
+    f = valid;
+    f.record[1] = 0xfffffff0;
+    write_forged(path, &f);
+    sst_reader *r = sst_reader_open(path);
+    CHECK(r != NULL);
+    CHECK(sst_reader_next(r) == -1);
+    sst_reader_close(r);
+    check_value(path, "k", NULL);
+}
+
+int main(void) {
+    char path[32];
+    temp_path(path);
+    test_export_and_search(path);
+    test_empty(path);
+    test_forged(path);
+    unlink(path);
+    test_merge();
+    return 0;
+}
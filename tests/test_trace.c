@@ -0,0 +1,122 @@
+// write a trace and read it back
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "trace.h"
+#include "test.h"
+
+static void test_round_trip(const char *path) {
+    ht_trace *t = trace_create(path);
+    CHECK(t != NULL);
+    trace_record(t, TRACE_INSERT, "alpha", 5, 0);
+    trace_record(t, TRACE_SEARCH, "alpha", 0, 1);
+    trace_record(t, TRACE_SEARCH, "beta", 0, 0);
+    trace_record(t, TRACE_DELETE, "alpha", 0, 1);
+    trace_record(t, TRACE_FLUSH, "", 0, 0);
+    CHECK(trace_close(t) == 0);
+
+    trace_reader *r = trace_open(path);
+    CHECK(r != NULL);
+    trace_op op;
+    uint64_t last_ns = 0;
+
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.op == TRACE_INSERT && !op.hit);
+    CHECK(op.key_len == 5 && memcmp(op.key, "alpha", 5) == 0);
+    CHECK(op.value_len == 5);
+    CHECK(op.key_hash == trace_hash("alpha", 5));
+    last_ns = op.time_ns;
+
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.op == TRACE_SEARCH && op.hit);
+    CHECK(op.time_ns >= last_ns);
+    last_ns = op.time_ns;
+
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.op == TRACE_SEARCH && !op.hit);
+    CHECK(op.key_len == 4 && memcmp(op.key, "beta", 4) == 0);
+    CHECK(op.time_ns >= last_ns);
+
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.op == TRACE_DELETE && op.hit);
+
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.op == TRACE_FLUSH && op.key_len == 0);
+
+    CHECK(trace_read(r, &op) == 0);
+    trace_reader_close(r);
+}
+
+static void write_header(const char *path, uint32_t magic, uint32_t version) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    const uint32_t header[2] = {magic, version};
+    CHECK(fwrite(header, sizeof(header), 1, f) == 1);
+    fclose(f);
+}
+
+static void test_header(const char *path) {
+    write_header(path, 0x12345678, TRACE_VERSION);
+    CHECK(trace_open(path) == NULL);
+    write_header(path, TRACE_MAGIC, TRACE_VERSION + 1);
+    CHECK(trace_open(path) == NULL);
+
+    // traces from before TRACE_FLUSH are still read
+    write_header(path, TRACE_MAGIC, 1);
+    trace_reader *r = trace_open(path);
+    CHECK(r != NULL);
+    trace_reader_close(r);
+}
+
+// write the header and a single insert of "k" with the given value length
+static void write_insert(const char *path, uint64_t value_len) {
+    FILE *f = fopen(path, "wb");
+    CHECK(f != NULL);
+    const uint32_t header[2] = {TRACE_MAGIC, TRACE_VERSION};
+    CHECK(fwrite(header, sizeof(header), 1, f) == 1);
+    putc(TRACE_INSERT, f);
+    putc(0, f);
+    const uint32_t hash = trace_hash("k", 1);
+    CHECK(fwrite(&hash, sizeof(hash), 1, f) == 1);
+    putc(1, f);
+    while (value_len >= 0x80) {
+        putc((int) (value_len & 0x7f) | 0x80, f);
+        value_len >>= 7;
+    }
+    putc((int) value_len, f);
+    putc('k', f);
+    fclose(f);
+}
+
+static void test_value_len(const char *path) {
+    trace_op op;
+    write_insert(path, TRACE_MAX_LEN);
+    trace_reader *r = trace_open(path);
+    CHECK(r != NULL);
+    CHECK(trace_read(r, &op) == 1);
+    CHECK(op.value_len == TRACE_MAX_LEN);
+    trace_reader_close(r);
+
+    // a length that would wrap when a replay adds its terminator
+    write_insert(path, UINT64_MAX);
+    r = trace_open(path);
+    CHECK(r != NULL);
+    CHECK(trace_read(r, &op) == -1);
+    trace_reader_close(r);
+}
+
+int main(void) {
+    char path[] = "/tmp/test_traceXXXXXX";
+    const int fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+
+    test_round_trip(path);
+    test_header(path);
+    test_value_len(path);
+
+    unlink(path);
+    return 0;
+}
@@ -0,0 +1,157 @@
+// recording and reading of table operation traces
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "xmalloc.h"
+#include "fnv.h"
+#include "histogram.h"
+#include "trace.h"
+
+// bytes of a record before its key
+#define TRACE_MAX_HEADER (1 + 10 + 4 + 10 + 10)
+
+uint32_t trace_hash(const char *key, size_t len) {
+    return fnv1a_32(key, len);
+}
+
+static size_t trace_put_varint(unsigned char *p, uint64_t v) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        p[n++] = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    p[n++] = (unsigned char) v;
+    return n;
+}
+
+static int trace_get_varint(FILE *f, uint64_t *v) {
+    *v = 0;
+    int shift;
+    for (shift = 0; shift < 64; shift += 7) {
+        const int c = getc(f);
+        if (c == EOF) {
+            return -1;
+        }
+        *v |= (uint64_t) (c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+// create the trace file at 'path', returns NULL if it cannot be written
+ht_trace *trace_create(const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        return NULL;
+    }
+    const uint32_t header[2] = {TRACE_MAGIC, TRACE_VERSION};
+    if (fwrite(header, sizeof(header), 1, f) != 1) {
+        fclose(f);
+        return NULL;
+    }
+    ht_trace *t = xcalloc(1, sizeof(ht_trace));
+    t->file = f;
+    t->last_ns = hist_now_ns();
+    return t;
+}
+
+/* Append a record. The file is locked while the record is timed and written,
+ * so records of concurrent threads stay whole and in time order.
+ */
+void trace_record(ht_trace *t, int op, const char *key, size_t value_len, int hit) {
+    const size_t key_len = strlen(key);
+    unsigned char header[TRACE_MAX_HEADER];
+    size_t n = 0;
+    header[n++] = (unsigned char) (op | (hit ? TRACE_HIT : 0));
+    flockfile(t->file);
+    const uint64_t now = hist_now_ns();
+    n += trace_put_varint(header + n, now - t->last_ns);
+    t->last_ns = now;
+    const uint32_t hash = trace_hash(key, key_len);
+    memcpy(header + n, &hash, sizeof(hash));
+    n += sizeof(hash);
+    n += trace_put_varint(header + n, key_len);
+    n += trace_put_varint(header + n, value_len);
+    fwrite_unlocked(header, 1, n, t->file);
+    fwrite_unlocked(key, 1, key_len, t->file);
+    t->records++;
+    funlockfile(t->file);
+}
+
+// close a trace, returns -1 if some of it could not be written
+int trace_close(ht_trace *t) {
+    int err = ferror(t->file) ? -1 : 0;
+    if (fclose(t->file) != 0) {
+        err = -1;
+    }
+    free(t);
+    return err;
+}
+
+// open a trace for reading, returns NULL if it cannot be read or is invalid
+trace_reader *trace_open(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    uint32_t header[2];
+    if (fread(header, sizeof(header), 1, f) != 1
+            || header[0] != TRACE_MAGIC || header[1] < 1
+            || header[1] > TRACE_VERSION) {
+        fclose(f);
+        return NULL;
+    }
+    trace_reader *r = xcalloc(1, sizeof(trace_reader));
+    r->file = f;
+    return r;
+}
+
+/* Read the next record. Returns 1, 0 at the end of the trace, or -1 if the
+ * record is truncated or corrupt.
+ */
+int trace_read(trace_reader *r, trace_op *op) {
+    const int c = getc(r->file);
+    if (c == EOF) {
+        return ferror(r->file) ? -1 : 0;
+    }
+    op->op = c & ~TRACE_HIT;
+    op->hit = (c & TRACE_HIT) != 0;
+    if (op->op < TRACE_INSERT || op->op > TRACE_FLUSH) {
+        return -1;
+    }
+    uint64_t delta, key_len, value_len;
+    if (trace_get_varint(r->file, &delta) < 0
+            || fread(&op->key_hash, sizeof(op->key_hash), 1, r->file) != 1
+            || trace_get_varint(r->file, &key_len) < 0
+            || trace_get_varint(r->file, &value_len) < 0
+            || key_len > TRACE_MAX_LEN || value_len > TRACE_MAX_LEN) {
+        return -1;
+    }
+    if (key_len + 1 > r->key_cap) {
+        r->key_cap = key_len + 1;
+        r->key = xrealloc(r->key, r->key_cap);
+    }
+    if (fread(r->key, 1, key_len, r->file) != key_len) {
+        return -1;
+    }
+    r->key[key_len] = '\0';
+    if (trace_hash(r->key, key_len) != op->key_hash) {
+        return -1;
+    }
+    r->time_ns += delta;
+    op->time_ns = r->time_ns;
+    op->key = r->key;
+    op->key_len = key_len;
+    op->value_len = value_len;
+    return 1;
+}
+
+void trace_reader_close(trace_reader *r) {
+    fclose(r->file);
+    free(r->key);
+    free(r);
+}
@@ -0,0 +1,65 @@
+#ifndef TRACE_HEADER
+#define TRACE_HEADER
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Binary traces of the operations on a hash table.
+ *
+ * A trace starts with a header:
+ *   uint32 magic | uint32 version
+ * followed by one record per operation:
+ *   uint8 op | varint time_delta | uint32 key_hash | varint key_len | varint value_len | key
+ * 'op' is one of TRACE_INSERT, TRACE_SEARCH, TRACE_DELETE or TRACE_FLUSH, with
+ * TRACE_HIT added for searches that found their key. TRACE_FLUSH removes
+ * every key and has an empty key; it appeared in version 2. The time delta is the number of
+ * nanoseconds since the previous record, the key hash is the 32 bit FNV-1a of
+ * the key, and value_len is the length of the inserted value, 0 for other
+ * operations. Values are not recorded. Varints are LEB128, other integers
+ * are in host byte order.
+ */
+
+#define TRACE_MAGIC 0x48545452
+#define TRACE_VERSION 2
+// longest key or value a reader accepts, longer ones mean a corrupt record
+#define TRACE_MAX_LEN (1 << 30)
+
+enum { TRACE_INSERT = 1, TRACE_SEARCH, TRACE_DELETE, TRACE_FLUSH };
+#define TRACE_HIT 0x80
+
+// recorder, records may be added from several threads
+typedef struct {
+    FILE *file;
+    uint64_t last_ns;
+    unsigned long long records;
+} ht_trace;
+
+typedef struct {
+    int op;
+    int hit;
+    // nanoseconds since the trace was created
+    uint64_t time_ns;
+    uint32_t key_hash;
+    size_t value_len;
+    // valid until the next read
+    const char *key;
+    size_t key_len;
+} trace_op;
+
+typedef struct {
+    FILE *file;
+    uint64_t time_ns;
+    char *key;
+    size_t key_cap;
+} trace_reader;
+
+uint32_t trace_hash(const char *key, size_t len);
+ht_trace *trace_create(const char *path);
+void trace_record(ht_trace *t, int op, const char *key, size_t value_len, int hit);
+int trace_close(ht_trace *t);
+trace_reader *trace_open(const char *path);
+int trace_read(trace_reader *r, trace_op *op);
+void trace_reader_close(trace_reader *r);
+
+#endif
@@ -4,6 +4,16 @@
 #include <sys/types.h>
 #include <string.h>
 #include <stdlib.h>
+#include "probes.h"
+#include "xmalloc.h"
+
+#ifdef HT_COUNTERS
+// shared by all threads, so updated atomically
+static xmalloc_counters counters;
+#define XMALLOC_COUNT(field, n) __atomic_fetch_add(&counters.field, (n), __ATOMIC_RELAXED)
+#else
+#define XMALLOC_COUNT(field, n) ((void) 0)
+#endif
 
 static void *xmalloc_fatal(size_t size) {
     if (size == 0) return NULL;
@@ -14,23 +24,48 @@ static void *xmalloc_fatal(size_t size) {
 void *xmalloc(size_t size) {
     void *ptr = malloc(size);
     if (ptr == NULL) return xmalloc_fatal(size);
+    HT_PROBE(malloc, ptr, size);
+    XMALLOC_COUNT(mallocs, 1);
+    XMALLOC_COUNT(bytes, size);
     return ptr;
 }
 
 void *xcalloc(size_t count, size_t size) {
     void *ptr = calloc(count, size);
     if (ptr == NULL) return xmalloc_fatal(count * size);
+    HT_PROBE(malloc, ptr, count * size);
+    XMALLOC_COUNT(callocs, 1);
+    XMALLOC_COUNT(bytes, count * size);
     return ptr;
 }
 
 void *xrealloc(void *ptr, size_t size) {
     void *p = realloc(ptr, size);
     if (p == NULL) return xmalloc_fatal(size);
+    HT_PROBE(realloc, ptr, p, size);
+    XMALLOC_COUNT(reallocs, 1);
+    XMALLOC_COUNT(bytes, size);
     return p;
 }
 
 char *xstrdup(const char *s) {
-    void *ptr = xmalloc(strlen(s) + 1);
-    strcpy(ptr, s);
+    const size_t size = strlen(s) + 1;
+    XMALLOC_COUNT(strdups, 1);
+    XMALLOC_COUNT(strdup_bytes, size);
+    void *ptr = xmalloc(size);
+    memcpy(ptr, s, size);
     return (char*) ptr;
 }
+
+void xmalloc_get_counters(xmalloc_counters *c) {
+#ifdef HT_COUNTERS
+    c->mallocs = __atomic_load_n(&counters.mallocs, __ATOMIC_RELAXED);
+    c->callocs = __atomic_load_n(&counters.callocs, __ATOMIC_RELAXED);
+    c->reallocs = __atomic_load_n(&counters.reallocs, __ATOMIC_RELAXED);
+    c->strdups = __atomic_load_n(&counters.strdups, __ATOMIC_RELAXED);
+    c->bytes = __atomic_load_n(&counters.bytes, __ATOMIC_RELAXED);
+    c->strdup_bytes = __atomic_load_n(&counters.strdup_bytes, __ATOMIC_RELAXED);
+#else
+    memset(c, 0, sizeof(xmalloc_counters));
+#endif
+}
@@ -1,9 +1,26 @@
 #ifndef XMALLOC_HEADER
 #define XMALLOC_HEADER 1
 
+#include <stddef.h>
+
+/* Allocations made through these functions, only counted when built with
+ * -DHT_COUNTERS and left at zero otherwise. xstrdup() calls count both as
+ * strdups and as mallocs.
+ */
+typedef struct {
+    unsigned long long mallocs;
+    unsigned long long callocs;
+    unsigned long long reallocs;
+    unsigned long long strdups;
+    // bytes requested by all of them
+    unsigned long long bytes;
+    unsigned long long strdup_bytes;
+} xmalloc_counters;
+
 void *xmalloc(size_t size);
 void *xcalloc(size_t count, size_t size);
 void *xrealloc(void *ptr, size_t size);
 char *xstrdup(const char *s);
+void xmalloc_get_counters(xmalloc_counters *counters);
 
 #endif
@@ -0,0 +1,37 @@
+#include <math.h>
+#include "zipf.h"
+
+// takes time proportional to 'n'
+void zipf_init(zipf *z, long n, double theta) {
+    z->n = n;
+    z->theta = theta;
+    if (theta == 0) {
+        return;
+    }
+    double zetan = 0;
+    long i;
+    for (i = 1; i <= n; i++) {
+        zetan += 1 / pow((double) i, theta);
+    }
+    const double zeta2 = 1 + 1 / pow(2, theta);
+    z->zetan = zetan;
+    z->alpha = 1 / (1 - theta);
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    z->half_pow = 1 + pow(0.5, theta);
+}
+
+// rank for a uniform number 'u' in [0, 1)
+long zipf_rank(const zipf *z, double u) {
+    if (z->theta == 0) {
+        return (long) (u * z->n);
+    }
+    const double uz = u * z->zetan;
+    if (uz < 1) {
+        return 0;
+    }
+    if (uz < z->half_pow) {
+        return 1;
+    }
+    const long rank = (long) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+    return rank < z->n ? rank : z->n - 1;
+}
@@ -0,0 +1,20 @@
+#ifndef ZIPF_HEADER
+#define ZIPF_HEADER
+
+/* Zipfian distribution over the ranks [0, n), rank 0 being the most popular,
+ * computed as in Gray et al., "Quickly generating billion-record synthetic
+ * databases". The exponent must be below 1, 0 gives uniform ranks.
+ */
+typedef struct {
+    long n;
+    double theta;
+    double alpha;
+    double zetan;
+    double eta;
+    double half_pow;
+} zipf;
+
+void zipf_init(zipf *z, long n, double theta);
+long zipf_rank(const zipf *z, double u);
+
+#endif